@@ -0,0 +1,148 @@
+#!/bin/bash
+##
+## Written by Amit Sides
+##
+## Compares the echo latency of threaded_echo_server with its threads pinned and unpinned, in every mode
+## (a thread per client, work-stealing workers, green threads). Prints the round trip percentiles and how
+## often the server's threads migrated between CPUs.
+##
+
+SERVER_PORT=12345
+SAMPLE_INTERVAL=0.2             # seconds between migration samples of the server
+
+USAGE="Usage: $0 [-b <build dir>] [-m '<server arguments>']... [-p '<placements>'] [-c <connections>] [-r <msgs/sec>]
+          [-d <seconds>] [-n <noise threads>] [-L <loadgen CPUs>] [-M]
+  Every -m is a mode (threaded_echo_server arguments), replacing the default modes. Placements are space
+  separated -A values, 'none' runs unpinned. -n runs busy loops next to the server, competing for the CPUs,
+  and -L keeps the load generator on these CPUs (taskset), off the server's. -M prints a markdown table."
+
+build_dir=build
+modes=("" "-w 0" "-g 0")
+custom_modes=()
+placements="none pin"
+connections=50
+rate=5000
+duration=5
+noise=0
+loadgen_cpus=
+markdown=false
+
+while getopts "b:m:p:c:r:d:n:L:M" option
+do
+    case $option in
+    b) build_dir=$OPTARG ;;
+    m) custom_modes+=("$OPTARG") ;;
+    p) placements=$OPTARG ;;
+    c) connections=$OPTARG ;;
+    r) rate=$OPTARG ;;
+    d) duration=$OPTARG ;;
+    n) noise=$OPTARG ;;
+    L) loadgen_cpus=$OPTARG ;;
+    M) markdown=true ;;
+    *) echo "$USAGE" >&2; exit 1 ;;
+    esac
+done
+if [ 0 -lt ${#custom_modes[@]} ]
+then
+    modes=("${custom_modes[@]}")
+fi
+
+source "$(dirname "$0")/common.sh"
+require_programs threaded_echo_server chat_loadgen
+
+CSV_HEADER="mode,placement,connections,rate,delivered_per_sec,p50_ms,p99_ms,max_ms,migrations"
+MARKDOWN_HEADER="| mode | placement | connections | rate | delivered/sec | p50 ms | p99 ms | max ms | migrations |"
+MARKDOWN_ALIGNMENT="|---|---|---:|---:|---:|---:|---:|---:|---:|"
+
+# CPU migrations of the server's live threads
+migrations()
+{
+    cat /proc/"$1"/task/*/sched 2>/dev/null | awk '/^se.nr_migrations/ { total += $3 } END { print total + 0 }'
+}
+
+start_noise()
+{
+    noise_pids=()
+    for (( i=0; i < noise; i++ ))
+    do
+        ( while :; do :; done ) &
+        noise_pids+=($!)
+    done
+}
+
+stop_noise()
+{
+    if [ 0 -lt ${#noise_pids[@]} ]
+    then
+        kill "${noise_pids[@]}" 2>/dev/null
+        wait "${noise_pids[@]}" 2>/dev/null
+    fi
+}
+
+cleanup()
+{
+    stop_noise
+}
+
+# run <mode arguments> <placement>
+run()
+{
+    local mode=$1 placement=$2
+    local arguments=() loadgen=()
+    local pid loadgen_pid result start_migrations end_migrations
+
+    if [ none != "$placement" ]
+    then
+        arguments+=(-A "$placement")
+    fi
+    if [ -n "$loadgen_cpus" ]
+    then
+        loadgen=(taskset -c "$loadgen_cpus")
+    fi
+
+    # Word splitting of the mode is intended, it's a list of arguments
+    "$build_dir/threaded_echo_server" $mode "${arguments[@]}" -P latency > /dev/null 2>&1 &
+    pid=$!
+    if ! wait_listening "$SERVER_PORT"
+    then
+        echo "Error: threaded_echo_server $mode ${arguments[*]} is not listening" >&2
+        kill "$pid" 2>/dev/null
+        wait "$pid" 2>/dev/null
+        return 1
+    fi
+
+    start_noise
+    start_migrations=$(migrations "$pid")
+    "${loadgen[@]}" "$build_dir/chat_loadgen" -e -p "$SERVER_PORT" -c "$connections" -i 64 -r "$rate" \
+        -d "$duration" -C > "$result_file" 2>/dev/null &
+    loadgen_pid=$!
+
+    # Sampled while the load runs, the threads per client exit with their clients
+    end_migrations=$start_migrations
+    while kill -0 "$loadgen_pid" 2>/dev/null
+    do
+        end_migrations=$(migrations "$pid")
+        sleep "$SAMPLE_INTERVAL"
+    done
+    wait "$loadgen_pid"
+    result=$(tail -n 1 "$result_file")
+    stop_noise
+
+    kill "$pid" 2>/dev/null
+    wait "$pid" 2>/dev/null
+
+    # clients,ready,rejected,dropped,sent,delivered,delivered_per_sec,fanout_p50_ms,fanout_p99_ms,fanout_max_ms,...
+    IFS=',' read -r -a fields <<< "$result"
+    print_row "${mode:-threads}" "$placement" "$connections" "$rate" "${fields[6]:--}" "${fields[7]:--}" \
+              "${fields[8]:--}" "${fields[9]:--}" $((end_migrations - start_migrations))
+}
+
+print_header
+for mode in "${modes[@]}"
+do
+    for placement in $placements
+    do
+        echo "Running threaded_echo_server ${mode:-(a thread per client)}, placement $placement..." >&2
+        run "$mode" "$placement"
+    done
+done
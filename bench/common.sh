@@ -0,0 +1,80 @@
+#!/bin/bash
+##
+## Written by Amit Sides
+##
+## Shared by the benchmark scripts, sourced after their options are parsed. A script sets CSV_HEADER,
+## MARKDOWN_HEADER and MARKDOWN_ALIGNMENT to its own columns and prints its rows with print_row, in markdown
+## when markdown=true. result_file is a temporary file for the load generator's output, removed on exit.
+##
+
+LISTEN_TIMEOUT=50               # tenths of a second to wait for a server to listen
+
+# require_programs <program>... exits unless every program was built in $build_dir
+require_programs()
+{
+    for program in "$@"
+    do
+        if [ ! -x "$build_dir/$program" ]
+        then
+            echo "Error: $build_dir/$program not found, build first (cmake --build $build_dir)" >&2
+            exit 1
+        fi
+    done
+}
+
+# wait_listening <port> [udp], waits until a TCP socket listens on the port (or a UDP socket is bound to it),
+# without connecting (echo_server serves a single client)
+wait_listening()
+{
+    local port_hex=$(printf ":%04X" "$1")
+    local tables="/proc/net/tcp /proc/net/tcp6"
+    local state="0A"
+
+    if [ udp == "$2" ]
+    then
+        tables="/proc/net/udp /proc/net/udp6"
+        state="07"
+    fi
+
+    for (( i=0; i < LISTEN_TIMEOUT; i++ ))
+    do
+        # Word splitting of the tables is intended
+        if awk -v port="$port_hex" -v state="$state" '$2 ~ port"$" && state == $4 { found=1 } END { exit !found }' \
+               $tables 2>/dev/null
+        then
+            return 0
+        fi
+        sleep 0.1
+    done
+    return 1
+}
+
+print_header()
+{
+    if $markdown
+    then
+        echo "$MARKDOWN_HEADER"
+        echo "$MARKDOWN_ALIGNMENT"
+    else
+        echo "$CSV_HEADER"
+    fi
+}
+
+print_row()
+{
+    if $markdown
+    then
+        echo "| $(IFS='|'; echo "$*" | sed 's/|/ | /g') |"
+    else
+        (IFS=','; echo "$*")
+    fi
+}
+
+# Called on exit, scripts that start more than the server redefine it
+cleanup()
+{
+    :
+}
+
+result_file=$(mktemp)
+trap 'rm -f "$result_file"; cleanup' EXIT
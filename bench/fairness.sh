@@ -0,0 +1,72 @@
+#!/bin/bash
+##
+## Written by Amit Sides
+##
+## Checks that a busy client doesn't starve the others on the work-stealing scheduler: threaded_echo_server
+## runs a single worker, one client floods it while a second client sends one message, which must be echoed
+## within the timeout. Exits with 1 when it isn't, run by ctest.
+##
+
+SERVER_PORT=12345
+MESSAGE="fairness"
+
+USAGE="Usage: $0 [-b <build dir>] [-t <seconds>]
+  -t is how long the second client waits for its echo (2 seconds by default)."
+
+build_dir=build
+timeout_seconds=2
+markdown=false
+
+while getopts "b:t:" option
+do
+    case $option in
+    b) build_dir=$OPTARG ;;
+    t) timeout_seconds=$OPTARG ;;
+    *) echo "$USAGE" >&2; exit 1 ;;
+    esac
+done
+
+source "$(dirname "$0")/common.sh"
+require_programs threaded_echo_server
+
+pids=()
+
+cleanup()
+{
+    for pid in "${pids[@]}"
+    do
+        kill "$pid" 2>/dev/null
+        wait "$pid" 2>/dev/null
+    done
+}
+
+"$build_dir/threaded_echo_server" -w 1 -P latency > /dev/null 2>&1 &
+pids+=($!)
+if ! wait_listening "$SERVER_PORT"
+then
+    echo "Error: threaded_echo_server is not listening" >&2
+    exit 1
+fi
+
+# The flooder keeps its socket readable, and drains the echoes so the worker never waits on a full send buffer
+if ! exec 3<>"/dev/tcp/127.0.0.1/$SERVER_PORT"
+then
+    echo "Error: the flooding client can't connect" >&2
+    exit 1
+fi
+yes flood >&3 2>/dev/null &
+pids+=($!)
+cat <&3 > /dev/null &
+pids+=($!)
+exec 3<&-
+sleep 0.5
+
+if timeout "$timeout_seconds" bash -c "exec 3<>/dev/tcp/127.0.0.1/$SERVER_PORT && echo $MESSAGE >&3 && \
+                                       read -r line <&3 && [ $MESSAGE == \"\$line\" ]" 2>/dev/null
+then
+    echo "Passed: the second client was echoed while the first one flooded the worker"
+    exit 0
+fi
+
+echo "Failed: the second client wasn't echoed within ${timeout_seconds}s while the first one flooded the worker" >&2
+exit 1
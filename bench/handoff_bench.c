@@ -0,0 +1,337 @@
+/**
+ ** Written by Amit Sides
+ **/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "handoff.h"
+
+#define DEFAULT_CONNECTIONS     (10000)
+#define STATE_SIZE              (64)        // per client, about a chat client's name and a short partial message
+#define VERIFY_TIMEOUT_MS       (10000)
+#define UPGRADE_PATH_FORMAT     ("/tmp/handoff_bench.%d.sock")
+
+#define USAGE ("Usage: %s [-c <connections>] [-C]\n" \
+               "  Hands <connections> TCP connections and the listener from one process to another, while a third\n" \
+               "  process keeps connecting. Reports the handoff time, the connections that still answer, and the\n" \
+               "  refused connects (there should be none).\n" \
+               "  -C  print a CSV row\n")
+
+// Filled by the children, printed by the parent
+typedef struct results_s {
+    double takeover_ms;                 // the new process, connect until everything was received
+    int taken_over;
+    int queued_accepted;                // connects that queued during the handoff, accepted by the new process
+    int verified;                       // connections that got the new process' byte
+    int connects;                       // attempted during the handoff
+    int refused;
+} results_t;
+
+static results_t *results = NULL;
+
+static void raise_fd_limit()
+{
+    struct rlimit limit = {0};
+
+    if (0 == getrlimit(RLIMIT_NOFILE, &limit))
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+static void wait_byte(int fd)
+{
+    char byte = 0;
+
+    if (1 != read(fd, &byte, sizeof(byte)))
+    {
+        perror("Failed to wait for the benchmark to start");
+        exit(-1);
+    }
+}
+
+static void signal_byte(int fd)
+{
+    char byte = 1;
+
+    if (1 != write(fd, &byte, sizeof(byte)))
+    {
+        perror("Failed to start the benchmark");
+        exit(-1);
+    }
+}
+
+static int setup_listener(struct sockaddr_in *address)
+{
+    socklen_t address_size = sizeof(*address);
+    int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    address->sin_family = AF_INET;
+    address->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address->sin_port = 0;
+    if (-1 == listen_fd || 0 != bind(listen_fd, (struct sockaddr *)address, sizeof(*address)) ||
+        0 != listen(listen_fd, SOMAXCONN) || 0 != getsockname(listen_fd, (struct sockaddr *)address, &address_size))
+    {
+        perror("Failed to set up the listener");
+        exit(errno);
+    }
+    return listen_fd;
+}
+
+// The clients: connects, then keeps connecting during the handoff until every connection got the new
+// process' byte
+static void run_clients(struct sockaddr_in *address, int connections, int go_fd, int connected_fd)
+{
+    struct pollfd *poll_fds = calloc(connections, sizeof(*poll_fds));
+    struct timespec now = {0};
+    time_t deadline = 0;
+    char byte = 0;
+    int fd = 0;
+
+    if (NULL == poll_fds)
+    {
+        perror("calloc failed");
+        exit(errno);
+    }
+    for(int i=0; i < connections; i++)
+    {
+        poll_fds[i].fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        poll_fds[i].events = POLLIN;
+        if (-1 == poll_fds[i].fd || 0 != connect(poll_fds[i].fd, (struct sockaddr *)address, sizeof(*address)))
+        {
+            perror("Failed to connect a client");
+            exit(errno);
+        }
+    }
+    signal_byte(connected_fd);
+    wait_byte(go_fd);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    deadline = now.tv_sec + VERIFY_TIMEOUT_MS / 1000;
+    while (results->verified < connections && now.tv_sec < deadline)
+    {
+        // A connect while the listener is moving
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        results->connects++;
+        if (0 != connect(fd, (struct sockaddr *)address, sizeof(*address)) && ECONNREFUSED == errno)
+        {
+            results->refused++;
+        }
+        close(fd);
+
+        if (0 < poll(poll_fds, connections, 1))
+        {
+            for(int i=0; i < connections; i++)
+            {
+                if (poll_fds[i].revents && 1 == recv(poll_fds[i].fd, &byte, sizeof(byte), 0))
+                {
+                    results->verified++;
+                    poll_fds[i].fd = -poll_fds[i].fd - 1; // ignored from now on
+                }
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    }
+}
+
+// The new server process: takes over, answers every connection and accepts what queued meanwhile
+static void run_new_server(const char *path, int go_fd, int done_fd)
+{
+    static handoff_t handoff;
+    char state[HANDOFF_STATE_SIZE] = {0};
+    int *client_fds = NULL;
+    int listen_fd = -1;
+    int client_count = 0;
+    uint32_t kind = 0;
+    size_t size = 0;
+    int fd = 0;
+    char byte = '!';
+
+    wait_byte(go_fd);
+    if (!handoff_connect(&handoff, path))
+    {
+        fprintf(stderr, "The old server is not listening on %s\n", path);
+        exit(-1);
+    }
+
+    client_fds = malloc(sizeof(int) * HANDOFF_BATCH);
+    while (handoff_get(&handoff, &kind, &fd, state, &size))
+    {
+        if (HANDOFF_LISTENER == kind)
+        {
+            listen_fd = fd;
+            continue;
+        }
+        if (0 == client_count % HANDOFF_BATCH)
+        {
+            client_fds = realloc(client_fds, sizeof(int) * (client_count + HANDOFF_BATCH));
+        }
+        client_fds[client_count++] = fd;
+    }
+    handoff_done(&handoff);
+    results->takeover_ms = handoff_elapsed_ms(&handoff);
+    results->taken_over = client_count;
+
+    for(int i=0; i < client_count; i++)
+    {
+        send(client_fds[i], &byte, sizeof(byte), MSG_NOSIGNAL);
+    }
+
+    // Serving the listener until the clients are done
+    fcntl(listen_fd, F_SETFL, O_NONBLOCK);
+    fcntl(done_fd, F_SETFL, O_NONBLOCK);
+    while (1 != read(done_fd, &byte, sizeof(byte)))
+    {
+        fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (-1 == fd)
+        {
+            usleep(1000);
+            continue;
+        }
+        results->queued_accepted++;
+        close(fd);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    static handoff_t handoff;
+    struct sockaddr_in address = {0};
+    char path[64] = {0};
+    char state[STATE_SIZE] = {0};
+    int connections = DEFAULT_CONNECTIONS;
+    bool csv = false;
+    int option = 0;
+    int listen_fd = 0;
+    int upgrade_fd = 0;
+    int *client_fds = NULL;
+    int go_pipe[2];
+    int connected_pipe[2];
+    int done_pipe[2];
+    pid_t clients_pid = 0;
+    pid_t server_pid = 0;
+    double handoff_ms = 0;
+
+    while (-1 != (option = getopt(argc, argv, "c:C")))
+    {
+        switch (option)
+        {
+        case 'c': connections = atoi(optarg); break;
+        case 'C': csv = true; break;
+        default:
+            fprintf(stderr, USAGE, argv[0]);
+            return -1;
+        }
+    }
+    if (0 >= connections)
+    {
+        fprintf(stderr, USAGE, argv[0]);
+        return -1;
+    }
+
+    raise_fd_limit();
+    results = mmap(NULL, sizeof(*results), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    client_fds = calloc(connections, sizeof(int));
+    if (MAP_FAILED == results || NULL == client_fds || 0 != pipe(go_pipe) || 0 != pipe(connected_pipe) ||
+        0 != pipe(done_pipe))
+    {
+        perror("Failed to set up the benchmark");
+        exit(errno);
+    }
+
+    snprintf(path, sizeof(path), UPGRADE_PATH_FORMAT, getpid());
+    listen_fd = setup_listener(&address);
+    upgrade_fd = handoff_listen(path);
+
+    // The children are forked before the connections are accepted, so they don't inherit them,
+    // and close the listener, so it only reaches the new server through the handoff
+    clients_pid = fork();
+    if (0 == clients_pid)
+    {
+        close(listen_fd);
+        close(upgrade_fd);
+        run_clients(&address, connections, go_pipe[0], connected_pipe[1]);
+        exit(0);
+    }
+    server_pid = fork();
+    if (0 == server_pid)
+    {
+        close(listen_fd);
+        close(upgrade_fd);
+        run_new_server(path, go_pipe[0], done_pipe[0]);
+        exit(0);
+    }
+
+    // The old server: accepts every client, then hands them off with their state
+    for(int i=0; i < connections; i++)
+    {
+        client_fds[i] = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (-1 == client_fds[i])
+        {
+            perror("Failed to accept a client");
+            exit(errno);
+        }
+    }
+    wait_byte(connected_pipe[0]);
+    fprintf(stderr, "%d clients connected, handing off...\n", connections);
+    signal_byte(go_pipe[1]);
+    signal_byte(go_pipe[1]);
+
+    handoff_accept(&handoff, upgrade_fd);
+    handoff_put(&handoff, HANDOFF_LISTENER, listen_fd, NULL, 0);
+    for(int i=0; i < connections; i++)
+    {
+        snprintf(state, sizeof(state), "client %d", i);
+        handoff_put(&handoff, HANDOFF_CLIENT, client_fds[i], state, sizeof(state));
+    }
+    if (!handoff_finish(&handoff))
+    {
+        exit(-1);
+    }
+    handoff_ms = handoff_elapsed_ms(&handoff);
+
+    // Exiting, as the old server would
+    close(listen_fd);
+    for(int i=0; i < connections; i++)
+    {
+        close(client_fds[i]);
+    }
+
+    waitpid(clients_pid, NULL, 0);
+    signal_byte(done_pipe[1]);
+    waitpid(server_pid, NULL, 0);
+    unlink(path);
+
+    if (csv)
+    {
+        printf("connections,handoff_ms,takeover_ms,taken_over,verified,connects,refused,queued_accepted\n");
+        printf("%d,%.3f,%.3f,%d,%d,%d,%d,%d\n", connections, handoff_ms, results->takeover_ms, results->taken_over,
+               results->verified, results->connects, results->refused, results->queued_accepted);
+        return 0;
+    }
+    printf("Handed off %d connections and the listener in %.3f ms (%.3f ms in the new process)\n",
+           connections, handoff_ms, results->takeover_ms);
+    printf("Taken over: %d, still answering: %d\n", results->taken_over, results->verified);
+    printf("Connects during the handoff: %d, refused: %d, accepted by the new process: %d\n",
+           results->connects, results->refused, results->queued_accepted);
+    return 0;
+}
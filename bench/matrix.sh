@@ -0,0 +1,143 @@
+#!/bin/bash
+##
+## Written by Amit Sides
+##
+## Runs the same workload against every server and prints a matrix of throughput, p99 latency, CPU and RSS.
+## Every server is started alone, driven by chat_loadgen (echo mode for the echo servers), and stopped.
+##
+
+SERVER_PORT=12345
+BROADCAST_SERVER_PORT=12346
+SAMPLE_INTERVAL=0.2             # seconds between CPU and RSS samples of the server
+
+USAGE="Usage: $0 [-b <build dir>] [-S '<servers>'] [-c '<connections>'] [-s '<message sizes>'] [-r '<msgs/sec>']
+          [-d <seconds>] [-P <socket profile>] [-M]
+  Lists are space separated, every combination is run. -M prints a markdown table instead of CSV.
+  Servers: echo_server threaded_echo_server select_chat poll_chat broadcast_server"
+
+build_dir=build
+servers="echo_server threaded_echo_server select_chat poll_chat broadcast_server"
+connections_list="5"            # the chat servers have 6 slots
+sizes_list="32"
+rates_list="1000"
+duration=5
+socket_profile=
+markdown=false
+
+while getopts "b:S:c:s:r:d:P:M" option
+do
+    case $option in
+    b) build_dir=$OPTARG ;;
+    S) servers=$OPTARG ;;
+    c) connections_list=$OPTARG ;;
+    s) sizes_list=$OPTARG ;;
+    r) rates_list=$OPTARG ;;
+    d) duration=$OPTARG ;;
+    P) socket_profile=$OPTARG ;;
+    M) markdown=true ;;
+    *) echo "$USAGE" >&2; exit 1 ;;
+    esac
+done
+
+source "$(dirname "$0")/common.sh"
+require_programs chat_loadgen
+
+CSV_HEADER="server,connections,message_size,rate,joined,sent,delivered_per_sec,p99_ms,incomplete,cpu_percent,rss_kb"
+MARKDOWN_HEADER="| server | connections | size | rate | joined | sent | delivered/sec | p99 ms | incomplete | CPU % | RSS KB |"
+MARKDOWN_ALIGNMENT="|---|---:|---:|---:|---:|---:|---:|---:|---:|---:|---:|"
+
+# Ticks of user + system time, all threads included
+cpu_ticks()
+{
+    awk '{ print $14 + $15 }' "/proc/$1/stat"
+}
+
+peak_rss_kb()
+{
+    awk '/^VmHWM:/ { print $2 }' "/proc/$1/status"
+}
+
+# run <server> <connections> <size> <rate>
+run()
+{
+    local server=$1 connections=$2 size=$3 rate=$4
+    local port=$SERVER_PORT
+    local arguments=()
+    local loadgen_arguments=()
+    local pid loadgen_pid start_ticks end_ticks start_ns end_ns result rss cpu
+
+    case $server in
+    echo_server|threaded_echo_server) loadgen_arguments=(-e) ;;
+    select_chat|poll_chat) ;;
+    broadcast_server) port=$BROADCAST_SERVER_PORT ;;
+    *) echo "Error: unknown server $server" >&2; return 1 ;;
+    esac
+    if [ -n "$socket_profile" ]
+    then
+        arguments+=(-P "$socket_profile")
+    fi
+    if [ broadcast_server == "$server" ]
+    then
+        arguments+=("$port")
+    fi
+
+    "$build_dir/$server" "${arguments[@]}" > /dev/null 2>&1 &
+    pid=$!
+    if ! wait_listening "$port"
+    then
+        echo "Error: $server is not listening on port $port" >&2
+        kill "$pid" 2>/dev/null
+        wait "$pid" 2>/dev/null
+        return 1
+    fi
+
+    start_ticks=$(cpu_ticks "$pid")
+    start_ns=$(date +%s%N)
+    "$build_dir/chat_loadgen" -p "$port" -c "$connections" -s "$size" -r "$rate" -d "$duration" \
+        "${loadgen_arguments[@]}" -C > "$result_file" 2>/dev/null &
+    loadgen_pid=$!
+
+    # Sampled while the load runs, a server may exit when the load generator disconnects (echo_server)
+    while kill -0 "$loadgen_pid" 2>/dev/null && [ -e "/proc/$pid/stat" ]
+    do
+        end_ticks=$(cpu_ticks "$pid")
+        end_ns=$(date +%s%N)
+        rss=$(peak_rss_kb "$pid")
+        sleep "$SAMPLE_INTERVAL"
+    done
+    wait "$loadgen_pid"
+    result=$(tail -n 1 "$result_file")
+
+    kill "$pid" 2>/dev/null
+    wait "$pid" 2>/dev/null
+
+    cpu=$(awk -v ticks=$((end_ticks - start_ticks)) -v hz="$(getconf CLK_TCK)" -v ns=$((end_ns - start_ns)) \
+          'BEGIN { printf "%.1f", ticks / hz * 1e9 / ns * 100 }')
+    if [ -z "$result" ]
+    then
+        # The load generator failed, nobody joined
+        print_row "$server" "$connections" "$size" "$rate" 0 0 0 - - "$cpu" "$rss"
+        return
+    fi
+
+    # clients,ready,rejected,dropped,sent,delivered,delivered_per_sec,fanout_p50_ms,fanout_p99_ms,...,incomplete
+    IFS=',' read -r -a fields <<< "$result"
+    print_row "$server" "$connections" "$size" "$rate" "${fields[1]}" "${fields[4]}" "${fields[6]}" "${fields[8]}" \
+              "${fields[12]}" "$cpu" "$rss"
+}
+
+print_header
+for server in $servers
+do
+    for connections in $connections_list
+    do
+        for size in $sizes_list
+        do
+            for rate in $rates_list
+            do
+                echo "Running $server: $connections connections, $size byte messages, $rate msgs/sec..." >&2
+                run "$server" "$connections" "$size" "$rate"
+            done
+        done
+    done
+done
@@ -0,0 +1,107 @@
+#!/bin/bash
+##
+## Written by Amit Sides
+##
+## Reports the memory threaded_echo_server takes per connection: resident (RSS) and virtual (VSZ), at every
+## connection count, for every mode (a thread per client with the default or a small stack, green threads,
+## work-stealing workers). The clients stay connected and send a message a second, so every stack is touched.
+##
+
+SERVER_PORT=12345
+BACKLOG=4096                    # connection storms, the default profile listens with a backlog of 0
+
+USAGE="Usage: $0 [-b <build dir>] [-c '<connections>'] [-d <seconds>] [-A '<server arguments>']... [-M]
+  Connection counts are space separated. Every -A is a mode (threaded_echo_server arguments), replacing
+  the default modes, e.g. -A '' -A '-s 32 -m 512' -A '-g 2'. -M prints a markdown table instead of CSV.
+  Many connections need ulimit -n, and for threads and green threads vm.max_map_count and kernel.threads-max."
+
+build_dir=build
+connections_list="1000 10000 50000"
+duration=5
+modes=("" "-s 64" "-g 0 -s 64" "-w 0")
+custom_modes=()
+markdown=false
+
+while getopts "b:c:d:A:M" option
+do
+    case $option in
+    b) build_dir=$OPTARG ;;
+    c) connections_list=$OPTARG ;;
+    d) duration=$OPTARG ;;
+    A) custom_modes+=("$OPTARG") ;;
+    M) markdown=true ;;
+    *) echo "$USAGE" >&2; exit 1 ;;
+    esac
+done
+if [ 0 -lt ${#custom_modes[@]} ]
+then
+    modes=("${custom_modes[@]}")
+fi
+
+source "$(dirname "$0")/common.sh"
+require_programs threaded_echo_server chat_loadgen
+
+CSV_HEADER="mode,connections,joined,rss_kb,vsz_kb,rss_kb_per_connection,vsz_kb_per_connection"
+MARKDOWN_HEADER="| mode | connections | joined | RSS KB | VSZ KB | RSS KB/conn | VSZ KB/conn |"
+MARKDOWN_ALIGNMENT="|---|---:|---:|---:|---:|---:|---:|"
+
+# status_kb <pid> <field>, e.g. VmRSS, VmHWM (peak RSS), VmSize, VmPeak (peak VSZ)
+status_kb()
+{
+    awk -v field="$2:" '$1 == field { print $2 }' "/proc/$1/status"
+}
+
+# run <mode arguments> <connections>
+run()
+{
+    local mode=$1 connections=$2
+    local pid result joined base_rss base_vsz peak_rss peak_vsz rss_per vsz_per
+
+    # Word splitting of the mode is intended, it's a list of arguments
+    "$build_dir/threaded_echo_server" $mode -P "default,backlog=$BACKLOG" > /dev/null 2>&1 &
+    pid=$!
+    if ! wait_listening "$SERVER_PORT"
+    then
+        echo "Error: threaded_echo_server $mode is not listening" >&2
+        kill "$pid" 2>/dev/null
+        wait "$pid" 2>/dev/null
+        return 1
+    fi
+    sleep 0.2
+    base_rss=$(status_kb "$pid" VmRSS)
+    base_vsz=$(status_kb "$pid" VmSize)
+
+    # A message per connection per second
+    "$build_dir/chat_loadgen" -e -p "$SERVER_PORT" -c "$connections" -i 256 -r "$connections" -d "$duration" -C \
+        > "$result_file" 2>/dev/null
+    result=$(tail -n 1 "$result_file")
+
+    # The peaks, the server keeps running after the clients left
+    peak_rss=$(status_kb "$pid" VmHWM)
+    peak_vsz=$(status_kb "$pid" VmPeak)
+    kill "$pid" 2>/dev/null
+    wait "$pid" 2>/dev/null
+
+    # clients,ready,...
+    IFS=',' read -r -a fields <<< "$result"
+    joined=${fields[1]:-0}
+    if [ 0 -lt "$joined" ]
+    then
+        rss_per=$(awk -v kb=$((peak_rss - base_rss)) -v n="$joined" 'BEGIN { printf "%.1f", kb / n }')
+        vsz_per=$(awk -v kb=$((peak_vsz - base_vsz)) -v n="$joined" 'BEGIN { printf "%.1f", kb / n }')
+    else
+        rss_per=-
+        vsz_per=-
+    fi
+    print_row "${mode:-threads}" "$connections" "$joined" "$peak_rss" "$peak_vsz" "$rss_per" "$vsz_per"
+}
+
+print_header
+for mode in "${modes[@]}"
+do
+    for connections in $connections_list
+    do
+        echo "Running threaded_echo_server ${mode:-(a thread per client)}: $connections connections..." >&2
+        run "$mode" "$connections"
+    done
+done
@@ -0,0 +1,86 @@
+#!/bin/bash
+##
+## Written by Amit Sides
+##
+## Compares the packets/sec of echo_server's UDP modes: a recvfrom/sendto per datagram (the baseline),
+## recvmmsg/sendmmsg batches and several SO_REUSEPORT sockets, driven by udp_bench.
+##
+
+SERVER_PORT=12345
+
+USAGE="Usage: $0 [-b <build dir>] [-m '<server arguments>']... [-c <sockets>] [-s '<sizes>'] [-w <window>]
+          [-d <seconds>] [-M]
+  Every -m is a mode (echo_server -u arguments), replacing the default modes. Sizes are space separated,
+  -c and -w are udp_bench's sockets and datagrams in flight per socket. -M prints a markdown table."
+
+build_dir=build
+modes=("-b 1" "-b 64" "-b 64 -n 4")
+custom_modes=()
+client_sockets=4
+sizes_list="32 1024"
+window=256
+duration=5
+markdown=false
+
+while getopts "b:m:c:s:w:d:M" option
+do
+    case $option in
+    b) build_dir=$OPTARG ;;
+    m) custom_modes+=("$OPTARG") ;;
+    c) client_sockets=$OPTARG ;;
+    s) sizes_list=$OPTARG ;;
+    w) window=$OPTARG ;;
+    d) duration=$OPTARG ;;
+    M) markdown=true ;;
+    *) echo "$USAGE" >&2; exit 1 ;;
+    esac
+done
+if [ 0 -lt ${#custom_modes[@]} ]
+then
+    modes=("${custom_modes[@]}")
+fi
+
+source "$(dirname "$0")/common.sh"
+require_programs echo_server udp_bench
+
+CSV_HEADER="mode,size,packets_per_sec,megabits_per_sec,lost"
+MARKDOWN_HEADER="| mode | size | packets/sec | Mbit/s | lost |"
+MARKDOWN_ALIGNMENT="|---|---:|---:|---:|---:|"
+
+# run <mode arguments> <size>
+run()
+{
+    local mode=$1 size=$2
+    local pid result
+
+    # Word splitting of the mode is intended, it's a list of arguments
+    "$build_dir/echo_server" -u $mode > /dev/null 2>&1 &
+    pid=$!
+    if ! wait_listening "$SERVER_PORT" udp
+    then
+        echo "Error: echo_server -u $mode is not bound" >&2
+        kill "$pid" 2>/dev/null
+        wait "$pid" 2>/dev/null
+        return 1
+    fi
+
+    "$build_dir/udp_bench" -p "$SERVER_PORT" -c "$client_sockets" -s "$size" -w "$window" -d "$duration" -C \
+        > "$result_file" 2>/dev/null
+    result=$(tail -n 1 "$result_file")
+    kill "$pid" 2>/dev/null
+    wait "$pid" 2>/dev/null
+
+    # sockets,size,window,sent,received,lost,packets_per_sec,megabits_per_sec
+    IFS=',' read -r -a fields <<< "$result"
+    print_row "$mode" "$size" "${fields[6]:--}" "${fields[7]:--}" "${fields[5]:--}"
+}
+
+print_header
+for mode in "${modes[@]}"
+do
+    for size in $sizes_list
+    do
+        echo "Running echo_server -u $mode: $size byte datagrams..." >&2
+        run "$mode" "$size"
+    done
+done
@@ -0,0 +1,239 @@
+/**
+ ** Written by Amit Sides
+ **/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define DEFAULT_IP              ("127.0.0.1")
+#define DEFAULT_PORT            (12345)
+#define DEFAULT_SOCKETS         (4)
+#define DEFAULT_SIZE            (32)
+#define DEFAULT_WINDOW          (32)        // datagrams in flight per socket
+#define DEFAULT_DURATION        (5)
+#define MAX_SIZE                (1472)      // a single Ethernet frame
+#define MAX_WINDOW              (1024)
+#define LOSS_TIMEOUT_US         (10000)     // no reply for this long, the datagrams in flight are lost
+
+#define USAGE ("Usage: %s [-h <ip>] [-p <port>] [-c <sockets>] [-s <datagram size>] [-w <window>] [-d <seconds>] [-C]\n" \
+               "  Keeps <window> datagrams in flight on each of <sockets> UDP sockets (a thread each, different\n" \
+               "  source ports so SO_REUSEPORT spreads them) against a UDP echo server, reporting the echoed\n" \
+               "  packets/sec and the loss.\n" \
+               "  -C  print a CSV row\n")
+
+typedef struct sender_s {
+    pthread_t tid;
+    int fd;
+    uint64_t sent;
+    uint64_t received;
+    uint64_t lost;
+} sender_t;
+
+static int datagram_size = DEFAULT_SIZE;
+static int window = DEFAULT_WINDOW;
+static uint64_t deadline_ns = 0;
+
+static uint64_t now_ns()
+{
+    struct timespec now = {0};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// Sends count datagrams in a single sendmmsg (the payload doesn't matter, the echo is only counted)
+static void send_datagrams(sender_t *sender, struct mmsghdr *messages, int count)
+{
+    int sent = 0;
+    int result = 0;
+
+    while (sent < count)
+    {
+        result = sendmmsg(sender->fd, messages + sent, count - sent, 0);
+        if (-1 == result)
+        {
+            if (EINTR == errno || ENOBUFS == errno || EAGAIN == errno)
+            {
+                continue;
+            }
+            perror("sendmmsg failed");
+            exit(errno);
+        }
+        sent += result;
+    }
+    sender->sent += count;
+}
+
+static void *run_sender(void *sender_data)
+{
+    sender_t *sender = (sender_t *)sender_data;
+    struct mmsghdr messages[MAX_WINDOW];
+    struct iovec vectors[MAX_WINDOW];
+    char *buffers = calloc(window, MAX_SIZE);
+    int received = 0;
+
+    if (NULL == buffers)
+    {
+        perror("calloc failed");
+        exit(errno);
+    }
+    memset(messages, 0, sizeof(messages));
+    for(int i=0; i < window; i++)
+    {
+        vectors[i].iov_base = buffers + i * MAX_SIZE;
+        vectors[i].iov_len = datagram_size;
+        messages[i].msg_hdr.msg_iov = &vectors[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    // Every echo makes room for another datagram, so the window stays full
+    send_datagrams(sender, messages, window);
+    while (now_ns() < deadline_ns)
+    {
+        // The receive buffers are the same ones, every reply is datagram_size (MAX_SIZE available)
+        for(int i=0; i < window; i++)
+        {
+            vectors[i].iov_len = MAX_SIZE;
+        }
+        received = recvmmsg(sender->fd, messages, window, MSG_WAITFORONE, NULL);
+        for(int i=0; i < window; i++)
+        {
+            vectors[i].iov_len = datagram_size;
+        }
+
+        if (-1 == received && (EAGAIN == errno || EWOULDBLOCK == errno))
+        {
+            // Dropped by the server (or its socket's buffer), the window starts over
+            sender->lost += window;
+            send_datagrams(sender, messages, window);
+            continue;
+        }
+        if (-1 == received)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            perror("recvmmsg failed");
+            exit(errno);
+        }
+
+        sender->received += received;
+        send_datagrams(sender, messages, received);
+    }
+    free(buffers);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    struct sockaddr_in server_address = {0};
+    struct timeval timeout = {0, LOSS_TIMEOUT_US};
+    const char *ip = DEFAULT_IP;
+    int port = DEFAULT_PORT;
+    int sockets = DEFAULT_SOCKETS;
+    int duration = DEFAULT_DURATION;
+    bool csv = false;
+    int option = 0;
+    sender_t *senders = NULL;
+    uint64_t start = 0;
+    uint64_t sent = 0;
+    uint64_t received = 0;
+    uint64_t lost = 0;
+    double seconds = 0;
+
+    while (-1 != (option = getopt(argc, argv, "h:p:c:s:w:d:C")))
+    {
+        switch (option)
+        {
+        case 'h': ip = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'c': sockets = atoi(optarg); break;
+        case 's': datagram_size = atoi(optarg); break;
+        case 'w': window = atoi(optarg); break;
+        case 'd': duration = atoi(optarg); break;
+        case 'C': csv = true; break;
+        default:
+            fprintf(stderr, USAGE, argv[0]);
+            return -1;
+        }
+    }
+    if (0 >= sockets || 0 >= datagram_size || MAX_SIZE < datagram_size || 0 >= window || MAX_WINDOW < window ||
+        0 >= duration)
+    {
+        fprintf(stderr, USAGE, argv[0]);
+        return -1;
+    }
+
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons(port);
+    if (1 != inet_pton(AF_INET, ip, &server_address.sin_addr))
+    {
+        perror("inet_pton failed");
+        exit(errno);
+    }
+
+    senders = calloc(sockets, sizeof(*senders));
+    if (NULL == senders)
+    {
+        perror("calloc failed");
+        exit(errno);
+    }
+    for(int i=0; i < sockets; i++)
+    {
+        // Connected, so replies only come from the server and sendmmsg needs no addresses
+        senders[i].fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (-1 == senders[i].fd ||
+            0 != setsockopt(senders[i].fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) ||
+            0 != connect(senders[i].fd, (struct sockaddr *)&server_address, sizeof(server_address)))
+        {
+            perror("Failed to set up a socket");
+            exit(errno);
+        }
+    }
+
+    start = now_ns();
+    deadline_ns = start + (uint64_t)duration * 1000000000ull;
+    for(int i=0; i < sockets; i++)
+    {
+        errno = pthread_create(&senders[i].tid, NULL, run_sender, &senders[i]);
+        if (0 != errno)
+        {
+            perror("Failed to create a sender");
+            exit(errno);
+        }
+    }
+    for(int i=0; i < sockets; i++)
+    {
+        pthread_join(senders[i].tid, NULL);
+        sent += senders[i].sent;
+        received += senders[i].received;
+        lost += senders[i].lost;
+    }
+    seconds = (double)(now_ns() - start) / 1e9;
+
+    if (csv)
+    {
+        printf("sockets,size,window,sent,received,lost,packets_per_sec,megabits_per_sec\n");
+        printf("%d,%d,%d,%lu,%lu,%lu,%.0f,%.1f\n", sockets, datagram_size, window, sent, received, lost,
+               received / seconds, received * datagram_size * 8 / seconds / 1e6);
+        return 0;
+    }
+    printf("Sent %lu datagrams of %d bytes on %d sockets (%d in flight each)\n", sent, datagram_size, sockets, window);
+    printf("Echoed: %lu (%.0f packets/sec, %.1f Mbit/s), lost: %lu\n", received, received / seconds,
+           received * datagram_size * 8 / seconds / 1e6, lost);
+    return 0;
+}
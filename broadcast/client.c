@@ -13,28 +13,52 @@
 #include <termios.h>
 #include <errno.h>
 #include <poll.h>
+#include <getopt.h>
+#include <time.h>
 
 #include "common.h"
+#include "discovery.h"
+#include "metrics.h"
+#include "renderer.h"
 
 #define SERVER_IP  ("127.0.0.1")
 
-#define USAGE       ("%s <name>\n")
+#define USAGE       ("%s [-f] [-m] [-n] [-l] [-c <cache file>] [-t <cache ttl>] " \
+                     "[-g <multicast group> [-i <interface>] [-T <multicast ttl>]] <name>\n" \
+                     "  -f  connect to the first server that answers\n" \
+                     "  -m  choose the server manually, instead of the less loaded of two random ones\n" \
+                     "  -n  don't use the discovery cache\n" \
+                     "  -l  keep the cache up to date with the servers' announcements\n" \
+                     "  -g  discover with multicast instead of a broadcast\n")
 #define ERASE_LINE  ("\33[2K\r")
+#define PROMPT      ("Message: ")
+#define READ_SIZE   (1024) // pasted text is read at once
 
-#define BROADCAST_TIMEOUT (1)
+#define FAILOVER_TIMEOUT    (5000) // ms of looking for another server before giving up
+
+typedef struct cursor_s {
+    uint32_t origin;
+    uint64_t sequence;
+} cursor_t;
 
 char input_buffer[MAX_MESSAGE_SIZE + 1] = {0};
 int input_index = 0;
+renderer_t renderer;
+
+// The session, resumed on another server when the connected one dies
+char *client_name = NULL;
+server_info_t connected_server = {0};
+cursor_t cursors[MAX_ORIGINS] = {0};
+int cursor_count = 0;
+
+// A sequence tag may be split between reads
+bool in_tag = false;
+char tag[32] = {0};
+int tag_length = 0;
 
 void print_buffer()
 {
-    int i=0;
-    printf("Message: ");
-
-    for (; i < input_index; i++)
-    {
-        printf("%c", input_buffer[i]);
-    }
+    renderer_line(&renderer, PROMPT, input_buffer, input_index);
 }
 
 void reset_terminal()
@@ -108,17 +132,17 @@ int setup_connection(char *ip, int port)
     if (0 != connect(socket_fd, (struct sockaddr *)&server_address, sizeof(server_address)))
     {
         perror("connect failed");
-        exit(errno);
+        close(socket_fd);
+        return -1;
     }
 
+    snprintf(connected_server.ip, sizeof(connected_server.ip), "%s", ip);
+    connected_server.port = port;
     return socket_fd;
 }
 
-void handle_character_input(int socket_fd)
+void handle_character(int socket_fd, char character)
 {
-    unsigned character = 0;
-
-    character = getchar();
     switch(character)
     {
         case 127: // backspace
@@ -138,11 +162,13 @@ void handle_character_input(int socket_fd)
 
             // Send current message
             input_buffer[input_index++] = character;
-            if (-1 == send(socket_fd, input_buffer, input_index, 0))
+            if (-1 == send(socket_fd, input_buffer, input_index, MSG_NOSIGNAL))
             {
+                // The server died, the failover starts with the next read
+                renderer_flush(&renderer, true);
                 printf(ERASE_LINE);
+                renderer_invalidate(&renderer);
                 perror("send failed");
-                exit(errno);
             }
             input_index = 0;
             break;
@@ -154,12 +180,93 @@ void handle_character_input(int socket_fd)
             }
             input_buffer[input_index++] = character;
     }
+}
+
+void handle_character_input(int socket_fd)
+{
+    char characters[READ_SIZE] = {0};
+    ssize_t bytes_read = 0;
+
+    bytes_read = read(STDIN_FILENO, characters, sizeof(characters));
+    if (0 >= bytes_read)
+    {
+        renderer_flush(&renderer, true);
+        printf(ERASE_LINE);
+        perror("read failed");
+        exit(errno);
+    }
 
-    printf(ERASE_LINE);
+    for(ssize_t i=0; i < bytes_read; i++)
+    {
+        handle_character(socket_fd, characters[i]);
+    }
     print_buffer();
 }
 
-void handle_message(int socket_fd)
+// Remembers the last message seen of every origin, for resuming the session
+void record_tag()
+{
+    unsigned int origin = 0;
+    unsigned long sequence = 0;
+    int i = 0;
+
+    tag[tag_length] = '\0';
+    if (2 != sscanf(tag, "%x:%lu", &origin, &sequence))
+    {
+        return;
+    }
+
+    for (; i < cursor_count && cursors[i].origin != origin; i++);
+    if (i == cursor_count)
+    {
+        if (MAX_ORIGINS <= cursor_count)
+        {
+            return;
+        }
+        cursor_count++;
+        cursors[i].origin = origin;
+        cursors[i].sequence = 0;
+    }
+    if (cursors[i].sequence < sequence)
+    {
+        cursors[i].sequence = sequence;
+    }
+}
+
+// Prints the messages, taking the sequence tags out
+void print_messages(char *buffer, int length)
+{
+    char *span = buffer;
+
+    for (char *current = buffer; current < buffer + length; current++)
+    {
+        if (SEQUENCE_TAG == *current)
+        {
+            if (!in_tag)
+            {
+                renderer_print(&renderer, span, current - span);
+            }
+            else
+            {
+                record_tag();
+            }
+            in_tag = !in_tag;
+            tag_length = 0;
+            span = current + 1;
+        }
+        else if (in_tag && tag_length < sizeof(tag) - 1)
+        {
+            tag[tag_length++] = *current;
+        }
+    }
+    if (!in_tag)
+    {
+        renderer_print(&renderer, span, buffer + length - span);
+    }
+}
+
+// Returns false when the connection to the server was lost
+bool handle_message(int socket_fd)
 {
     int bytes_recv = 0;
     char buffer[MAX_MESSAGE_SIZE] = {0};
@@ -168,23 +275,46 @@ void handle_message(int socket_fd)
     switch(bytes_recv)
     {
         case -1:
-            printf(ERASE_LINE);
-            perror("recv failed");
-            exit(errno);
         case 0:
+            renderer_flush(&renderer, true);
             printf(ERASE_LINE);
             fprintf(stderr, "Connection closed :(\n");
-            exit(errno);
+            return false;
         default:
             break;
     }
 
-    printf(ERASE_LINE);
-    printf("%s", buffer);
+    print_messages(buffer, bytes_recv);
     print_buffer();
+    return true;
+}
+
+// Names the client, with the cursors of the session when resuming it
+void send_session(int socket_fd, bool resume)
+{
+    char session[MAX_MESSAGE_SIZE] = {0};
+    int length = 0;
+
+    length = snprintf(session, sizeof(session), "%s%s", resume ? RESUME_COMMAND : SESSION_COMMAND, client_name);
+    for(int i=0; resume && i < cursor_count && length < sizeof(session); i++)
+    {
+        length += snprintf(session + length, sizeof(session) - length, " %08x:%lu", cursors[i].origin, cursors[i].sequence);
+    }
+    if (sizeof(session) - 1 <= length)
+    {
+        length = sizeof(session) - 2;
+    }
+    session[length++] = '\n';
+
+    if (-1 == send(socket_fd, session, length, MSG_NOSIGNAL))
+    {
+        perror("Failed to send name");
+        exit(errno);
+    }
 }
 
-void handle_client_connection(int socket_fd)
+// Returns false when the connection to the server was lost
+bool handle_client_connection(int socket_fd)
 {
     struct pollfd pollfds[2] = {0};
     int poll_result = 0;
@@ -195,7 +325,8 @@ void handle_client_connection(int socket_fd)
     pollfds[1].fd = socket_fd;
     pollfds[1].events = POLLIN;
 
-    poll_result = poll(pollfds, sizeof(pollfds) / sizeof(*pollfds), 0);
+    // Waiting for input, or for the next frame
+    poll_result = poll(pollfds, sizeof(pollfds) / sizeof(*pollfds), renderer_timeout(&renderer));
     switch(poll_result)
     {
         case -1:
@@ -204,21 +335,29 @@ void handle_client_connection(int socket_fd)
             perror("poll failed");
             exit(errno);
         case 0:
-            // timeout occurred, just exit
-            return;
+            // timeout occurred, time for a frame
+            renderer_flush(&renderer, false);
+            return true;
         default:
             break;
     }
 
     // First, check for an error
-    if ((pollfds[0].revents & POLLHUP) || (pollfds[0].revents & POLLERR) || (pollfds[0].revents & POLLNVAL) ||
-        (pollfds[1].revents & POLLHUP) || (pollfds[1].revents & POLLERR) || (pollfds[1].revents & POLLNVAL))
+    if ((pollfds[0].revents & POLLHUP) || (pollfds[0].revents & POLLERR) || (pollfds[0].revents & POLLNVAL))
     {
         // One of the file descriptors got an error
         printf(ERASE_LINE);
         fprintf(stderr, "A file descriptor got an error :(\n");
         exit(-1);
     }
+    if ((pollfds[1].revents & POLLHUP) || (pollfds[1].revents & POLLERR) || (pollfds[1].revents & POLLNVAL))
+    {
+        // The server reset the connection
+        renderer_flush(&renderer, true);
+        printf(ERASE_LINE);
+        fprintf(stderr, "Connection closed :(\n");
+        return false;
+    }
 
     // Either we got a message, or an input from stdin, or both
     if (pollfds[0].revents & POLLIN)
@@ -226,163 +365,271 @@ void handle_client_connection(int socket_fd)
         // Input from stdin
         handle_character_input(socket_fd);
     }
-    if (pollfds[1].revents & POLLIN)
+    if ((pollfds[1].revents & POLLIN) && !handle_message(socket_fd))
     {
-        // message from socket
-        handle_message(socket_fd);
+        // message from socket, or the connection was lost
+        return false;
     }
+
+    renderer_flush(&renderer, false);
+    return true;
 }
 
-int send_broadcast(int port, char *message, size_t message_size)
+// Lets the user choose one of the discovered servers (or picks the first one)
+server_info_t *select_server(server_list_t *list, bool manual)
 {
-    struct sockaddr_in broadcast_address = {0};
+    int server_index = 1;
 
-    int sender_fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
-    if (-1 == sender_fd)
+    if (!manual)
     {
-        perror("socket");
-        exit(errno);
+        return pick_server(list);
     }
 
-    int enabled = 1;
-    if (0 != setsockopt(sender_fd, SOL_SOCKET, SO_BROADCAST, &enabled, sizeof(enabled)))
+    // Let the user choose a server, unless there is only one to choose from
+    while (1 < list->count)
     {
-        perror("Failed to set SO_REUSEADDR");
-        exit(errno);
+        printf("Select a server: ");
+        fflush(stdout);
+        if (1 != scanf("%d", &server_index))
+        {
+            // Not a number, dropping the rest of the line
+            scanf("%*s");
+            continue;
+        }
+        if (0 < server_index && server_index <= list->count)
+        {
+            break;
+        }
     }
 
-    broadcast_address.sin_family = AF_INET;
-    broadcast_address.sin_port=htons(port);
-    broadcast_address.sin_addr.s_addr=htonl(INADDR_BROADCAST);
+    return &list->servers[server_index - 1];
+}
 
-    // Best Effort
-    sendto(sender_fd, message, message_size, 0,
-           (struct sockaddr *)&broadcast_address, sizeof(broadcast_address));
+// Connects to a recently seen server from the cache, invalidating the ones that can't be reached.
+// Returns the connected socket, or -1 when there is no cached server to use.
+int connect_cached_server(const char *cache_path, int ttl)
+{
+    server_list_t cached = {0};
+    server_info_t *server = NULL;
+    int socket_fd = -1;
 
-    return sender_fd;
+    cache_load(cache_path, ttl, &cached);
+
+    // Trying the less loaded of two cached servers, then the rest from the most recently seen
+    server = pick_server(&cached);
+    if (NULL != server)
+    {
+        socket_fd = setup_connection(server->ip, server->port);
+        if (-1 == socket_fd)
+        {
+            cache_invalidate(cache_path, ttl, server);
+        }
+    }
+    for(int i=0; i < cached.count && -1 == socket_fd; i++)
+    {
+        if (&cached.servers[i] == server)
+        {
+            continue;
+        }
+        socket_fd = setup_connection(cached.servers[i].ip, cached.servers[i].port);
+        if (-1 == socket_fd)
+        {
+            cache_invalidate(cache_path, ttl, &cached.servers[i]);
+        }
+    }
+
+    server_list_free(&cached);
+    return socket_fd;
 }
 
-int get_server(char *ip)
+int connect_discovered_server(const char *cache_path, int ttl, bool connect_first, bool manual)
 {
-    char buffer[MAX_MESSAGE_SIZE] = {0};
-    struct sockaddr_in server_address = {0};
-    socklen_t server_address_size = sizeof(server_address);
-    char **ips = NULL;
-    int *ports = NULL;
-    int counter = 0;
-    int bytes_recv = 0;
-    int server_index = 0;
-    int server_port = 0;
-
-    int broadcast_fd = send_broadcast(BROADCAST_PORT, BROADCAST_DISCOVER_MESSAGE, sizeof(BROADCAST_DISCOVER_MESSAGE));
+    server_list_t list = {0};
+    server_info_t *server = NULL;
+    int socket_fd = -1;
 
     printf("Searching for servers...\n");
-    sleep(BROADCAST_TIMEOUT);
-    do
+    discover_servers(&list, connect_first, true);
+    if (0 == list.count)
     {
-        bytes_recv = recvfrom(broadcast_fd, buffer, sizeof(buffer), MSG_DONTWAIT,
-                              (struct sockaddr *)&server_address, &server_address_size);
-        if (0 < bytes_recv)
-        {
-            // We received an answer!
-            if (0 != strncmp(buffer, BROADCAST_ANSWER_MESSAGE, sizeof(BROADCAST_ANSWER_MESSAGE)-1))
-            {
-                // Invalid answer :(
-                continue;
-            }
+        fprintf(stderr, "No chat servers were found :(\n");
+        exit(-1);
+    }
+    if (NULL != cache_path)
+    {
+        cache_save(cache_path, ttl, &list);
+    }
 
-            // The answer is in the format of "ANSWER:<port>"
+    server = select_server(&list, manual && !connect_first);
+    socket_fd = setup_connection(server->ip, server->port);
+    if (-1 == socket_fd)
+    {
+        exit(errno);
+    }
 
-            // Increase ips & ports tables
-            counter++;
-            ips = realloc(ips, counter * sizeof(*ips));
-            ports = realloc(ports, counter * sizeof(*ports));
-            if (NULL == ips || NULL == ports)
-            {
-                perror("realloc failed");
-                exit(errno);
-            }
-            ips[counter-1] = malloc(IPV4_SIZE);
-            if (NULL == ips[counter-1])
-            {
-                perror("malloc failed");
-                exit(errno);
-            }
+    server_list_free(&list);
+    return socket_fd;
+}
 
+// Connects to another server and resumes the session there
+int failover(const char *cache_path, int ttl)
+{
+    server_list_t list = {0};
+    server_info_t *server = NULL;
+    uint64_t start = metrics_now_ms();
+    int socket_fd = -1;
+
+    if (NULL != cache_path)
+    {
+        cache_invalidate(cache_path, ttl, &connected_server);
+    }
+
+    // A tag cut by the dead connection is dropped
+    in_tag = false;
+    tag_length = 0;
 
-            ports[counter-1] = atoi(&buffer[sizeof(BROADCAST_ANSWER_MESSAGE)]);
-            if (0 == ports[counter-1] ||
-                NULL == inet_ntop(AF_INET, &server_address.sin_addr, ips[counter-1], IPV4_SIZE))
+    while (-1 == socket_fd && metrics_now_ms() - start < FAILOVER_TIMEOUT)
+    {
+        if (NULL != cache_path)
+        {
+            socket_fd = connect_cached_server(cache_path, ttl);
+            if (-1 != socket_fd)
             {
-                perror("inet_ntop failed");
-                counter--;
-                free(ips[counter]);
+                break;
             }
         }
-    } while(EWOULDBLOCK != errno && EAGAIN != errno && -1 != bytes_recv);
 
-    // Displaying answers to the user and let him choose server
-    printf("\nFound chat servers:\n");
-    for(int i=0; i<counter; i++)
-    {
-        printf("%d. %s:%d\n", i+1, ips[i], ports[i]);
+        // Any server will do, the first one to answer is the fastest failover
+        discover_servers(&list, true, false);
+        server = pick_server(&list);
+        if (NULL != server)
+        {
+            socket_fd = setup_connection(server->ip, server->port);
+        }
+        server_list_free(&list);
     }
-    do
-    {
-        printf("Select a server: ");
-        fflush(stdout);
-        scanf("%d", &server_index);
-    } while(server_index<=0 || server_index>counter);
-
-    // Saving selected server data
-    memcpy(ip, ips[server_index-1], IPV4_SIZE);
-    server_port = ports[server_index-1];
-
-    // Freeing all the malloc'd data
-    for(int i=0; i<counter; i++)
+    if (-1 == socket_fd)
     {
-        free(ips[i]);
+        fprintf(stderr, "No chat servers were found :(\n");
+        exit(-1);
     }
-    free(ips);
-    free(ports);
-    return server_port;
+
+    send_session(socket_fd, true);
+    printf("Failed over to %s:%d in %lu ms\n", connected_server.ip, connected_server.port,
+           metrics_now_ms() - start);
+    return socket_fd;
 }
 
 int main(int argc, char *argv[])
 {
-    int socket_fd = 0;
-    char ip[IPV4_SIZE] = {0};
-    int port = 0;
-    if (argc < 2)
+    int socket_fd = -1;
+    char *name = NULL;
+    const char *cache_path = cache_default_path();
+    int cache_ttl = CACHE_TTL;
+    int option = 0;
+    bool connect_first = false;
+    bool manual = false;
+    bool listen_announcements = false;
+    char *multicast_group = NULL;
+    char *multicast_interface = NULL;
+    int multicast_ttl = DISCOVERY_MULTICAST_TTL;
+
+    while (-1 != (option = getopt(argc, argv, "fmnlc:t:g:i:T:")))
+    {
+        switch (option)
+        {
+        case 'f':
+            connect_first = true;
+            break;
+        case 'm':
+            manual = true;
+            break;
+        case 'n':
+            cache_path = NULL;
+            break;
+        case 'l':
+            listen_announcements = true;
+            break;
+        case 'c':
+            cache_path = optarg;
+            break;
+        case 't':
+            cache_ttl = atoi(optarg);
+            break;
+        case 'g':
+            multicast_group = optarg;
+            break;
+        case 'i':
+            multicast_interface = optarg;
+            break;
+        case 'T':
+            multicast_ttl = atoi(optarg);
+            break;
+        default:
+            printf(USAGE, argv[0]);
+            return -1;
+        }
+    }
+
+    if (argc <= optind)
     {
         printf("Not enough arguments.\n");
         printf(USAGE, argv[0]);
         return -1;
     }
+    name = argv[optind];
 
-    if (MAX_NAME_SIZE <=strlen(argv[1]))
+    if (MAX_NAME_SIZE <=strlen(name))
     {
-        printf("Name '%s' is too long. Use less than %d characters.\n", argv[1], MAX_NAME_SIZE);
+        printf("Name '%s' is too long. Use less than %d characters.\n", name, MAX_NAME_SIZE);
         printf(USAGE, argv[0]);
         return -1;
     }
 
-    port = get_server(ip);
+    if (NULL != multicast_group)
+    {
+        discovery_use_multicast(multicast_group, multicast_interface, multicast_ttl);
+    }
 
-    configure_terminal();
+    // Clients started together shouldn't pick the same servers
+    srand(time(NULL) ^ getpid());
 
-    socket_fd = setup_connection(ip, port);
+    if (NULL != cache_path && listen_announcements)
+    {
+        // Passive discovery, also finds the servers to fail over to
+        cache_listen_in_background(cache_path, cache_ttl);
+    }
 
-    // Sends the server the name
-    printf("%s", argv[1]);
-    if (-1 == send(socket_fd, argv[1], strlen(argv[1])+1, 0))
+    if (NULL != cache_path && !manual)
     {
-        perror("Failed to send name");
-        exit(errno);
+        // A recently good server is used right away, the cache is refreshed in the background
+        socket_fd = connect_cached_server(cache_path, cache_ttl);
+        if (-1 != socket_fd && !listen_announcements)
+        {
+            cache_refresh_in_background(cache_path, cache_ttl);
+        }
+    }
+    if (-1 == socket_fd)
+    {
+        socket_fd = connect_discovered_server(cache_path, cache_ttl, connect_first, manual);
     }
 
+    configure_terminal();
+    renderer_init(&renderer);
+
+    // Sends the server the name, in a session that can fail over to another server
+    printf("%s", name);
+    renderer_invalidate(&renderer);
+    client_name = name;
+    send_session(socket_fd, false);
+
     while(true)
     {
-        handle_client_connection(socket_fd);
+        if (!handle_client_connection(socket_fd))
+        {
+            close(socket_fd);
+            socket_fd = failover(cache_path, cache_ttl);
+            renderer_invalidate(&renderer);
+        }
     }
 }
\ No newline at end of file
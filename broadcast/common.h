@@ -8,9 +8,21 @@
 
 #define MAX_MESSAGE_SIZE    (256)
 #define MAX_NAME_SIZE       (20)
-#define IPV4_SIZE           (4*3)
+#define IPV4_SIZE           (4*4) // "255.255.255.255" + null-terminator
 #define BROADCAST_PORT      (11111)
 #define BROADCAST_DISCOVER_MESSAGE  ("DISCOVER")
-#define BROADCAST_ANSWER_MESSAGE    ("ALIVE")
+#define BROADCAST_ANSWER_MESSAGE    ("ALIVE") // "ALIVE:<port>:<clients>:<capacity>:<load>:<node id>:<relay port>"
+#define MAXIMUM_LOAD                (100)     // load is the percentage of the capacity in use
+
+// Multicast discovery only reaches hosts that joined the group, and can be routed across subnets
+#define DISCOVERY_MULTICAST_TTL     (1) // Hops, 1 keeps discovery on the local subnet
+
+// Sessions, for clients that fail over to another federated server. A first frame of "/session <name>"
+// (or "/resume <name> <origin>:<sequence>..." after a failover) instead of the name has every room message
+// sent to the client tagged with SEQUENCE_TAG "<origin>:<sequence>" SEQUENCE_TAG.
+#define SESSION_COMMAND             ("/session ")
+#define RESUME_COMMAND              ("/resume ")
+#define SEQUENCE_TAG                ('\x1E') // ASCII record separator, never typed into a message
+#define MAX_ORIGINS                 (16)     // cursors a client resumes with
 
 #endif //POLL_COMMON_H
@@ -0,0 +1,609 @@
+/**
+ ** Written by Amit Sides
+ **/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <string.h>
+#include <poll.h>
+#include <pthread.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "metrics.h"
+#include "discovery.h"
+
+typedef struct multicast_config_s {
+    bool enabled;
+    struct in_addr group;
+    struct in_addr interface;
+    int ttl;
+} multicast_config_t;
+
+typedef struct refresh_args_s {
+    char path[PATH_MAX];
+    int ttl;
+    int fd;                         // the announcements listener
+} refresh_args_t;
+
+// Set once before discovering, read by the background refresh too
+static multicast_config_t multicast = {0};
+
+void server_list_free(server_list_t *list)
+{
+    free(list->servers);
+    list->servers = NULL;
+    list->count = 0;
+}
+
+// Adds a server to the list, or updates it if it is already there.
+// Returns the server, and whether it is a new one in is_new.
+static server_info_t *add_server(server_list_t *list, server_info_t *server, bool *is_new)
+{
+    for(int i=0; i < list->count; i++)
+    {
+        if (list->servers[i].port == server->port && 0 == strcmp(list->servers[i].ip, server->ip))
+        {
+            if (list->servers[i].last_seen < server->last_seen)
+            {
+                list->servers[i].last_seen = server->last_seen;
+                if (UNKNOWN_LOAD != server->load)
+                {
+                    list->servers[i].clients = server->clients;
+                    list->servers[i].capacity = server->capacity;
+                    list->servers[i].load = server->load;
+                }
+            }
+            *is_new = false;
+            return &list->servers[i];
+        }
+    }
+
+    // Increase the servers table
+    list->count++;
+    list->servers = realloc(list->servers, list->count * sizeof(*list->servers));
+    if (NULL == list->servers)
+    {
+        perror("realloc failed");
+        exit(errno);
+    }
+    list->servers[list->count - 1] = *server;
+    *is_new = true;
+    return &list->servers[list->count - 1];
+}
+
+void discovery_use_multicast(const char *group, const char *interface, int ttl)
+{
+    if (1 != inet_pton(AF_INET, group, &multicast.group) || !IN_MULTICAST(ntohl(multicast.group.s_addr)))
+    {
+        fprintf(stderr, "Invalid multicast group '%s'\n", group);
+        exit(-1);
+    }
+
+    multicast.interface.s_addr = htonl(INADDR_ANY);
+    if (NULL != interface && 1 != inet_pton(AF_INET, interface, &multicast.interface))
+    {
+        fprintf(stderr, "Invalid multicast interface '%s'\n", interface);
+        exit(-1);
+    }
+
+    if (0 > ttl || UCHAR_MAX < ttl)
+    {
+        fprintf(stderr, "Invalid multicast ttl %d\n", ttl);
+        exit(-1);
+    }
+
+    multicast.ttl = ttl;
+    multicast.enabled = true;
+}
+
+static void setup_multicast(int sender_fd)
+{
+    unsigned char ttl = multicast.ttl;
+    unsigned char loopback = 1;
+
+    if (0 != setsockopt(sender_fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)))
+    {
+        perror("Failed to set IP_MULTICAST_TTL");
+        exit(errno);
+    }
+
+    // Servers on this host are members of the group too
+    if (0 != setsockopt(sender_fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loopback, sizeof(loopback)))
+    {
+        perror("Failed to set IP_MULTICAST_LOOP");
+        exit(errno);
+    }
+
+    if (INADDR_ANY != multicast.interface.s_addr &&
+        0 != setsockopt(sender_fd, IPPROTO_IP, IP_MULTICAST_IF, &multicast.interface, sizeof(multicast.interface)))
+    {
+        perror("Failed to set IP_MULTICAST_IF");
+        exit(errno);
+    }
+}
+
+static int setup_discovery()
+{
+    int sender_fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (-1 == sender_fd)
+    {
+        perror("socket");
+        exit(errno);
+    }
+
+    if (multicast.enabled)
+    {
+        setup_multicast(sender_fd);
+        return sender_fd;
+    }
+
+    int enabled = 1;
+    if (0 != setsockopt(sender_fd, SOL_SOCKET, SO_BROADCAST, &enabled, sizeof(enabled)))
+    {
+        perror("Failed to set SO_BROADCAST");
+        exit(errno);
+    }
+
+    return sender_fd;
+}
+
+static void send_broadcast(int sender_fd, int port, char *message, size_t message_size)
+{
+    struct sockaddr_in broadcast_address = {0};
+
+    broadcast_address.sin_family = AF_INET;
+    broadcast_address.sin_port=htons(port);
+    broadcast_address.sin_addr.s_addr=htonl(INADDR_BROADCAST);
+    if (multicast.enabled)
+    {
+        broadcast_address.sin_addr = multicast.group;
+    }
+
+    // Best Effort
+    sendto(sender_fd, message, message_size, 0,
+           (struct sockaddr *)&broadcast_address, sizeof(broadcast_address));
+}
+
+// Parses an "ALIVE:<port>[:<clients>:<capacity>:<load>]" answer, returns false for an invalid one
+static bool parse_answer(char *answer, struct sockaddr_in *address, server_info_t *server)
+{
+    if (0 != strncmp(answer, BROADCAST_ANSWER_MESSAGE, sizeof(BROADCAST_ANSWER_MESSAGE)-1) ||
+        ':' != answer[sizeof(BROADCAST_ANSWER_MESSAGE)-1])
+    {
+        // Invalid answer :(
+        return false;
+    }
+
+    server->port = 0;
+    if (4 != sscanf(&answer[sizeof(BROADCAST_ANSWER_MESSAGE)], "%d:%d:%d:%d",
+                    &server->port, &server->clients, &server->capacity, &server->load))
+    {
+        // Older servers answer with the port alone
+        server->clients = UNKNOWN_LOAD;
+        server->capacity = UNKNOWN_LOAD;
+        server->load = UNKNOWN_LOAD;
+    }
+    server->last_seen = time(NULL);
+    return 0 < server->port && NULL != inet_ntop(AF_INET, &address->sin_addr, server->ip, sizeof(server->ip));
+}
+
+void discover_servers(server_list_t *list, bool stop_at_first, bool verbose)
+{
+    char buffer[MAX_MESSAGE_SIZE] = {0};
+    struct sockaddr_in server_address = {0};
+    socklen_t server_address_size = sizeof(server_address);
+    struct pollfd poll_fd = {0};
+    server_info_t answer = {0};
+    server_info_t *server = NULL;
+    bool is_new = false;
+    int found = 0;
+    int bytes_recv = 0;
+    int retransmit_interval = DISCOVER_RETRANSMIT;
+    uint64_t start = 0;
+    uint64_t last_sent = 0;
+    uint64_t next_send = 0;
+    uint64_t deadline = 0;
+    uint64_t now = 0;
+
+    int broadcast_fd = setup_discovery();
+
+    start = metrics_now_ms();
+    deadline = start + DISCOVER_TIMEOUT;
+    next_send = start;
+    poll_fd.fd = broadcast_fd;
+    poll_fd.events = POLLIN;
+
+    // Handling servers as they answer. DISCOVER is retransmitted with an exponential backoff,
+    // so a single lost datagram doesn't hide every server.
+    for (now = start; now < deadline; now = metrics_now_ms())
+    {
+        if (now >= next_send)
+        {
+            send_broadcast(broadcast_fd, BROADCAST_PORT, BROADCAST_DISCOVER_MESSAGE, sizeof(BROADCAST_DISCOVER_MESSAGE));
+            last_sent = now;
+            next_send = now + retransmit_interval;
+            retransmit_interval *= 2;
+        }
+
+        if (0 >= poll(&poll_fd, 1, (next_send < deadline ? next_send : deadline) - now))
+        {
+            continue;
+        }
+
+        bytes_recv = recvfrom(broadcast_fd, buffer, sizeof(buffer) - 1, MSG_DONTWAIT,
+                              (struct sockaddr *)&server_address, &server_address_size);
+        if (0 >= bytes_recv)
+        {
+            continue;
+        }
+        buffer[bytes_recv] = '\0';
+
+        if (!parse_answer(buffer, &server_address, &answer))
+        {
+            continue;
+        }
+        answer.rtt_ms = (double)(metrics_now_ms() - last_sent);
+
+        // An answer to a retransmission only refreshes a server we already know of
+        server = add_server(list, &answer, &is_new);
+        if (!is_new)
+        {
+            continue;
+        }
+
+        found++;
+        if (verbose)
+        {
+            if (1 == found)
+            {
+                printf("\nFound chat servers:\n");
+            }
+            if (UNKNOWN_LOAD == server->load)
+            {
+                printf("%d. %s:%d (%.0f ms)\n", list->count, server->ip, server->port, server->rtt_ms);
+            }
+            else
+            {
+                printf("%d. %s:%d (%.0f ms, %d/%d clients)\n", list->count, server->ip, server->port,
+                       server->rtt_ms, server->clients, server->capacity);
+            }
+        }
+
+        if (stop_at_first)
+        {
+            // The first responder is the closest (or least busy) server, no need to wait for the rest
+            break;
+        }
+    }
+    close(broadcast_fd);
+}
+
+static int server_load(server_info_t *server)
+{
+    // A server that doesn't report its load is only picked over a full one
+    return UNKNOWN_LOAD == server->load ? MAXIMUM_LOAD : server->load;
+}
+
+server_info_t *pick_server(server_list_t *list)
+{
+    server_info_t *first = NULL;
+    server_info_t *second = NULL;
+    int second_index = 0;
+
+    if (0 == list->count)
+    {
+        return NULL;
+    }
+    first = &list->servers[rand() % list->count];
+    if (1 == list->count)
+    {
+        return first;
+    }
+
+    // Two distinct servers
+    second_index = rand() % (list->count - 1);
+    if (second_index >= first - list->servers)
+    {
+        second_index++;
+    }
+    second = &list->servers[second_index];
+
+    if (server_load(first) != server_load(second))
+    {
+        return server_load(first) < server_load(second) ? first : second;
+    }
+    return first->rtt_ms <= second->rtt_ms ? first : second;
+}
+
+const char *cache_default_path()
+{
+    static char path[PATH_MAX] = {0};
+    const char *home = getenv("HOME");
+
+    if (NULL == home)
+    {
+        return CACHE_FILE_NAME;
+    }
+    snprintf(path, sizeof(path), "%s/%s", home, CACHE_FILE_NAME);
+    return path;
+}
+
+static int compare_last_seen(const void *first, const void *second)
+{
+    const server_info_t *first_server = first;
+    const server_info_t *second_server = second;
+
+    // Most recently seen first
+    return (second_server->last_seen > first_server->last_seen) - (second_server->last_seen < first_server->last_seen);
+}
+
+void cache_load(const char *path, int ttl, server_list_t *list)
+{
+    FILE *cache = fopen(path, "r");
+    server_info_t server = {0};
+    char line[128] = {0};
+    time_t now = time(NULL);
+    long last_seen = 0;
+    bool is_new = false;
+
+    if (NULL == cache)
+    {
+        // No cache yet
+        return;
+    }
+
+    while (NULL != fgets(line, sizeof(line), cache))
+    {
+        // The load is missing from caches written by older clients
+        server.load = UNKNOWN_LOAD;
+        if (3 > sscanf(line, "%15s %d %ld %d", server.ip, &server.port, &last_seen, &server.load))
+        {
+            break;
+        }
+        server.last_seen = last_seen;
+        server.rtt_ms = 0;
+        server.clients = UNKNOWN_LOAD;
+        server.capacity = UNKNOWN_LOAD;
+        if (now - server.last_seen <= ttl && 0 < server.port)
+        {
+            add_server(list, &server, &is_new);
+        }
+    }
+    fclose(cache);
+
+    qsort(list->servers, list->count, sizeof(*list->servers), compare_last_seen);
+}
+
+// Serializes the cache's load-modify-write within the process: the refresh and listen threads and the
+// failover on the main thread would otherwise write the same temporary file and lose each other's updates.
+// Other clients on the host write their own temporary file, the last rename wins.
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void write_cache(const char *path, server_list_t *list)
+{
+    char temporary_path[PATH_MAX + 16] = {0};
+    FILE *cache = NULL;
+
+    // Writing a temporary file and renaming it, so concurrent clients never read a partial cache
+    snprintf(temporary_path, sizeof(temporary_path), "%s.%d", path, getpid());
+    cache = fopen(temporary_path, "w");
+    if (NULL == cache)
+    {
+        // The cache is an optimization, best-effort
+        return;
+    }
+
+    for(int i=0; i < list->count; i++)
+    {
+        fprintf(cache, "%s %d %ld %d\n", list->servers[i].ip, list->servers[i].port,
+                (long)list->servers[i].last_seen, list->servers[i].load);
+    }
+
+    if (0 != fclose(cache) || 0 != rename(temporary_path, path))
+    {
+        unlink(temporary_path);
+    }
+}
+
+void cache_save(const char *path, int ttl, server_list_t *list)
+{
+    server_list_t cached = {0};
+    bool is_new = false;
+
+    pthread_mutex_lock(&cache_lock);
+    cache_load(path, ttl, &cached);
+    for(int i=0; i < list->count; i++)
+    {
+        add_server(&cached, &list->servers[i], &is_new);
+    }
+    write_cache(path, &cached);
+    pthread_mutex_unlock(&cache_lock);
+    server_list_free(&cached);
+}
+
+void cache_invalidate(const char *path, int ttl, server_info_t *server)
+{
+    server_list_t cached = {0};
+
+    pthread_mutex_lock(&cache_lock);
+    cache_load(path, ttl, &cached);
+    for(int i=0; i < cached.count; i++)
+    {
+        if (cached.servers[i].port == server->port && 0 == strcmp(cached.servers[i].ip, server->ip))
+        {
+            cached.servers[i] = cached.servers[--cached.count];
+            break;
+        }
+    }
+    write_cache(path, &cached);
+    pthread_mutex_unlock(&cache_lock);
+    server_list_free(&cached);
+}
+
+static void *refresh_thread(void *arguments)
+{
+    refresh_args_t *refresh = arguments;
+    server_list_t list = {0};
+
+    discover_servers(&list, false, false);
+    if (0 < list.count)
+    {
+        cache_save(refresh->path, refresh->ttl, &list);
+    }
+
+    server_list_free(&list);
+    free(refresh);
+    return NULL;
+}
+
+void cache_refresh_in_background(const char *path, int ttl)
+{
+    struct stat cache_stat = {0};
+    refresh_args_t *refresh = NULL;
+    pthread_t tid;
+
+    // A storm of clients restarting together should cause a single refresh, not a broadcast wave.
+    // Touching the cache claims the refresh for this client.
+    if (0 == stat(path, &cache_stat) && time(NULL) - cache_stat.st_mtime < CACHE_REFRESH_INTERVAL)
+    {
+        return;
+    }
+    utime(path, NULL);
+
+    refresh = malloc(sizeof(*refresh));
+    if (NULL == refresh)
+    {
+        return;
+    }
+    snprintf(refresh->path, sizeof(refresh->path), "%s", path);
+    refresh->ttl = ttl;
+
+    errno = pthread_create(&tid, NULL, refresh_thread, refresh);
+    if (0 != errno)
+    {
+        // Best-effort, the cache will be refreshed by the next client
+        free(refresh);
+        return;
+    }
+    pthread_detach(tid);
+}
+
+static int setup_listener()
+{
+    struct sockaddr_in listen_address = {0};
+    int enabled = 1;
+    int listen_fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+    if (-1 == listen_fd)
+    {
+        perror("socket");
+        exit(errno);
+    }
+
+    // Shared with the servers and the other listening clients on this host
+    if (0 != setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &enabled, sizeof(enabled)))
+    {
+        perror("Failed to set SO_REUSEADDR");
+        exit(errno);
+    }
+
+    listen_address.sin_family = AF_INET;
+    listen_address.sin_addr.s_addr = htonl(INADDR_ANY);
+    listen_address.sin_port = htons(BROADCAST_PORT);
+    if (0 != bind(listen_fd, (struct sockaddr *)&listen_address, sizeof(listen_address)))
+    {
+        perror("Failed to bind the announcements listener");
+        exit(errno);
+    }
+
+    if (multicast.enabled)
+    {
+        struct ip_mreq membership = {multicast.group, multicast.interface};
+        if (0 != setsockopt(listen_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)))
+        {
+            perror("Failed to join the multicast group");
+            exit(errno);
+        }
+    }
+
+    return listen_fd;
+}
+
+static void *listen_thread(void *arguments)
+{
+    refresh_args_t *listener = arguments;
+    char buffer[MAX_MESSAGE_SIZE] = {0};
+    struct sockaddr_in server_address = {0};
+    socklen_t server_address_size = sizeof(server_address);
+    server_list_t known = {0};
+    server_list_t pending = {0};      // announced since the last save
+    server_info_t announcement = {0};
+    bool is_new = false;
+    int bytes_recv = 0;
+    uint64_t last_save = 0;
+
+    while (true)
+    {
+        server_address_size = sizeof(server_address);
+        bytes_recv = recvfrom(listener->fd, buffer, sizeof(buffer) - 1, 0,
+                              (struct sockaddr *)&server_address, &server_address_size);
+        if (0 >= bytes_recv)
+        {
+            continue;
+        }
+        buffer[bytes_recv] = '\0';
+
+        // DISCOVERs of other clients arrive here too
+        if (!parse_answer(buffer, &server_address, &announcement))
+        {
+            continue;
+        }
+
+        add_server(&pending, &announcement, &is_new);
+        add_server(&known, &announcement, &is_new);
+
+        // Every server announces periodically, a new one is saved right away and the rest are batched.
+        // Only servers that announced lately are saved, so a server invalidated after a failure stays out.
+        // cache_save takes the cache lock, so this doesn't race the refresh thread or a failover's invalidation.
+        if (is_new || metrics_now_ms() - last_save >= LISTEN_SAVE_INTERVAL)
+        {
+            cache_save(listener->path, listener->ttl, &pending);
+            server_list_free(&pending);
+            last_save = metrics_now_ms();
+        }
+    }
+
+    return NULL;
+}
+
+void cache_listen_in_background(const char *path, int ttl)
+{
+    refresh_args_t *listener = malloc(sizeof(*listener));
+    pthread_t tid;
+
+    if (NULL == listener)
+    {
+        perror("malloc failed");
+        exit(errno);
+    }
+    snprintf(listener->path, sizeof(listener->path), "%s", path);
+    listener->ttl = ttl;
+    listener->fd = setup_listener();
+
+    errno = pthread_create(&tid, NULL, listen_thread, listener);
+    if (0 != errno)
+    {
+        perror("Failed to create the announcements listener thread");
+        exit(errno);
+    }
+    pthread_detach(tid);
+}
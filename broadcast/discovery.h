@@ -0,0 +1,66 @@
+/**
+ ** Written by Amit Sides
+ **/
+
+#ifndef BROADCAST_DISCOVERY_H
+#define BROADCAST_DISCOVERY_H
+
+#include <stdbool.h>
+#include <time.h>
+
+#include "common.h"
+
+#define DISCOVER_TIMEOUT        (1000) // ms
+#define DISCOVER_RETRANSMIT     (100)  // ms, doubled after every retransmission
+#define UNKNOWN_LOAD            (-1)   // an older server that doesn't report its load
+
+#define CACHE_FILE_NAME         (".chat_servers")
+#define CACHE_TTL               (60)   // seconds a discovered server is trusted without asking again
+#define CACHE_REFRESH_INTERVAL  (10)   // seconds, a cache refreshed more recently isn't refreshed again
+#define LISTEN_SAVE_INTERVAL    (1000) // ms, announcements of known servers are saved to the cache at most that often
+
+typedef struct server_info_s {
+    char ip[IPV4_SIZE];
+    int port;
+    double rtt_ms;
+    time_t last_seen;
+    int clients;                    // UNKNOWN_LOAD for an older server
+    int capacity;
+    int load;                       // percentage of the capacity in use
+} server_info_t;
+
+typedef struct server_list_s {
+    server_info_t *servers;
+    int count;
+} server_list_t;
+
+void server_list_free(server_list_t *list);
+
+// Discovers servers with multicast to the group instead of a broadcast. The interface address (or NULL for
+// the default one) selects the outgoing interface, ttl the amount of hops. Call before any discovery.
+void discovery_use_multicast(const char *group, const char *interface, int ttl);
+
+// Broadcasts (or multicasts) DISCOVER and collects the answers for up to DISCOVER_TIMEOUT.
+// With stop_at_first, returns as soon as a server answers. verbose prints servers as they answer.
+void discover_servers(server_list_t *list, bool stop_at_first, bool verbose);
+
+// Power of two choices: picks two random servers and returns the less loaded one.
+// Avoids the herd of every client choosing the same "least loaded" server off a stale load.
+server_info_t *pick_server(server_list_t *list);
+
+// Discovery cache, a text file with a "<ip> <port> <last seen> [<load>]" line per server.
+// Returns $HOME/CACHE_FILE_NAME (or one in the working directory without $HOME)
+const char *cache_default_path();
+// Loads the servers seen in the last ttl seconds, most recently seen first
+void cache_load(const char *path, int ttl, server_list_t *list);
+// Merges the servers into the cache. Thread-safe, like cache_invalidate.
+void cache_save(const char *path, int ttl, server_list_t *list);
+// Removes a server that couldn't be reached
+void cache_invalidate(const char *path, int ttl, server_info_t *server);
+// Runs a discovery on a detached thread and saves the answers, unless the cache was refreshed lately
+void cache_refresh_in_background(const char *path, int ttl);
+// Passive discovery: saves the servers' periodic announcements (server -A) to the cache from a detached
+// thread, so the cache is up to date when connecting or failing over. Also listens on the multicast group.
+void cache_listen_in_background(const char *path, int ttl);
+
+#endif //BROADCAST_DISCOVERY_H
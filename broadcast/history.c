@@ -0,0 +1,66 @@
+/**
+ ** Written by Amit Sides
+ **/
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "metrics.h"
+#include "history.h"
+
+void history_add(history_t *history, uint32_t origin, uint64_t sequence, const char *message, size_t length)
+{
+    history_entry_t *entry = &history->entries[history->next];
+
+    if (sizeof(entry->message) < length)
+    {
+        length = sizeof(entry->message);
+    }
+
+    entry->origin = origin;
+    entry->sequence = sequence;
+    entry->received_ms = metrics_now_ns() / 1000000;
+    entry->length = length;
+    memcpy(entry->message, message, length);
+
+    history->added++;
+    history->next = (history->next + 1) % HISTORY_SIZE;
+    if (HISTORY_SIZE > history->count)
+    {
+        history->count++;
+    }
+}
+
+static bool missed(history_entry_t *entry, session_cursor_t *cursors, int cursor_count, uint64_t now)
+{
+    for(int i=0; i < cursor_count; i++)
+    {
+        if (cursors[i].origin == entry->origin)
+        {
+            return entry->sequence > cursors[i].sequence;
+        }
+    }
+
+    // The client didn't see any message of this origin, only the recent ones may have been missed
+    return now - entry->received_ms <= HISTORY_MAX_GAP;
+}
+
+size_t history_replay(history_t *history, uint64_t until, session_cursor_t *cursors, int cursor_count,
+                      history_replay_t replay, void *context)
+{
+    uint64_t now = metrics_now_ns() / 1000000;
+    size_t first = (history->next + HISTORY_SIZE - history->count) % HISTORY_SIZE;
+    size_t replayed = 0;
+
+    // Oldest first
+    for(size_t i=0; i < history->count && history->added - history->count + i < until; i++)
+    {
+        history_entry_t *entry = &history->entries[(first + i) % HISTORY_SIZE];
+        if (missed(entry, cursors, cursor_count, now))
+        {
+            replay(context, entry);
+            replayed++;
+        }
+    }
+    return replayed;
+}
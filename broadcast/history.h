@@ -0,0 +1,49 @@
+/**
+ ** Written by Amit Sides
+ **/
+
+#ifndef BROADCAST_HISTORY_H
+#define BROADCAST_HISTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+
+#define HISTORY_SIZE            (256)   // recent room messages kept for resumed sessions
+#define HISTORY_MESSAGE_SIZE    (MAX_MESSAGE_SIZE * 2 + 128)
+#define HISTORY_MAX_GAP         (3000)  // ms, how far back messages of an origin the client never saw are replayed
+
+// A message of the room is identified by the server it originated at and its sequence number there
+typedef struct session_cursor_s {
+    uint32_t origin;
+    uint64_t sequence;                  // the last one the client saw
+} session_cursor_t;
+
+typedef struct history_entry_s {
+    uint32_t origin;
+    uint64_t sequence;
+    uint64_t received_ms;
+    size_t length;
+    char message[HISTORY_MESSAGE_SIZE];
+} history_entry_t;
+
+// A ring of the last HISTORY_SIZE messages, in the order this server delivered them
+typedef struct history_s {
+    history_entry_t entries[HISTORY_SIZE];
+    size_t next;
+    size_t count;
+    uint64_t added;                     // messages ever added
+} history_t;
+
+typedef void (*history_replay_t)(void *context, history_entry_t *entry);
+
+void history_add(history_t *history, uint32_t origin, uint64_t sequence, const char *message, size_t length);
+
+// Replays the messages the client missed: newer than its cursor for their origin, or received in the
+// last HISTORY_MAX_GAP for an origin it has no cursor of. Only the first until messages ever added are
+// replayed, the later ones were sent to the client already. Returns the amount of messages replayed.
+size_t history_replay(history_t *history, uint64_t until, session_cursor_t *cursors, int cursor_count,
+                      history_replay_t replay, void *context);
+
+#endif //BROADCAST_HISTORY_H
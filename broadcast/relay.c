@@ -0,0 +1,520 @@
+/**
+ ** Written by Amit Sides
+ **/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "metrics.h"
+#include "relay.h"
+
+#define NO_SOCKET           (-1)
+#define RELAY_FRAME_SIZE    (MAX_MESSAGE_SIZE * 2 + 128) // a formatted chat message and the relay header
+
+static void close_peer(relay_t *relay, relay_peer_t *peer)
+{
+    if (0 != peer->node_id && !peer->connecting)
+    {
+        printf("Peer %08x left the federation\n", peer->node_id);
+    }
+    close(peer->fd);
+    peer->fd = NO_SOCKET;
+    peer->node_id = 0;
+    peer->connecting = false;
+    frame_reset(&peer->input);
+}
+
+static bool send_to_peer(relay_t *relay, relay_peer_t *peer, const char *frame, size_t length)
+{
+    if (length != send(peer->fd, frame, length, MSG_NOSIGNAL))
+    {
+        // A peer that can't keep up (a full send buffer or a partial write) is dropped, rather than
+        // blocking the chat loop. It reconnects on the next discovery.
+        close_peer(relay, peer);
+        return false;
+    }
+    return true;
+}
+
+static void send_hello(relay_t *relay, relay_peer_t *peer)
+{
+    char hello[64] = {0};
+    int length = snprintf(hello, sizeof(hello), "%s %u\n", RELAY_HELLO, relay->node_id);
+
+    send_to_peer(relay, peer, hello, length);
+}
+
+static relay_peer_t *add_peer(relay_t *relay, int fd, uint32_t node_id, bool connecting)
+{
+    for(int i=0; i < RELAY_MAX_PEERS; i++)
+    {
+        relay_peer_t *peer = &relay->peers[i];
+        if (NO_SOCKET == peer->fd)
+        {
+            peer->fd = fd;
+            peer->node_id = node_id;
+            peer->connecting = connecting;
+            frame_reset(&peer->input);
+            return peer;
+        }
+    }
+
+    // Too many peers
+    close(fd);
+    return NULL;
+}
+
+static relay_peer_t *find_peer(relay_t *relay, uint32_t node_id)
+{
+    for(int i=0; i < RELAY_MAX_PEERS; i++)
+    {
+        if (NO_SOCKET != relay->peers[i].fd && node_id == relay->peers[i].node_id)
+        {
+            return &relay->peers[i];
+        }
+    }
+    return NULL;
+}
+
+static int setup_listener(int *port)
+{
+    struct sockaddr_in address = {0};
+    socklen_t address_size = sizeof(address);
+    int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (-1 == listen_fd)
+    {
+        perror("Failed to create the relay socket");
+        exit(errno);
+    }
+
+    // An ephemeral port, peers learn it from ALIVE
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = 0;
+    if (0 != bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) ||
+        0 != listen(listen_fd, RELAY_MAX_PEERS) ||
+        0 != getsockname(listen_fd, (struct sockaddr *)&address, &address_size))
+    {
+        perror("Failed to setup the relay listener");
+        exit(errno);
+    }
+
+    *port = ntohs(address.sin_port);
+    return listen_fd;
+}
+
+static int setup_discovery(const char *multicast_group)
+{
+    int discovery_fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    int enabled = 1;
+    unsigned char ttl = DISCOVERY_MULTICAST_TTL;
+
+    if (-1 == discovery_fd)
+    {
+        perror("Failed to create the relay discovery socket");
+        exit(errno);
+    }
+
+    if (NULL == multicast_group)
+    {
+        if (0 != setsockopt(discovery_fd, SOL_SOCKET, SO_BROADCAST, &enabled, sizeof(enabled)))
+        {
+            perror("Failed to set SO_BROADCAST");
+            exit(errno);
+        }
+    }
+    else if (0 != setsockopt(discovery_fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)))
+    {
+        // Multicast loopback is on by default, so servers on this host are found too
+        perror("Failed to set IP_MULTICAST_TTL");
+        exit(errno);
+    }
+
+    return discovery_fd;
+}
+
+uint32_t relay_new_node_id()
+{
+    uint32_t node_id = 0;
+
+    // 0 means "not federated" in ALIVE
+    while (0 == node_id)
+    {
+        if (sizeof(node_id) != getrandom(&node_id, sizeof(node_id), 0))
+        {
+            perror("getrandom failed");
+            exit(errno);
+        }
+    }
+    return node_id;
+}
+
+void relay_init(relay_t *relay, uint32_t node_id, const char *multicast_group, relay_deliver_t deliver, void *context)
+{
+    memset(relay, 0, sizeof(*relay));
+
+    relay->node_id = node_id;
+
+    for(int i=0; i < RELAY_MAX_PEERS; i++)
+    {
+        relay->peers[i].fd = NO_SOCKET;
+    }
+    relay->multicast_group = multicast_group;
+    relay->listen_fd = setup_listener(&relay->port);
+    relay->discovery_fd = setup_discovery(multicast_group);
+    relay->deliver = deliver;
+    relay->context = context;
+
+    printf("Relaying as node %08x on %d\n", relay->node_id, relay->port);
+}
+
+void relay_poll_fds(relay_t *relay, struct pollfd *poll_fds)
+{
+    poll_fds[0].fd = relay->listen_fd;
+    poll_fds[1].fd = relay->discovery_fd;
+    for(int i=0; i < RELAY_MAX_PEERS; i++)
+    {
+        poll_fds[i + 2].fd = relay->peers[i].fd; // poll ignores the empty ones
+    }
+    for(int i=0; i < RELAY_POLL_FDS; i++)
+    {
+        poll_fds[i].events = POLLIN;
+        poll_fds[i].revents = 0;
+    }
+    for(int i=0; i < RELAY_MAX_PEERS; i++)
+    {
+        if (relay->peers[i].connecting)
+        {
+            // Writable once connected
+            poll_fds[i + 2].events = POLLOUT;
+        }
+    }
+}
+
+static void send_discover(relay_t *relay)
+{
+    struct sockaddr_in address = {0};
+
+    address.sin_family = AF_INET;
+    address.sin_port = htons(BROADCAST_PORT);
+    address.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+    if (NULL != relay->multicast_group)
+    {
+        inet_pton(AF_INET, relay->multicast_group, &address.sin_addr);
+    }
+
+    // Best Effort
+    sendto(relay->discovery_fd, BROADCAST_DISCOVER_MESSAGE, sizeof(BROADCAST_DISCOVER_MESSAGE), 0,
+           (struct sockaddr *)&address, sizeof(address));
+}
+
+static void peer_connected(relay_t *relay, relay_peer_t *peer)
+{
+    printf("Peer %08x joined the federation\n", peer->node_id);
+    peer->connecting = false;
+    send_hello(relay, peer);
+}
+
+// Completes a non-blocking connect, the peer became writable (or failed)
+static void finish_connect(relay_t *relay, relay_peer_t *peer)
+{
+    int error = 0;
+    socklen_t error_size = sizeof(error);
+
+    if (0 != getsockopt(peer->fd, SOL_SOCKET, SO_ERROR, &error, &error_size) || 0 != error)
+    {
+        // Best-effort, tried again on the next discovery
+        close_peer(relay, peer);
+        return;
+    }
+    peer_connected(relay, peer);
+}
+
+static void connect_peer(relay_t *relay, struct sockaddr_in *address, uint32_t node_id)
+{
+    relay_peer_t *peer = NULL;
+    int peer_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    int result = 0;
+
+    if (-1 == peer_fd)
+    {
+        perror("Failed to create a peer socket");
+        return;
+    }
+
+    // Doesn't wait for the handshake, an unreachable peer would hold the chat loop for the SYN timeout
+    result = connect(peer_fd, (struct sockaddr *)address, sizeof(*address));
+    if (0 != result && EINPROGRESS != errno)
+    {
+        // Best-effort, tried again on the next discovery
+        close(peer_fd);
+        return;
+    }
+
+    peer = add_peer(relay, peer_fd, node_id, 0 != result);
+    if (NULL != peer && 0 == result)
+    {
+        peer_connected(relay, peer);
+    }
+}
+
+// Connects to the servers that answered our DISCOVER, the lower node id of every pair connects
+static void handle_answers(relay_t *relay)
+{
+    char answer[MAX_MESSAGE_SIZE + 1] = {0};
+    struct sockaddr_in address = {0};
+    socklen_t address_size = sizeof(address);
+    int port = 0;
+    int clients = 0;
+    int capacity = 0;
+    int load = 0;
+    unsigned int node_id = 0;
+    int relay_port = 0;
+    int bytes_recv = 0;
+
+    while (0 < (bytes_recv = recvfrom(relay->discovery_fd, answer, sizeof(answer) - 1, 0,
+                                      (struct sockaddr *)&address, &address_size)))
+    {
+        answer[bytes_recv] = '\0';
+        if (0 != strncmp(answer, BROADCAST_ANSWER_MESSAGE, sizeof(BROADCAST_ANSWER_MESSAGE)-1) ||
+            6 != sscanf(answer + sizeof(BROADCAST_ANSWER_MESSAGE), "%d:%d:%d:%d:%u:%d",
+                        &port, &clients, &capacity, &load, &node_id, &relay_port))
+        {
+            // Not federated
+            continue;
+        }
+
+        if (0 == node_id || 0 >= relay_port || relay->node_id >= node_id || NULL != find_peer(relay, node_id))
+        {
+            // Ourselves, a peer we already have, or one that connects to us
+            continue;
+        }
+
+        address.sin_port = htons(relay_port);
+        connect_peer(relay, &address, node_id);
+    }
+}
+
+static void accept_peer(relay_t *relay)
+{
+    relay_peer_t *peer = NULL;
+    int peer_fd = accept4(relay->listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+
+    if (-1 == peer_fd)
+    {
+        perror("accept failed");
+        return;
+    }
+
+    // The node id arrives with the peer's HELLO
+    peer = add_peer(relay, peer_fd, 0, false);
+    if (NULL != peer)
+    {
+        send_hello(relay, peer);
+    }
+}
+
+// Returns true if the message wasn't seen yet, and marks it as seen
+static bool first_seen(relay_t *relay, uint32_t origin, uint64_t sequence)
+{
+    relay_origin_t *entry = NULL;
+    uint64_t offset = 0;
+
+    for(int i=0; i < RELAY_MAX_ORIGINS && NULL == entry; i++)
+    {
+        if (origin == relay->origins[i].node_id)
+        {
+            entry = &relay->origins[i];
+        }
+    }
+    if (NULL == entry)
+    {
+        // A new origin replaces the oldest one
+        entry = &relay->origins[relay->next_origin];
+        relay->next_origin = (relay->next_origin + 1) % RELAY_MAX_ORIGINS;
+        entry->node_id = origin;
+        entry->highest = 0;
+        entry->window = 0;
+    }
+
+    if (sequence > entry->highest)
+    {
+        offset = sequence - entry->highest;
+        entry->window = RELAY_WINDOW <= offset ? 0 : entry->window << offset;
+        entry->window |= 1;
+        entry->highest = sequence;
+        return true;
+    }
+
+    offset = entry->highest - sequence;
+    if (RELAY_WINDOW <= offset || 0 != (entry->window & (1ull << offset)))
+    {
+        // Too old to tell, or a duplicate
+        return false;
+    }
+    entry->window |= 1ull << offset;
+    return true;
+}
+
+static void forward(relay_t *relay, relay_peer_t *source, uint32_t origin, uint64_t sequence, int hops,
+                    uint64_t sent_ns, const char *message, size_t length)
+{
+    char frame[RELAY_FRAME_SIZE] = {0};
+    int frame_length = 0;
+    size_t forwarded = 0;
+
+    // The message keeps its '\n' as the frame delimiter
+    frame_length = snprintf(frame, sizeof(frame), "%s %u %lu %d %lu %.*s", RELAY_MESSAGE, origin,
+                            sequence, hops, sent_ns, (int)length, message);
+    if (0 > frame_length || sizeof(frame) <= frame_length)
+    {
+        return;
+    }
+
+    for(int i=0; i < RELAY_MAX_PEERS; i++)
+    {
+        relay_peer_t *peer = &relay->peers[i];
+        if (NO_SOCKET == peer->fd || 0 == peer->node_id || peer->connecting || source == peer || origin == peer->node_id)
+        {
+            continue;
+        }
+        if (send_to_peer(relay, peer, frame, frame_length))
+        {
+            forwarded++;
+        }
+    }
+    metrics_relayed_out(forwarded);
+}
+
+void relay_publish(relay_t *relay, uint64_t sequence, const char *message, size_t length)
+{
+    first_seen(relay, relay->node_id, sequence);
+    forward(relay, NULL, relay->node_id, sequence, 1, metrics_now_ns(), message, length);
+}
+
+static void handle_frame(relay_t *relay, relay_peer_t *peer, char *frame)
+{
+    char message[RELAY_FRAME_SIZE] = {0};
+    unsigned int node_id = 0;
+    uint64_t sequence = 0;
+    uint64_t sent_ns = 0;
+    int hops = 0;
+    int header_length = 0;
+    int length = 0;
+
+    if (0 == strncmp(frame, RELAY_HELLO, sizeof(RELAY_HELLO)-1) &&
+        1 == sscanf(frame + sizeof(RELAY_HELLO)-1, " %u", &node_id))
+    {
+        if (0 == peer->node_id && 0 != node_id)
+        {
+            peer->node_id = node_id;
+            printf("Peer %08x joined the federation\n", node_id);
+        }
+        return;
+    }
+
+    if (0 != strncmp(frame, RELAY_MESSAGE, sizeof(RELAY_MESSAGE)-1) || 0 == peer->node_id ||
+        4 != sscanf(frame + sizeof(RELAY_MESSAGE)-1, " %u %lu %d %lu %n", &node_id, &sequence, &hops, &sent_ns, &header_length) ||
+        0 == header_length)
+    {
+        // Invalid frame :(
+        return;
+    }
+
+    if (!first_seen(relay, node_id, sequence))
+    {
+        metrics_relay_duplicate();
+        return;
+    }
+
+    // Restoring the '\n' framing removed
+    length = snprintf(message, sizeof(message), "%s\n", frame + sizeof(RELAY_MESSAGE)-1 + header_length);
+    if (sizeof(message) <= length)
+    {
+        length = sizeof(message) - 1;
+    }
+
+    // The clocks are comparable between processes on the same machine only
+    metrics_relayed_in(sent_ns);
+    relay->deliver(relay->context, node_id, sequence, message, length);
+
+    // Flooding, so servers that aren't connected to the origin get it too
+    if (RELAY_MAX_HOPS > hops)
+    {
+        forward(relay, peer, node_id, sequence, hops + 1, sent_ns, message, length);
+    }
+}
+
+static void handle_peer(relay_t *relay, relay_peer_t *peer)
+{
+    frame_buffer_t *input = &peer->input;
+    size_t offset = 0;
+    char *frame = NULL;
+    ssize_t bytes_recv = frame_recv(peer->fd, input);
+
+    if (-1 == bytes_recv && (EAGAIN == errno || EWOULDBLOCK == errno))
+    {
+        return;
+    }
+    if (0 >= bytes_recv)
+    {
+        close_peer(relay, peer);
+        return;
+    }
+    input->length += bytes_recv;
+
+    while (NULL != (frame = frame_next(input, &offset)))
+    {
+        handle_frame(relay, peer, frame);
+        if (NO_SOCKET == peer->fd)
+        {
+            // Dropped while forwarding
+            return;
+        }
+    }
+    frame_compact(input, offset);
+}
+
+void relay_handle(relay_t *relay, struct pollfd *poll_fds)
+{
+    uint64_t now = metrics_now_ms();
+
+    if (now >= relay->next_discover_ms)
+    {
+        send_discover(relay);
+        relay->next_discover_ms = now + RELAY_DISCOVER_INTERVAL;
+    }
+
+    if (poll_fds[0].revents)
+    {
+        accept_peer(relay);
+    }
+    if (poll_fds[1].revents)
+    {
+        handle_answers(relay);
+    }
+    for(int i=0; i < RELAY_MAX_PEERS; i++)
+    {
+        // Only the peers that were polled, one accepted meanwhile may have taken an empty slot
+        if (NO_SOCKET != relay->peers[i].fd && relay->peers[i].fd == poll_fds[i + 2].fd && poll_fds[i + 2].revents)
+        {
+            if (relay->peers[i].connecting)
+            {
+                finish_connect(relay, &relay->peers[i]);
+            }
+            else
+            {
+                handle_peer(relay, &relay->peers[i]);
+            }
+        }
+    }
+}
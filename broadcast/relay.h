@@ -0,0 +1,80 @@
+/**
+ ** Written by Amit Sides
+ **/
+
+#ifndef BROADCAST_RELAY_H
+#define BROADCAST_RELAY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <poll.h>
+
+#include "common.h"
+#include "framing.h"
+
+#define RELAY_MAX_PEERS         (8)
+#define RELAY_MAX_ORIGINS       (32)    // servers whose recent sequence numbers are remembered
+#define RELAY_WINDOW            (64)    // sequence numbers remembered per origin, a bit each
+#define RELAY_MAX_HOPS          (4)
+#define RELAY_DISCOVER_INTERVAL (2000)  // ms between looking for new peers
+#define RELAY_POLL_FDS          (RELAY_MAX_PEERS + 2) // listener, discovery and peers
+
+// Peer protocol, a line per frame:
+//   "HELLO <node id>"                                         sent by both sides when connecting
+//   "MSG <origin> <sequence> <hops> <sent ns> <message>"      a chat message, already formatted for clients
+#define RELAY_HELLO             ("HELLO")
+#define RELAY_MESSAGE           ("MSG")
+
+// Delivers a message relayed from another server to the local clients
+typedef void (*relay_deliver_t)(void *context, uint32_t origin, uint64_t sequence, char *message, size_t length);
+
+typedef struct relay_peer_s {
+    int fd;
+    uint32_t node_id;                   // 0 until the peer's HELLO
+    bool connecting;                    // the non-blocking connect is in progress
+    frame_buffer_t input;
+} relay_peer_t;
+
+// Duplicate detection, like an IPsec replay window
+typedef struct relay_origin_s {
+    uint32_t node_id;
+    uint64_t highest;                   // highest sequence number seen
+    uint64_t window;                    // bit i is set if highest - i was seen
+} relay_origin_t;
+
+// Federates broadcast servers into a single room. Servers find each other with DISCOVER/ALIVE and
+// the one with the lower node id connects, so every pair has a single link. Messages are flooded over
+// the mesh (so a partial mesh still reaches everyone) and dropped by the per-origin windows when
+// they arrive again over another path. Not thread-safe, everything runs on the chat loop, so the peer
+// sockets are non-blocking and a peer that would block the loop is dropped.
+typedef struct relay_s {
+    uint32_t node_id;
+    int listen_fd;
+    int port;
+    int discovery_fd;
+    const char *multicast_group;        // NULL to discover with a broadcast
+    uint64_t next_discover_ms;
+    int next_origin;                    // the origin entry replaced next when the table is full
+    relay_peer_t peers[RELAY_MAX_PEERS];
+    relay_origin_t origins[RELAY_MAX_ORIGINS];
+    relay_deliver_t deliver;
+    void *context;
+} relay_t;
+
+// A random id, so a restarted server is a new origin with fresh sequence numbers
+uint32_t relay_new_node_id();
+
+// Listens for peers on an ephemeral port (advertised in ALIVE) and starts looking for them
+void relay_init(relay_t *relay, uint32_t node_id, const char *multicast_group, relay_deliver_t deliver, void *context);
+
+// Fills RELAY_POLL_FDS entries for the chat loop's poll
+void relay_poll_fds(relay_t *relay, struct pollfd *poll_fds);
+
+// Handles the events of relay_poll_fds() (and looks for peers when due). Call on every iteration.
+void relay_handle(relay_t *relay, struct pollfd *poll_fds);
+
+// Sends a message of a local client to the peers, sequence numbers the messages originating here
+void relay_publish(relay_t *relay, uint64_t sequence, const char *message, size_t length);
+
+#endif //BROADCAST_RELAY_H
@@ -0,0 +1,352 @@
+/**
+ ** Written by Amit Sides
+ **/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "metrics.h"
+#include "responder.h"
+
+void responder_init(responder_t *responder)
+{
+    memset(responder, 0, sizeof(*responder));
+}
+
+void responder_publish(responder_t *responder, int clients, int capacity)
+{
+    responder_status_t *status = &responder->status;
+    uint32_t sequence = __atomic_load_n(&status->sequence, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&status->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&status->clients, clients, __ATOMIC_RELAXED);
+    __atomic_store_n(&status->capacity, capacity, __ATOMIC_RELAXED);
+    __atomic_store_n(&status->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+static void read_status(responder_t *responder, int *clients, int *capacity)
+{
+    responder_status_t *status = &responder->status;
+    uint32_t before = 0;
+    uint32_t after = 0;
+
+    do
+    {
+        before = __atomic_load_n(&status->sequence, __ATOMIC_ACQUIRE);
+        *clients = __atomic_load_n(&status->clients, __ATOMIC_RELAXED);
+        *capacity = __atomic_load_n(&status->capacity, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&status->sequence, __ATOMIC_RELAXED);
+    } while (before != after || 0 != (before & 1));
+}
+
+static source_entry_t *find_source(responder_t *responder, in_addr_t address, uint64_t now)
+{
+    // Fibonacci hashing of the address
+    uint32_t hash = (uint32_t)address * 2654435769u;
+    source_entry_t *source = &responder->sources[(hash >> 16) & (RESPONDER_SOURCES - 1)];
+
+    if (!source->used || source->address != address)
+    {
+        source->used = true;
+        source->address = address;
+        source->last_port = 0;
+        source->last_answer_ms = 0;
+        source->refilled_ms = now;
+        source->tokens = RESPONDER_BURST;
+    }
+    return source;
+}
+
+static bool should_answer(responder_t *responder, struct sockaddr_in *address, uint64_t now)
+{
+    source_entry_t *source = find_source(responder, address->sin_addr.s_addr, now);
+
+    source->tokens += (double)(now - source->refilled_ms) * RESPONDER_RATE / 1000;
+    if (RESPONDER_BURST < source->tokens)
+    {
+        source->tokens = RESPONDER_BURST;
+    }
+    source->refilled_ms = now;
+
+    // The same client asking again before it could get the answer (e.g. broadcast on several interfaces)
+    if (source->last_port == address->sin_port && 0 != source->last_answer_ms &&
+        now - source->last_answer_ms < RESPONDER_DEDUP_WINDOW)
+    {
+        return false;
+    }
+
+    if (1 > source->tokens)
+    {
+        return false;
+    }
+
+    source->tokens -= 1;
+    source->last_port = address->sin_port;
+    source->last_answer_ms = now;
+    return true;
+}
+
+static void send_answers(int fd, struct mmsghdr *answers, int count)
+{
+    int sent = 0;
+
+    while (sent < count)
+    {
+        int result = sendmmsg(fd, answers + sent, count - sent, 0);
+        if (-1 == result)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            perror("sendmmsg failed"); // Best-effort
+            return;
+        }
+        sent += result;
+    }
+}
+
+int responder_handle(responder_t *responder, int fd, const char *answer, size_t answer_length)
+{
+    char messages[RESPONDER_BATCH][MAX_MESSAGE_SIZE + 1];
+    struct sockaddr_in addresses[RESPONDER_BATCH];
+    struct iovec message_vectors[RESPONDER_BATCH];
+    struct mmsghdr requests[RESPONDER_BATCH];
+    struct iovec answer_vector = {(void *)answer, answer_length};
+    struct mmsghdr answers[RESPONDER_BATCH];
+    int answered = 0;
+    int suppressed = 0;
+
+    for(int batch=0; batch < RESPONDER_MAX_BATCHES; batch++)
+    {
+        int received = 0;
+        int to_answer = 0;
+        uint64_t now = 0;
+
+        memset(requests, 0, sizeof(requests));
+        for(int i=0; i < RESPONDER_BATCH; i++)
+        {
+            message_vectors[i].iov_base = messages[i];
+            message_vectors[i].iov_len = MAX_MESSAGE_SIZE;
+            requests[i].msg_hdr.msg_iov = &message_vectors[i];
+            requests[i].msg_hdr.msg_iovlen = 1;
+            requests[i].msg_hdr.msg_name = &addresses[i];
+            requests[i].msg_hdr.msg_namelen = sizeof(addresses[i]);
+        }
+
+        received = recvmmsg(fd, requests, RESPONDER_BATCH, MSG_DONTWAIT, NULL);
+        if (-1 == received)
+        {
+            if (EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno)
+            {
+                // We dont exit here because it could be a random broadcast
+                perror("Failed to read broadcast!");
+            }
+            break;
+        }
+
+        now = metrics_now_ns() / 1000000;
+        memset(answers, 0, sizeof(answers));
+        for(int i=0; i < received; i++)
+        {
+            messages[i][requests[i].msg_len] = '\0';
+            if (0 != strcmp(messages[i], BROADCAST_DISCOVER_MESSAGE))
+            {
+                continue;
+            }
+
+            if (!should_answer(responder, &addresses[i], now))
+            {
+                suppressed++;
+                continue;
+            }
+
+            // Every answer shares the same payload
+            answers[to_answer].msg_hdr.msg_iov = &answer_vector;
+            answers[to_answer].msg_hdr.msg_iovlen = 1;
+            answers[to_answer].msg_hdr.msg_name = &addresses[i];
+            answers[to_answer].msg_hdr.msg_namelen = requests[i].msg_hdr.msg_namelen;
+            to_answer++;
+        }
+
+        send_answers(fd, answers, to_answer);
+        answered += to_answer;
+
+        if (RESPONDER_BATCH > received)
+        {
+            // Drained
+            break;
+        }
+    }
+
+    responder->answered += answered;
+    responder->suppressed += suppressed;
+    metrics_discovers(answered, suppressed);
+    return answered;
+}
+
+void responder_set_relay(responder_t *responder, uint32_t node_id, int relay_port)
+{
+    responder->node_id = node_id;
+    responder->relay_port = relay_port;
+}
+
+void responder_set_announce(responder_t *responder, int interval_ms, int jitter_ms, struct in_addr destination)
+{
+    if (0 >= interval_ms || 0 > jitter_ms || interval_ms <= jitter_ms)
+    {
+        fprintf(stderr, "Invalid announcement interval %d ms (jitter %d ms)\n", interval_ms, jitter_ms);
+        exit(-1);
+    }
+
+    responder->announce_interval = interval_ms;
+    responder->announce_jitter = jitter_ms;
+    responder->announce_address.sin_family = AF_INET;
+    responder->announce_address.sin_port = htons(BROADCAST_PORT);
+    responder->announce_address.sin_addr = destination;
+    responder->random_seed = time(NULL) ^ getpid();
+}
+
+// "ALIVE:<port>:<clients>:<capacity>:<load>:<node id>:<relay port>", so clients can pick the least
+// loaded server and federated servers can find their peers
+static int format_answer(responder_t *responder, char *answer, size_t size)
+{
+    int clients = 0;
+    int capacity = 0;
+
+    read_status(responder, &clients, &capacity);
+    return snprintf(answer, size, "%s:%d:%d:%d:%d:%u:%d", BROADCAST_ANSWER_MESSAGE, responder->server_port,
+                    clients, capacity, 0 < capacity ? clients * MAXIMUM_LOAD / capacity : MAXIMUM_LOAD,
+                    responder->node_id, responder->relay_port);
+}
+
+static void announce(responder_t *responder, uint64_t now)
+{
+    char announcement[MAX_MESSAGE_SIZE] = {0};
+    int jitter = responder->announce_jitter;
+    int bytes_to_send = format_answer(responder, announcement, sizeof(announcement));
+
+    // Best-effort, a lost announcement is made up for by the next one
+    if (0 < bytes_to_send &&
+        -1 != sendto(responder->fd, announcement, bytes_to_send, 0,
+                     (struct sockaddr *)&responder->announce_address, sizeof(responder->announce_address)))
+    {
+        metrics_announced();
+    }
+
+    // Uniformly in [interval - jitter, interval + jitter]
+    responder->next_announce_ms = now + responder->announce_interval - jitter +
+                                  (0 < jitter ? rand_r(&responder->random_seed) % (2 * jitter + 1) : 0);
+}
+
+// A summary line at most every RESPONDER_LOG_INTERVAL instead of a line per DISCOVER, a storm would
+// otherwise hold the stdout lock the chat loop prints under
+static void log_answers(responder_t *responder)
+{
+    uint64_t now = metrics_now_ns() / 1000000;
+
+    if (now < responder->next_log_ms ||
+        (responder->answered == responder->logged_answered && responder->suppressed == responder->logged_suppressed))
+    {
+        return;
+    }
+
+    printf("Answered %lu DISCOVERs (%lu suppressed)\n", responder->answered - responder->logged_answered,
+           responder->suppressed - responder->logged_suppressed);
+    responder->logged_answered = responder->answered;
+    responder->logged_suppressed = responder->suppressed;
+    responder->next_log_ms = now + RESPONDER_LOG_INTERVAL;
+}
+
+// Until the next announcement, or forever when not announcing
+static int poll_timeout(responder_t *responder)
+{
+    uint64_t now = metrics_now_ns() / 1000000;
+
+    if (0 == responder->announce_interval)
+    {
+        return -1;
+    }
+    if (now >= responder->next_announce_ms)
+    {
+        announce(responder, now);
+    }
+    return responder->next_announce_ms - now;
+}
+
+static void *responder_thread(void *arguments)
+{
+    responder_t *responder = arguments;
+    struct pollfd poll_fd = {responder->fd, POLLIN, 0};
+    char answer[MAX_MESSAGE_SIZE] = {0};
+    int bytes_to_send = 0;
+    int result = 0;
+
+    while (true)
+    {
+        result = poll(&poll_fd, 1, poll_timeout(responder));
+        if (0 == result)
+        {
+            // Time to announce
+            continue;
+        }
+        if (-1 == result)
+        {
+            if (EINTR == errno)
+            {
+                // Interrupted by a profiler signal
+                continue;
+            }
+            perror("poll failed");
+            exit(-1);
+        }
+
+        // The load doesn't change while the pending DISCOVERs are drained, every one gets the same answer
+        bytes_to_send = format_answer(responder, answer, sizeof(answer));
+        if (0 > bytes_to_send)
+        {
+            fprintf(stderr, "Error: failed on snprintf\n");
+            continue;
+        }
+        responder_handle(responder, responder->fd, answer, bytes_to_send);
+        log_answers(responder);
+    }
+
+    return NULL;
+}
+
+void responder_start(responder_t *responder, int fd, int server_port)
+{
+    pthread_t tid;
+
+    responder->fd = fd;
+    responder->server_port = server_port;
+
+    int enabled = 1;
+    if (0 != responder->announce_interval &&
+        0 != setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &enabled, sizeof(enabled)))
+    {
+        perror("Failed to set SO_BROADCAST");
+        exit(errno);
+    }
+
+    errno = pthread_create(&tid, NULL, responder_thread, responder);
+    if (0 != errno)
+    {
+        perror("Failed to create the discovery responder thread");
+        exit(errno);
+    }
+    pthread_detach(tid);
+}
@@ -0,0 +1,83 @@
+/**
+ ** Written by Amit Sides
+ **/
+
+#ifndef BROADCAST_RESPONDER_H
+#define BROADCAST_RESPONDER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "common.h"
+
+#define RESPONDER_BATCH         (32)    // datagrams per recvmmsg/sendmmsg
+#define RESPONDER_MAX_BATCHES   (8)     // per wakeup, so during a DISCOVER storm the answers' load is refreshed
+                                        // and the announcements go out on time
+#define RESPONDER_SOURCES       (256)   // tracked source addresses, a power of two
+#define RESPONDER_DEDUP_WINDOW  (50)    // ms, a repeated DISCOVER from the same socket isn't answered again
+#define RESPONDER_RATE          (10)    // answers per second to a single source address
+#define RESPONDER_BURST         (20)
+#define RESPONDER_LOG_INTERVAL  (1000)  // ms, the answered DISCOVERs are printed at most this often
+#define ANNOUNCE_DEFAULT_JITTER (4)     // without an explicit jitter, an announcement is up to interval / 4 early or late
+
+typedef struct source_entry_s {
+    bool used;
+    in_addr_t address;
+    in_port_t last_port;                // the socket that was answered last
+    uint64_t last_answer_ms;
+    uint64_t refilled_ms;
+    double tokens;                      // token bucket, RESPONDER_RATE per second up to RESPONDER_BURST
+} source_entry_t;
+
+// The chat loop's load, published with a seqlock: the chat loop is the only writer, and the
+// responder thread retries a read that overlapped a write. Neither side ever waits for the other.
+typedef struct responder_status_s {
+    uint32_t sequence;                  // odd while a write is in progress
+    int clients;
+    int capacity;
+} responder_status_t;
+
+// Answers DISCOVERs in batches. The sources table is direct mapped, a colliding address replaces the entry.
+typedef struct responder_s {
+    source_entry_t sources[RESPONDER_SOURCES];
+    uint64_t answered;
+    uint64_t suppressed;
+    uint64_t logged_answered;           // the counts at the last printed summary
+    uint64_t logged_suppressed;
+    uint64_t next_log_ms;
+    responder_status_t status __attribute__((aligned(64))); // Away from the counters the thread writes
+    int fd;
+    int server_port;
+    uint32_t node_id;                   // federation, advertised in ALIVE (0 when not federated)
+    int relay_port;
+    int announce_interval;              // ms between unsolicited ALIVEs, 0 to only answer DISCOVERs
+    int announce_jitter;                // ms, every interval is randomly that much shorter or longer
+    struct sockaddr_in announce_address;
+    uint64_t next_announce_ms;
+    unsigned int random_seed;
+} responder_t;
+
+void responder_init(responder_t *responder);
+
+// Answers the DISCOVERs arriving on fd from a dedicated thread, so discovery latency doesn't depend
+// on the chat load (and the other way around)
+void responder_start(responder_t *responder, int fd, int server_port);
+
+// Advertises the server's relay, before responder_start()
+void responder_set_relay(responder_t *responder, uint32_t node_id, int relay_port);
+
+// Also sends an ALIVE to the destination (the broadcast address or the discovery group) every interval,
+// so listening clients know the servers before they discover. The jitter keeps servers started together
+// from announcing in bursts. Before responder_start().
+void responder_set_announce(responder_t *responder, int interval_ms, int jitter_ms, struct in_addr destination);
+
+// Publishes the chat loop's load for the following answers. Only one thread may publish.
+void responder_publish(responder_t *responder, int clients, int capacity);
+
+// Drains the pending datagrams and answers every DISCOVER that isn't a duplicate or rate limited.
+// Returns the amount of DISCOVERs answered.
+int responder_handle(responder_t *responder, int fd, const char *answer, size_t answer_length);
+
+#endif //BROADCAST_RESPONDER_H
@@ -14,110 +14,324 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <poll.h>
+#include <getopt.h>
 
 #include "common.h"
 #include "colors.h"
+#include "metrics.h"
+#include "profiler.h"
+#include "framing.h"
+#include "name_index.h"
+#include "responder.h"
+#include "relay.h"
+#include "history.h"
+#include "net.h"
 
 #define NO_SOCKET           (-1)
-#define SERVER_INTERFACE    ("0.0.0.0")
 #define MAXIMUM_CLIENTS     (sizeof(colors) / sizeof(*colors)) // = 6
 
 
 #define WELCOME_BANNER      ("Hello! Please enter your name: ")
+#define NAME_TAKEN_BANNER   ("is taken, please enter another name: ")
+#define PRIVATE_COMMAND     ("/msg ")
+#define USAGE               ("Usage: %s [-a <admin port | unix:path>] [-p] [-t <trace.json>] " \
+                             "[-g <multicast group>] [-i <multicast interface>] [-f] " \
+                             "[-A <announce interval ms> [-J <jitter ms>]] [-P <profile>] [-B <address>] <port>\n")
 
-int setup_server(int port);
-int setup_broadcast();
+#define RELAY_INDEX         (MAXIMUM_CLIENTS + 1) // The relay's fds are polled after the clients, when federated
+
+int setup_broadcast(const char *multicast_group, const char *multicast_interface);
 
 typedef struct client_s {
     int client_fd;
     char name[MAX_NAME_SIZE + 1];
+    frame_buffer_t input;
+    bool session;                       // room messages are tagged with their sequence numbers
 } client_t;
 
-void send_to_all_clients(client_t *clients, char *message, size_t length)
+typedef struct replay_target_s {
+    client_t *clients;
+    int client_index;
+} replay_target_t;
+
+// Name -> client slot, for uniqueness and direct messages
+name_index_t client_names = {0};
+
+// Batched, deduplicated and rate limited DISCOVER answers, from the responder thread
+responder_t responder = {0};
+
+int count_clients(client_t *clients);
+
+// Federation with the other servers on the segment (-f)
+relay_t relay = {0};
+bool federated = false;
+
+// Every room message is numbered by the server it originated at, and kept for resumed sessions
+uint32_t node_id = 0;
+uint64_t room_sequence = 0;
+history_t history = {0};
+
+// Lets the responder thread answer with the current load
+void publish_load(client_t *clients)
+{
+    responder_publish(&responder, count_clients(clients), MAXIMUM_CLIENTS);
+}
+
+void disconnect_client(client_t *clients, int client_index);
+
+bool send_to_client(client_t *clients, int client_index, char *message, size_t length)
 {
     int bytes_sent = 0;
-    int bytes_to_send = 0;
-    char send_message[MAX_NAME_SIZE + MAX_MESSAGE_SIZE + 10] = {0}; // +10 for metadata
+
+    errno = 0;
+    bytes_sent = send(clients[client_index].client_fd, message, length, MSG_NOSIGNAL);
+    if (ECONNRESET == errno || ETIMEDOUT == errno || EPIPE == errno)
+    {
+        // Client closed the connection
+        disconnect_client(clients, client_index);
+        return false;
+    }
+    else if (bytes_sent != length)
+    {
+        perror("Failed to send message");
+        exit(-1);
+    }
+
+    metrics_message_out(bytes_sent);
+    return true;
+}
+
+// "<tag><origin>:<sequence><tag><message>", for the session clients
+int tag_message(char *tagged, size_t size, uint32_t origin, uint64_t sequence, const char *message, size_t length)
+{
+    int tagged_length = snprintf(tagged, size, "%c%08x:%lu%c%.*s", SEQUENCE_TAG, origin, sequence, SEQUENCE_TAG,
+                                 (int)length, message);
+
+    if (0 > tagged_length)
+    {
+        perror("snprintf failed");
+        exit(-1);
+    }
+    if (size <= tagged_length)
+    {
+        // Truncated, sending what fits
+        tagged_length = size - 1;
+    }
+    return tagged_length;
+}
+
+// Sends to the clients of this server only
+void deliver_to_clients(client_t *clients, uint32_t origin, uint64_t sequence, char *message, size_t length)
+{
+    size_t recipients = 0;
+    char tagged[HISTORY_MESSAGE_SIZE + 32] = {0}; // +32 for the tag
+    int tagged_length = tag_message(tagged, sizeof(tagged), origin, sequence, message, length);
+
+    history_add(&history, origin, sequence, message, length);
 
     printf("%s", message);
     for(int i=0; i < MAXIMUM_CLIENTS; i++)
     {
-        if (NO_SOCKET == clients[i].client_fd)
+        // A client that didn't enter a name didn't join the room yet
+        if (NO_SOCKET == clients[i].client_fd || '\0' == clients[i].name[0])
         {
             continue;
         }
 
-        errno = 0;
-        bytes_sent = send(clients[i].client_fd, message, length, 0);
-        if (ECONNRESET == errno || ETIMEDOUT == errno)
+        if (clients[i].session ? send_to_client(clients, i, tagged, tagged_length) :
+                                 send_to_client(clients, i, message, length))
         {
-            // Client closed the connection
+            recipients++;
+        }
+    }
 
-            // Constructing a message to notify clients a client has disconnected.
-            bytes_to_send = snprintf(send_message, sizeof(send_message), "%sServer:\tClient %s%s%s%s %swas disconnected.%s\n",
-                                     BOLD_WHITE, RESET, colors[i], clients[i].name, RESET, BOLD_WHITE, RESET);
+    metrics_fanout(recipients);
+}
 
-            close(clients[i].client_fd);
-            clients[i].client_fd = NO_SOCKET;
-            memset(clients[i].name, 0, sizeof(clients[i].name));
-            send_to_all_clients(clients, send_message, bytes_to_send);
-        }
-        else if (bytes_sent != length)
-        {
-            perror("Failed to send message");
-            exit(-1);
-        }
+// Messages relayed from the other servers of the federation
+void deliver_relayed(void *context, uint32_t origin, uint64_t sequence, char *message, size_t length)
+{
+    deliver_to_clients(context, origin, sequence, message, length);
+}
+
+void send_to_all_clients(client_t *clients, char *message, size_t length)
+{
+    uint64_t sequence = ++room_sequence;
+
+    // Relaying first, the remote rooms shouldn't wait for the local fan-out
+    if (federated)
+    {
+        relay_publish(&relay, sequence, message, length);
     }
+    deliver_to_clients(clients, node_id, sequence, message, length);
 }
 
-void get_client_name(client_t *clients, int client_index)
+void replay_to_client(void *context, history_entry_t *entry)
 {
-    int bytes_recv = 0;
-    char send_message[MAX_NAME_SIZE + MAX_MESSAGE_SIZE + 10] = {0}; // +10 for metadata
+    replay_target_t *target = context;
+    char tagged[HISTORY_MESSAGE_SIZE + 32] = {0}; // +32 for the tag
+    int tagged_length = 0;
 
-    // Receive client name
-    bytes_recv = recv(clients[client_index].client_fd, clients[client_index].name, MAX_NAME_SIZE, 0);
-    if (-1 == bytes_recv && ECONNRESET != errno && ETIMEDOUT != errno)
+    if (NO_SOCKET == target->clients[target->client_index].client_fd)
     {
-        perror("recv failed");
-        exit(-1);
+        // Disconnected while replaying
+        return;
     }
+    tagged_length = tag_message(tagged, sizeof(tagged), entry->origin, entry->sequence, entry->message, entry->length);
+    send_to_client(target->clients, target->client_index, tagged, tagged_length);
+}
 
-    if (0 == bytes_recv || (-1 == bytes_recv && (ECONNRESET == errno || ETIMEDOUT == errno)))
+// Parses the "<origin>:<sequence>" cursors following the name, returns their amount
+int parse_cursors(char *text, session_cursor_t *cursors)
+{
+    int count = 0;
+    int consumed = 0;
+    unsigned int origin = 0;
+    unsigned long sequence = 0;
+
+    // Skipping the name
+    text += strcspn(text, " ");
+    while (MAX_ORIGINS > count && 2 == sscanf(text, " %x:%lu%n", &origin, &sequence, &consumed))
+    {
+        cursors[count].origin = origin;
+        cursors[count].sequence = sequence;
+        count++;
+        text += consumed;
+    }
+    return count;
+}
+
+// Replays the messages a client that failed over from another server missed
+void resume_session(client_t *clients, int client_index, uint64_t until, session_cursor_t *cursors, int cursor_count)
+{
+    replay_target_t target = {clients, client_index};
+    char send_message[MAX_MESSAGE_SIZE] = {0};
+    int bytes_to_send = 0;
+    size_t replayed = history_replay(&history, until, cursors, cursor_count, replay_to_client, &target);
+
+    if (NO_SOCKET == clients[client_index].client_fd)
+    {
+        return;
+    }
+    bytes_to_send = snprintf(send_message, sizeof(send_message), "%sServer:\tSession resumed, %lu missed messages replayed.%s\n",
+                             BOLD_WHITE, replayed, RESET);
+    send_to_client(clients, client_index, send_message, bytes_to_send);
+}
+
+void get_client_name(client_t *clients, int client_index, char *name)
+{
+    int bytes_to_send = 0;
+    char send_message[MAX_NAME_SIZE + MAX_MESSAGE_SIZE + 10] = {0}; // +10 for metadata
+
+    // Names are unique (direct messages are routed by them), spaces would break /msg
+    name[strcspn(name, " ")] = '\0';
+    if (MAX_NAME_SIZE < strlen(name))
+    {
+        name[MAX_NAME_SIZE] = '\0';
+    }
+    if ('\0' == name[0] || !name_index_insert(&client_names, name, client_index))
     {
-        // Client disconnected
-        close(clients[client_index].client_fd);
-        clients[client_index].client_fd = NO_SOCKET;
-        memset(clients[client_index].name, 0, sizeof(clients[client_index].name));
+        // Asking for another name, the client stays nameless until then
+        bytes_to_send = snprintf(send_message, sizeof(send_message), "%sServer:\tName '%s' %s%s",
+                                 BOLD_WHITE, name, NAME_TAKEN_BANNER, RESET);
+        send_to_client(clients, client_index, send_message, bytes_to_send);
         return;
     }
 
-    // null-terminating the name
-    clients[client_index].name[bytes_recv-1] = '\0';
+    // Copying the name, it is already null-terminated and truncated to MAX_NAME_SIZE
+    strncpy(clients[client_index].name, name, MAX_NAME_SIZE);
 
     // Notifying the chat room a new client has connected
-    bytes_recv = snprintf(send_message, sizeof(send_message), "%sServer:\tClient %s%s%s%s %shas connected.%s\n",
-                          BOLD_WHITE, RESET, colors[client_index], clients[client_index].name, RESET, BOLD_WHITE, RESET);
-    send_to_all_clients(clients, send_message, bytes_recv);
+    bytes_to_send = snprintf(send_message, sizeof(send_message), "%sServer:\tClient %s%s%s%s %shas connected.%s\n",
+                             BOLD_WHITE, RESET, colors[client_index], clients[client_index].name, RESET, BOLD_WHITE, RESET);
+    send_to_all_clients(clients, send_message, bytes_to_send);
 }
 
-void handle_client(client_t *clients, int client_index)
+void disconnect_client(client_t *clients, int client_index)
 {
-    int bytes_recv = 0;
     int bytes_to_send = 0;
-    char recv_message[MAX_MESSAGE_SIZE] = {0};
+    bool named = '\0' != clients[client_index].name[0];
     char send_message[MAX_NAME_SIZE + MAX_MESSAGE_SIZE + 10] = {0}; // +10 for metadata
 
-    // Checks if the client has entered a name already
-    if ('\0' == clients[client_index].name[0])
+    // Constructing a message to notify clients a client has disconnected.
+    bytes_to_send = snprintf(send_message, sizeof(send_message), "%sServer:\tClient %s%s%s%s %swas disconnected.%s\n",
+                             BOLD_WHITE, RESET, colors[client_index], clients[client_index].name, RESET, BOLD_WHITE, RESET);
+
+    // Resetting client struct
+    if (named)
+    {
+        name_index_remove(&client_names, clients[client_index].name);
+    }
+    close(clients[client_index].client_fd);
+    clients[client_index].client_fd = NO_SOCKET;
+    memset(clients[client_index].name, 0, sizeof(clients[client_index].name));
+    metrics_disconnected();
+    publish_load(clients);
+
+    // A client that didn't enter a name never joined the chat room
+    if (named)
+    {
+        send_to_all_clients(clients, send_message, bytes_to_send);
+    }
+}
+
+void send_private_message(client_t *clients, int client_index, char *command)
+{
+    int bytes_to_send = 0;
+    int recipient = 0;
+    char *text = command + strcspn(command, " ");
+    char send_message[MAX_NAME_SIZE * 2 + MAX_MESSAGE_SIZE + 20] = {0}; // +20 for metadata
+
+    // "/msg <name> <text>", splitting the name from the text
+    if ('\0' != *text)
+    {
+        *text++ = '\0';
+    }
+
+    recipient = name_index_find(&client_names, command);
+    if (NAME_INDEX_NOT_FOUND == recipient || '\0' == *text)
     {
-        // A client has no name
-        get_client_name(clients, client_index);
+        bytes_to_send = snprintf(send_message, sizeof(send_message), "%sServer:\tNo client named '%s'%s\n",
+                                 BOLD_WHITE, command, RESET);
+        if ('\0' == *text)
+        {
+            bytes_to_send = snprintf(send_message, sizeof(send_message), "%sServer:\tUsage: %s<name> <text>%s\n",
+                                     BOLD_WHITE, PRIVATE_COMMAND, RESET);
+        }
+        send_to_client(clients, client_index, send_message, bytes_to_send);
         return;
     }
 
-    // Receive client message
-    bytes_recv = recv(clients[client_index].client_fd, recv_message, sizeof(recv_message), 0);
+    bytes_to_send = snprintf(send_message, sizeof(send_message), "%s%s -> %s:\t%.*s%s\n",
+                             colors[client_index], clients[client_index].name, clients[recipient].name,
+                             MAX_MESSAGE_SIZE, text, RESET);
+    if (sizeof(send_message) <= bytes_to_send)
+    {
+        bytes_to_send = sizeof(send_message) - 1;
+    }
+
+    metrics_fanout(1);
+    if (send_to_client(clients, recipient, send_message, bytes_to_send) && recipient != client_index)
+    {
+        // The sender sees its own direct message too
+        send_to_client(clients, client_index, send_message, bytes_to_send);
+    }
+}
+
+void handle_client(client_t *clients, int client_index)
+{
+    int bytes_recv = 0;
+    int bytes_to_send = 0;
+    size_t offset = 0;
+    char *message = NULL;
+    frame_buffer_t *input = &clients[client_index].input;
+    uint64_t profile_start = 0;
+    char send_message[MAX_NAME_SIZE + MAX_MESSAGE_SIZE + 10] = {0}; // +10 for metadata
+
+    // Receive whatever the client sent, it may hold several messages or only a part of one
+    profile_start = profiler_begin();
+    bytes_recv = frame_recv(clients[client_index].client_fd, input);
+    profiler_end(PROFILE_RECV, profile_start);
     if (-1 == bytes_recv && ECONNRESET != errno && ETIMEDOUT != errno)
     {
         perror("recv failed");
@@ -128,50 +342,123 @@ void handle_client(client_t *clients, int client_index)
     if (0 == bytes_recv || (-1 == bytes_recv && (ECONNRESET == errno || ETIMEDOUT == errno)))
     {
         // Connection probably closed...
-        // Constructing a message to notify clients a client has disconnected.
-        bytes_to_send = snprintf(send_message, sizeof(send_message), "%sServer:\tClient %s%s%s%s %swas disconnected.%s\n",
-                              BOLD_WHITE, RESET, colors[client_index], clients[client_index].name, RESET, BOLD_WHITE, RESET);
-        // Resetting client struct
-        close(clients[client_index].client_fd);
-        clients[client_index].client_fd = NO_SOCKET;
-        memset(clients[client_index].name, 0, sizeof(clients[client_index].name));
+        disconnect_client(clients, client_index);
+        return;
     }
-    else
+    input->length += bytes_recv;
+    net_received(clients[client_index].client_fd);
+
+    // Handling every complete message, the partial tail stays in the buffer for the next read
+    while (NULL != (message = frame_next(input, &offset)))
     {
+        if ('\0' == message[0])
+        {
+            // Empty line
+            continue;
+        }
+        metrics_message_in(strlen(message));
+
+        // Checks if the client has entered a name already
+        if ('\0' == clients[client_index].name[0])
+        {
+            session_cursor_t cursors[MAX_ORIGINS];
+            int cursor_count = 0;
+            bool resume = false;
+            uint64_t missed_until = history.added; // Not the client's own "has connected"
+
+            // Session clients name themselves with a command
+            if (0 == strncmp(message, SESSION_COMMAND, sizeof(SESSION_COMMAND) - 1))
+            {
+                clients[client_index].session = true;
+                message += sizeof(SESSION_COMMAND) - 1;
+            }
+            else if (0 == strncmp(message, RESUME_COMMAND, sizeof(RESUME_COMMAND) - 1))
+            {
+                clients[client_index].session = true;
+                message += sizeof(RESUME_COMMAND) - 1;
+                cursor_count = parse_cursors(message, cursors);
+                resume = true;
+            }
+
+            // The first message of a client is its name
+            get_client_name(clients, client_index, message);
+            if (NO_SOCKET == clients[client_index].client_fd)
+            {
+                return;
+            }
+            if (resume && '\0' != clients[client_index].name[0])
+            {
+                resume_session(clients, client_index, missed_until, cursors, cursor_count);
+                if (NO_SOCKET == clients[client_index].client_fd)
+                {
+                    return;
+                }
+            }
+            continue;
+        }
+
+        if (0 == strncmp(message, PRIVATE_COMMAND, sizeof(PRIVATE_COMMAND) - 1))
+        {
+            // A direct message, only the recipient (and the sender) get it
+            send_private_message(clients, client_index, message + sizeof(PRIVATE_COMMAND) - 1);
+            if (NO_SOCKET == clients[client_index].client_fd)
+            {
+                return;
+            }
+            continue;
+        }
+
         // A message was received. Construct a message to deliver to the other clients.
-        recv_message[bytes_recv-1] = '\0'; // replacing new-line with null-terminator
-        // Constructing the message to send to the users
-        bytes_to_send = snprintf(send_message, sizeof(send_message), "%s%s:\t%s%s\n",
-                              colors[client_index], clients[client_index].name, recv_message, RESET);
+        profile_start = profiler_begin();
+        bytes_to_send = snprintf(send_message, sizeof(send_message), "%s%s:\t%.*s%s\n",
+                                 colors[client_index], clients[client_index].name, MAX_MESSAGE_SIZE, message, RESET);
+        profiler_end(PROFILE_FORMAT, profile_start);
 
-    }
+        // Checks the call to snprintf was successful
+        if (0 > bytes_to_send)
+        {
+            perror("snprintf failed");
+            exit(-1);
+        }
+        if (sizeof(send_message) <= bytes_to_send)
+        {
+            // Truncated, sending what fits
+            bytes_to_send = sizeof(send_message) - 1;
+        }
 
-    // Checks the call to snprintf was successful
-    if (0 > bytes_to_send)
-    {
-        perror("snprintf failed");
-        exit(-1);
+        // Sending the message to all clients...
+        profile_start = profiler_begin();
+        send_to_all_clients(clients, send_message, bytes_to_send);
+        profiler_end(PROFILE_FANOUT, profile_start);
+
+        if (NO_SOCKET == clients[client_index].client_fd)
+        {
+            // The client was disconnected while sending to it
+            return;
+        }
     }
 
-    // Sending the message to all clients...
-    send_to_all_clients(clients, send_message, bytes_to_send);
+    frame_compact(input, offset);
 }
 
-int handle_poll(int server_fd, int broadcast_fd, client_t *clients, struct pollfd *poll_fds)
+int handle_poll(int server_fd, client_t *clients, struct pollfd *poll_fds)
 {
     // Initializing the poll_fds array
     poll_fds[0].fd = server_fd;
     poll_fds[0].events = POLLIN | POLLHUP;
-    poll_fds[1].fd = broadcast_fd;
-    poll_fds[1].events = POLLIN | POLLHUP;
-    for(int i=2; i < MAXIMUM_CLIENTS + 2; i++)
+    for(int i=1; i < MAXIMUM_CLIENTS + 1; i++)
     {
-        poll_fds[i].fd = clients[i-2].client_fd;
+        poll_fds[i].fd = clients[i-1].client_fd;
         poll_fds[i].events = POLLIN | POLLHUP;
     }
 
+    if (federated)
+    {
+        relay_poll_fds(&relay, &poll_fds[RELAY_INDEX]);
+    }
+
     // Calling poll with array
-    return poll(poll_fds, MAXIMUM_CLIENTS + 2, 0);
+    return poll(poll_fds, MAXIMUM_CLIENTS + 1 + (federated ? RELAY_POLL_FDS : 0), 0);
 }
 
 void handle_new_client(int server_fd, client_t *clients) {
@@ -185,6 +472,9 @@ void handle_new_client(int server_fd, client_t *clients) {
         perror("accept failed");
         return;
     }
+    metrics_accepted();
+    net_accepted(client_fd);
+
     for (int i = 0; i < MAXIMUM_CLIENTS && !connected; i++) {
         if (NO_SOCKET != clients[i].client_fd) {
             continue;
@@ -192,11 +482,15 @@ void handle_new_client(int server_fd, client_t *clients) {
 
         // Found an empty client slot
         clients[i].client_fd = client_fd;
+        frame_reset(&clients[i].input);
+        clients[i].session = false;
         connected = true;
     }
+    publish_load(clients);
 
     if (!connected) {
         close(client_fd);
+        metrics_disconnected();
     }
     else
     {
@@ -212,52 +506,29 @@ void handle_new_client(int server_fd, client_t *clients) {
 
 void handle_messages(client_t *clients, struct pollfd *poll_fds)
 {
-    for(int i=2; i < MAXIMUM_CLIENTS+2; i++)
+    for(int i=1; i < MAXIMUM_CLIENTS+1; i++)
     {
-        if (NO_SOCKET != clients[i-2].client_fd && poll_fds[i].revents)
+        if (NO_SOCKET != clients[i-1].client_fd && poll_fds[i].revents)
         {
-            handle_client(clients, i-2);
+            uint64_t start = metrics_now_ns();
+            handle_client(clients, i-1);
+            metrics_handling_time(start);
         }
     }
 }
 
-void handle_broadcast(int broadcast_fd, int server_port)
+int count_clients(client_t *clients)
 {
-    int bytes_recv = 0;
-    struct sockaddr_in client_address = {0};
-    socklen_t client_address_size = sizeof(client_address);
-    char message[MAX_MESSAGE_SIZE] = {0};
+    int connected = 0;
 
-    bytes_recv = recvfrom(broadcast_fd, message, sizeof(message), 0, &client_address, &client_address_size);
-    switch(bytes_recv)
-    {
-        case -1:
-            perror("Failed to read broadcast!");
-            // We dont exit here because it could be a random broadcast
-            return;
-        case 0:
-            // Connection error? anyways, UDP is best effort...
-            return;
-        default:
-            break;
-    }
-    if (0 == strcmp(message, BROADCAST_DISCOVER_MESSAGE))
+    for(int i=0; i < MAXIMUM_CLIENTS; i++)
     {
-        // We got a DISCOVER message, send respond...
-
-        printf("Received Discover broadcast from %s:%d\n", inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port));
-
-        int bytes_to_send = snprintf(message, sizeof(message), "%s:%d", BROADCAST_ANSWER_MESSAGE, server_port);
-        if (0 > bytes_to_send)
-        {
-            fprintf(stderr, "Error: failed on snprintf\n");
-            return;
-        }
-        if (-1 == sendto(broadcast_fd, message, bytes_to_send, 0, &client_address, client_address_size))
+        if (NO_SOCKET != clients[i].client_fd)
         {
-            perror("sendto failed"); // Best-effort
+            connected++;
         }
     }
+    return connected;
 }
 
 int main(int argc, char *argv[])
@@ -266,16 +537,75 @@ int main(int argc, char *argv[])
     int poll_result = 0;
     int broadcast_fd = 0;
     int server_port = 0;
+    int option = 0;
+    bool profile = false;
+    char *trace_path = NULL;
+    char *socket_profile = NULL;
+    char *address = NULL;
+    char *multicast_group = NULL;
+    char *multicast_interface = NULL;
+    int announce_interval = 0;
+    int announce_jitter = -1;
+    struct in_addr announce_destination = {htonl(INADDR_BROADCAST)};
+    uint64_t profile_start = 0;
     client_t clients[MAXIMUM_CLIENTS];
-    struct pollfd poll_fds[MAXIMUM_CLIENTS + 2]; // +2 for server and broadcast fds
+    struct pollfd poll_fds[MAXIMUM_CLIENTS + 1 + RELAY_POLL_FDS]; // +1 for the server fd
+
+    metrics_init("broadcast_server");
 
-    if (argc < 2)
+    while (-1 != (option = getopt(argc, argv, "a:pt:g:i:fA:J:P:B:")))
     {
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]);
+        switch (option)
+        {
+        case 'a':
+            // Optional admin listener, serving Prometheus metrics off the chat loop
+            metrics_start_admin_thread(metrics_setup_admin(optarg));
+            break;
+        case 'p':
+            // Profile from startup (otherwise toggled with SIGUSR1)
+            profile = true;
+            break;
+        case 't':
+            trace_path = optarg;
+            break;
+        case 'g':
+            // Also answering multicast discovery (broadcasts are still answered)
+            multicast_group = optarg;
+            break;
+        case 'i':
+            multicast_interface = optarg;
+            break;
+        case 'f':
+            // Sharing the room with the other federated servers
+            federated = true;
+            break;
+        case 'A':
+            // Announcing the server periodically, for clients that listen instead of discovering
+            announce_interval = atoi(optarg);
+            break;
+        case 'J':
+            announce_jitter = atoi(optarg);
+            break;
+        case 'P':
+            socket_profile = optarg;
+            break;
+        case 'B':
+            address = optarg;
+            break;
+        default:
+            fprintf(stderr, USAGE, argv[0]);
+            fputs(NET_PROFILE_USAGE, stderr);
+            return -1;
+        }
+    }
+
+    if (argc <= optind)
+    {
+        fprintf(stderr, USAGE, argv[0]);
         return -1;
     }
 
-    server_port = atoi(argv[1]);
+    server_port = atoi(argv[optind]);
     if (0 >= server_port)
     {
         fprintf(stderr, "Error: Port must be greater than 0!\n");
@@ -283,50 +613,123 @@ int main(int argc, char *argv[])
     }
 
     // Initializes clients
+    name_index_init(&client_names, MAXIMUM_CLIENTS);
+    responder_init(&responder);
     for(int i=0; i < MAXIMUM_CLIENTS; i++)
     {
         clients[i].client_fd = NO_SOCKET;
         memset(clients[i].name, 0, sizeof(clients[i].name));
     }
 
+    profiler_init(trace_path, profile);
+    node_id = relay_new_node_id();
+
     // Setup the server (socket, bind, listen)
-    server_fd = setup_server(server_port);
+    net_configure(socket_profile, address);
+    server_fd = net_listen(server_port);
 
-    // Setup the broadcast listener
-    broadcast_fd = setup_broadcast();
+    // Setup the broadcast listener, answered by the responder thread
+    broadcast_fd = setup_broadcast(multicast_group, multicast_interface);
+    publish_load(clients);
+    if (federated)
+    {
+        relay_init(&relay, node_id, multicast_group, deliver_relayed, clients);
+        responder_set_relay(&responder, relay.node_id, relay.port);
+    }
+    if (0 != announce_interval)
+    {
+        // To the group when discovered with multicast, as the listening clients joined it
+        if (NULL != multicast_group)
+        {
+            inet_pton(AF_INET, multicast_group, &announce_destination);
+        }
+        responder_set_announce(&responder, announce_interval,
+                               0 > announce_jitter ? announce_interval / ANNOUNCE_DEFAULT_JITTER : announce_jitter,
+                               announce_destination);
+    }
+    responder_start(&responder, broadcast_fd, server_port);
 
     while(true)
     {
-        poll_result = handle_poll(server_fd, broadcast_fd, clients, poll_fds);
+        profile_start = profiler_begin();
+        poll_result = handle_poll(server_fd, clients, poll_fds);
+        profiler_end_wait(profile_start, poll_result);
         switch (poll_result)
         {
         case -1:
+            if (EINTR == errno)
+            {
+                // Interrupted by a profiler signal
+                break;
+            }
             perror("poll failed");
             exit(-1);
         case 0:
             // Timeout has occurred
             break;
         default:
+            metrics_queue_depth(poll_result);
             if (poll_fds[0].revents)
             {
                 // A new client is connecting
+                profile_start = profiler_begin();
                 handle_new_client(server_fd, clients);
-            }
-            else if(poll_fds[1].revents)
-            {
-                // A broadcast was received
-                handle_broadcast(broadcast_fd, server_port);
+                profiler_end(PROFILE_NEW_CLIENT, profile_start);
             }
             else
             {
                 // One client or more sent a message
+                profile_start = profiler_begin();
                 handle_messages(clients, poll_fds);
+                profiler_end(PROFILE_MESSAGES, profile_start);
             }
         }
+
+        if (federated)
+        {
+            // Relayed messages, and looking for new peers (so also without any event)
+            relay_handle(&relay, &poll_fds[RELAY_INDEX]);
+        }
+    }
+}
+
+// Joins the discovery multicast group, on the given interface address (or the default one)
+void join_multicast_group(int broadcast_fd, const char *multicast_group, const char *multicast_interface)
+{
+    struct ip_mreq membership = {0};
+
+    if (1 != inet_pton(AF_INET, multicast_group, &membership.imr_multiaddr) ||
+        !IN_MULTICAST(ntohl(membership.imr_multiaddr.s_addr)))
+    {
+        fprintf(stderr, "Invalid multicast group '%s'\n", multicast_group);
+        exit(-1);
+    }
+
+    membership.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (NULL != multicast_interface && 1 != inet_pton(AF_INET, multicast_interface, &membership.imr_interface))
+    {
+        fprintf(stderr, "Invalid multicast interface '%s'\n", multicast_interface);
+        exit(-1);
+    }
+
+    if (0 != setsockopt(broadcast_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)))
+    {
+        perror("Failed to join the multicast group");
+        exit(errno);
+    }
+
+    // Announcements leave through the same interface
+    if (INADDR_ANY != membership.imr_interface.s_addr &&
+        0 != setsockopt(broadcast_fd, IPPROTO_IP, IP_MULTICAST_IF, &membership.imr_interface, sizeof(membership.imr_interface)))
+    {
+        perror("Failed to set IP_MULTICAST_IF");
+        exit(errno);
     }
+
+    printf("Joined multicast group %s\n", multicast_group);
 }
 
-int setup_broadcast()
+int setup_broadcast(const char *multicast_group, const char *multicast_interface)
 {
     struct sockaddr_in broadcast_address = {0};
     int broadcast_fd = 0;
@@ -359,49 +762,22 @@ int setup_broadcast()
         exit(errno);
     }
 
-    printf("Listening for broadcasts on %d...\n", BROADCAST_PORT);
-
-    return broadcast_fd;
-}
-
-int setup_server(int port)
-{
-    struct sockaddr_in server_address = {0};
-    int server_fd = 0;
-
-    // Creates the server socket
-    server_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
-    if (-1 == server_fd) {
-        perror("Failed to create server socket");
-        exit(errno);
-    }
-
-    // Sets socket option SO_REUSEADDR, other processes will be able to listen on this port
-    // (enables quick restart of the server)
-    int enabled = 1;
-    if (0 != setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &enabled, sizeof(enabled)))
+    // By default Linux delivers datagrams of any group joined on the host to every socket bound to the port,
+    // so servers that didn't join would answer multicast discovery too
+    int multicast_all = 0;
+    if (0 != setsockopt(broadcast_fd, IPPROTO_IP, IP_MULTICAST_ALL, &multicast_all, sizeof(multicast_all)))
     {
-        perror("Failed to set SO_REUSEADDR");
+        perror("Failed to set IP_MULTICAST_ALL");
         exit(errno);
     }
 
-    // Construct the server's data struct
-    server_address.sin_family = AF_INET;
-    server_address.sin_addr.s_addr = inet_addr(SERVER_INTERFACE);
-    server_address.sin_port = htons(port);
-
-    // Bind server socket to the network interface
-    if (0 != bind(server_fd, (struct sockaddr *)&server_address, sizeof(server_address))) {
-        perror("Failed to bind");
-        exit(errno);
+    // The socket is bound to INADDR_ANY, so it gets the group's datagrams as well as broadcasts
+    if (NULL != multicast_group)
+    {
+        join_multicast_group(broadcast_fd, multicast_group, multicast_interface);
     }
 
-    // Listen for incoming clients
-    if (0 != listen(server_fd, 0)) {
-        perror("Failed to listen");
-        exit(errno);
-    }
+    printf("Listening for broadcasts on %d...\n", BROADCAST_PORT);
 
-    printf("Listening for incoming connections...\n");
-    return server_fd;
+    return broadcast_fd;
 }
@@ -0,0 +1,224 @@
+/**
+ ** Written by Amit Sides
+ **/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "affinity.h"
+
+#define PLACEMENT_SPEC_SIZE     (256)
+#define CPU_DIRECTORY_FORMAT    ("/sys/devices/system/cpu/cpu%d")
+#define MEMORY_POLICY_PREFERRED (1)     // MPOL_PREFERRED, <numaif.h> comes with libnuma
+#define MAX_NODES               (1024)
+
+static affinity_t affinity = {0};
+
+// "0-3+8" into a CPU set
+static void parse_cpus(const char *option, char *list, cpu_set_t *cpus)
+{
+    char *range = NULL;
+    char *saved = NULL;
+    char *end = NULL;
+    long first = 0;
+    long last = 0;
+
+    CPU_ZERO(cpus);
+    for (range = strtok_r(list, "+", &saved); NULL != range; range = strtok_r(NULL, "+", &saved))
+    {
+        first = strtol(range, &end, 10);
+        last = first;
+        if ('-' == *end)
+        {
+            last = strtol(end + 1, &end, 10);
+        }
+        if (end == range || '\0' != *end || 0 > first || first > last || CPU_SETSIZE <= last)
+        {
+            fprintf(stderr, "Invalid CPU list '%s' for %s\n", range, option);
+            exit(-1);
+        }
+        for(long cpu=first; cpu <= last; cpu++)
+        {
+            CPU_SET(cpu, cpus);
+        }
+    }
+}
+
+static void parse_option(char *option)
+{
+    char *value = strchr(option, '=');
+    cpu_set_t cpus;
+
+    if (NULL != value)
+    {
+        *value++ = '\0';
+    }
+
+    if (0 == strcmp(option, "pin") && NULL == value)
+    {
+        affinity.pin = true;
+    }
+    else if (0 == strcmp(option, "numa") && NULL == value)
+    {
+        affinity.pin = true;
+        affinity.numa = true;
+    }
+    else if (0 == strcmp(option, "cpus") && NULL != value)
+    {
+        parse_cpus(option, value, &cpus);
+        CPU_AND(&affinity.allowed, &affinity.allowed, &cpus);
+    }
+    else if (0 == strcmp(option, "irq") && NULL != value)
+    {
+        // The interrupts' CPUs are set in /proc/irq/<n>/smp_affinity, the server stays off them
+        parse_cpus(option, value, &cpus);
+        CPU_XOR(&cpus, &cpus, &affinity.allowed);
+        CPU_AND(&affinity.allowed, &affinity.allowed, &cpus);
+    }
+    else
+    {
+        fprintf(stderr, "Unknown CPU placement option '%s'\n", option);
+        exit(-1);
+    }
+}
+
+void affinity_configure(const char *spec)
+{
+    char placement[PLACEMENT_SPEC_SIZE] = {0};
+    char *option = NULL;
+    char *saved = NULL;
+
+    if (NULL == spec)
+    {
+        return;
+    }
+
+    // Starts from the CPUs the server was started on (taskset, cgroups)
+    if (0 != sched_getaffinity(0, sizeof(affinity.allowed), &affinity.allowed))
+    {
+        perror("sched_getaffinity failed");
+        exit(errno);
+    }
+    snprintf(placement, sizeof(placement), "%s", spec);
+    for (option = strtok_r(placement, ",", &saved); NULL != option; option = strtok_r(NULL, ",", &saved))
+    {
+        parse_option(option);
+    }
+
+    affinity.cpu_count = 0;
+    for(int cpu=0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, &affinity.allowed))
+        {
+            affinity.cpus[affinity.cpu_count++] = cpu;
+        }
+    }
+    if (0 == affinity.cpu_count)
+    {
+        fprintf(stderr, "No CPU left for the server in '%s'\n", spec);
+        exit(-1);
+    }
+
+    // Inherited by every thread created from now on: the accepting thread, the admin listener, the clients
+    if (0 != sched_setaffinity(0, sizeof(affinity.allowed), &affinity.allowed))
+    {
+        perror("Failed to restrict the server's CPUs");
+        exit(errno);
+    }
+
+    printf("Running on CPUs");
+    for(int i=0; i < affinity.cpu_count; i++)
+    {
+        printf(" %d", affinity.cpus[i]);
+    }
+    printf("%s%s\n", affinity.pin ? ", pinned" : "", affinity.numa ? ", NUMA local memory" : "");
+}
+
+int affinity_cpu_count()
+{
+    if (0 == affinity.cpu_count)
+    {
+        return sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    return affinity.cpu_count;
+}
+
+// The NUMA node of a CPU, its sysfs directory has a node<n> link. 0 without NUMA.
+static int cpu_node(int cpu)
+{
+    char path[64] = {0};
+    struct dirent *entry = NULL;
+    DIR *directory = NULL;
+    int node = 0;
+
+    snprintf(path, sizeof(path), CPU_DIRECTORY_FORMAT, cpu);
+    directory = opendir(path);
+    if (NULL == directory)
+    {
+        return 0;
+    }
+    while (NULL != (entry = readdir(directory)))
+    {
+        if (1 == sscanf(entry->d_name, "node%d", &node))
+        {
+            break;
+        }
+    }
+    closedir(directory);
+    return node;
+}
+
+// Pages the thread touches from now on come from the node, when it has free memory. The kernel's default
+// allocates on the node the thread runs on when it faults, which a migrated thread leaves behind.
+static void prefer_node(int node)
+{
+    unsigned long nodes[MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+
+    if (MAX_NODES <= node)
+    {
+        return;
+    }
+    nodes[node / (8 * sizeof(unsigned long))] |= 1ul << (node % (8 * sizeof(unsigned long)));
+    if (0 != syscall(SYS_set_mempolicy, MEMORY_POLICY_PREFERRED, nodes, sizeof(nodes) * 8 + 1))
+    {
+        // A kernel without NUMA support, the thread is still pinned
+        perror("Warning: failed to set the NUMA memory policy");
+    }
+}
+
+void affinity_apply(int index)
+{
+    cpu_set_t cpus;
+    int cpu = 0;
+
+    if (!affinity.pin)
+    {
+        return;
+    }
+    if (AFFINITY_NEXT == index)
+    {
+        index = __atomic_fetch_add(&affinity.next, 1, __ATOMIC_RELAXED);
+    }
+
+    cpu = affinity.cpus[(unsigned int)index % affinity.cpu_count];
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    errno = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (0 != errno)
+    {
+        perror("Failed to pin a thread");
+        exit(errno);
+    }
+    if (affinity.numa)
+    {
+        prefer_node(cpu_node(cpu));
+    }
+}
@@ -0,0 +1,39 @@
+/**
+ ** Written by Amit Sides
+ **/
+
+#ifndef CORE_AFFINITY_H
+#define CORE_AFFINITY_H
+
+#include <stdbool.h>
+#include <sched.h>               // cpu_set_t, needs _GNU_SOURCE
+
+#define AFFINITY_NEXT           (-1)        // affinity_apply() index of the next CPU, round-robin
+#define AFFINITY_USAGE          ("  -A  CPU placement, comma separated: cpus=<list> runs the server on these CPUs only,\n" \
+                                 "      irq=<list> leaves these CPUs to interrupts, pin gives every worker a CPU of its own\n" \
+                                 "      (round-robin), numa pins and keeps a worker's memory on its CPU's NUMA node.\n" \
+                                 "      Lists are CPUs and ranges joined with +, e.g. cpus=0-5+8,irq=0,pin\n")
+
+// Where the server's threads run. Unpinned threads float over the allowed CPUs, the scheduler may migrate
+// them (and their cache and memory locality), pinned threads stay on a single CPU.
+typedef struct affinity_s {
+    cpu_set_t allowed;                  // without the IRQ CPUs
+    int cpus[CPU_SETSIZE];              // the allowed CPUs in order, the n-th pinned thread runs on cpus[n % count]
+    int cpu_count;
+    bool pin;
+    bool numa;                          // memory preferred from the pinned CPU's node
+    unsigned int next;                  // round-robin for AFFINITY_NEXT
+} affinity_t;
+
+// Parses the placement (NULL keeps the default, no placement) and restricts the calling thread to the
+// allowed CPUs, every thread it creates afterwards inherits them. Call from main(), before starting threads.
+void affinity_configure(const char *spec);
+
+// The CPUs the server may use, for a worker per CPU
+int affinity_cpu_count();
+
+// Pins the calling thread to the index-th allowed CPU (AFFINITY_NEXT for the next one), with the NUMA memory
+// policy when configured. Does nothing unless pinning. Called by the workers and carriers when they start.
+void affinity_apply(int index);
+
+#endif //CORE_AFFINITY_H
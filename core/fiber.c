@@ -0,0 +1,344 @@
+/**
+ ** Written by Amit Sides
+ **/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "fiber.h"
+#include "affinity.h"
+
+// The carrier running on this thread, NULL outside the carriers
+static __thread fiber_carrier_t *current_carrier = NULL;
+
+static size_t page_size = 0;
+
+static void push_ready(fiber_carrier_t *carrier, fiber_t *fiber)
+{
+    fiber->next = NULL;
+    if (NULL == carrier->ready_tail)
+    {
+        carrier->ready_head = fiber;
+    }
+    else
+    {
+        carrier->ready_tail->next = fiber;
+    }
+    carrier->ready_tail = fiber;
+}
+
+static fiber_t *pop_ready(fiber_carrier_t *carrier)
+{
+    fiber_t *fiber = carrier->ready_head;
+
+    if (NULL != fiber)
+    {
+        carrier->ready_head = fiber->next;
+        if (NULL == carrier->ready_head)
+        {
+            carrier->ready_tail = NULL;
+        }
+    }
+    return fiber;
+}
+
+// Moves the fibers spawned from other threads to the run queue, oldest first
+static void take_inbox(fiber_carrier_t *carrier)
+{
+    fiber_t *spawned = NULL;
+    fiber_t *reversed = NULL;
+    fiber_t *next = NULL;
+
+    pthread_mutex_lock(&carrier->inbox_lock);
+    spawned = carrier->inbox;
+    carrier->inbox = NULL;
+    pthread_mutex_unlock(&carrier->inbox_lock);
+
+    for (; NULL != spawned; spawned = next)
+    {
+        next = spawned->next;
+        spawned->next = reversed;
+        reversed = spawned;
+    }
+    for (; NULL != reversed; reversed = next)
+    {
+        next = reversed->next;
+        push_ready(carrier, reversed);
+    }
+}
+
+// Stacks are mapped with a guard page below them (a stack overflow faults instead of corrupting the
+// neighbour), and without reserving swap, so only the pages a fiber touches take memory.
+static void *allocate_stack(fiber_carrier_t *carrier)
+{
+    size_t stack_size = carrier->runtime->stack_size;
+    char *mapping = NULL;
+    void *stack = carrier->stack_pool;
+
+    if (NULL != stack)
+    {
+        carrier->stack_pool = *(void **)stack;
+        carrier->pooled--;
+        return stack;
+    }
+
+    mapping = mmap(NULL, stack_size + page_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (MAP_FAILED == mapping)
+    {
+        perror("Failed to map a fiber stack");
+        exit(errno);
+    }
+    if (0 != mprotect(mapping, page_size, PROT_NONE))
+    {
+        perror("Failed to protect a fiber stack");
+        exit(errno);
+    }
+    return mapping + page_size;
+}
+
+static void release_stack(fiber_carrier_t *carrier, void *stack)
+{
+    if (FIBER_STACK_POOL > carrier->pooled)
+    {
+        *(void **)stack = carrier->stack_pool;
+        carrier->stack_pool = stack;
+        carrier->pooled++;
+        return;
+    }
+    munmap((char *)stack - page_size, carrier->runtime->stack_size + page_size);
+}
+
+// The first frame of every fiber. It never returns, a finished fiber switches back to its carrier for good.
+static void fiber_main()
+{
+    fiber_carrier_t *carrier = current_carrier;
+    fiber_t *fiber = carrier->running;
+
+    fiber->entry(fiber->argument);
+    fiber->finished = true;
+    setcontext(&carrier->context);
+}
+
+static void run_fiber(fiber_carrier_t *carrier, fiber_t *fiber)
+{
+    if (NULL == fiber->stack)
+    {
+        // First run
+        fiber->stack = allocate_stack(carrier);
+        getcontext(&fiber->context);
+        fiber->context.uc_stack.ss_sp = fiber->stack;
+        fiber->context.uc_stack.ss_size = carrier->runtime->stack_size;
+        fiber->context.uc_link = NULL;
+        makecontext(&fiber->context, fiber_main, 0);
+    }
+
+    carrier->running = fiber;
+    swapcontext(&carrier->context, &fiber->context);
+    carrier->running = NULL;
+
+    if (fiber->finished)
+    {
+        release_stack(carrier, fiber->stack);
+        free(fiber);
+    }
+}
+
+static void *carrier_thread(void *arguments)
+{
+    fiber_carrier_t *carrier = arguments;
+    struct epoll_event events[FIBER_MAX_EVENTS];
+    fiber_t *fiber = NULL;
+    uint64_t wakeups = 0;
+    int events_count = 0;
+
+    current_carrier = carrier;
+    affinity_apply(carrier->index);
+    while (true)
+    {
+        take_inbox(carrier);
+        while (NULL != (fiber = pop_ready(carrier)))
+        {
+            run_fiber(carrier, fiber);
+        }
+
+        // Every fiber is blocked, waiting for their sockets or for new fibers
+        events_count = epoll_wait(carrier->epoll_fd, events, FIBER_MAX_EVENTS, -1);
+        if (-1 == events_count)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            perror("epoll_wait failed");
+            exit(errno);
+        }
+
+        for(int i=0; i < events_count; i++)
+        {
+            if (NULL == events[i].data.ptr)
+            {
+                read(carrier->wake_fd, &wakeups, sizeof(wakeups));
+                continue;
+            }
+            push_ready(carrier, events[i].data.ptr);
+        }
+    }
+    return NULL;
+}
+
+void fiber_runtime_init(fiber_runtime_t *runtime, int carrier_count, size_t stack_size)
+{
+    struct epoll_event event = {0};
+
+    page_size = sysconf(_SC_PAGESIZE);
+    memset(runtime, 0, sizeof(*runtime));
+    runtime->carrier_count = carrier_count;
+    runtime->stack_size = 0 == stack_size ? FIBER_STACK_SIZE : stack_size;
+    runtime->stack_size = (runtime->stack_size + page_size - 1) / page_size * page_size;
+    runtime->carriers = calloc(carrier_count, sizeof(fiber_carrier_t));
+    if (NULL == runtime->carriers)
+    {
+        perror("calloc failed");
+        exit(errno);
+    }
+
+    for(int i=0; i < carrier_count; i++)
+    {
+        fiber_carrier_t *carrier = &runtime->carriers[i];
+
+        carrier->index = i;
+        carrier->runtime = runtime;
+        pthread_mutex_init(&carrier->inbox_lock, NULL);
+        carrier->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        carrier->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (-1 == carrier->epoll_fd || -1 == carrier->wake_fd)
+        {
+            perror("Failed to create a carrier's reactor");
+            exit(errno);
+        }
+
+        // The wake fd's data is NULL, the fibers' data is their fiber_t
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        if (0 != epoll_ctl(carrier->epoll_fd, EPOLL_CTL_ADD, carrier->wake_fd, &event))
+        {
+            perror("Failed to watch the wake fd");
+            exit(errno);
+        }
+
+        errno = pthread_create(&carrier->tid, NULL, carrier_thread, carrier);
+        if (0 != errno)
+        {
+            perror("Failed to create a carrier");
+            exit(errno);
+        }
+    }
+}
+
+void fiber_spawn(fiber_runtime_t *runtime, void (*entry)(void *argument), void *argument)
+{
+    uint32_t index = __atomic_fetch_add(&runtime->next_carrier, 1, __ATOMIC_RELAXED) % runtime->carrier_count;
+    fiber_carrier_t *carrier = &runtime->carriers[index];
+    fiber_t *fiber = calloc(1, sizeof(*fiber));
+    uint64_t wakeup = 1;
+    bool was_empty = false;
+
+    if (NULL == fiber)
+    {
+        perror("calloc failed");
+        exit(errno);
+    }
+    fiber->entry = entry;
+    fiber->argument = argument;
+    fiber->carrier = carrier;
+    fiber->wait_fd = -1;
+
+    if (current_carrier == carrier)
+    {
+        push_ready(carrier, fiber);
+        return;
+    }
+
+    pthread_mutex_lock(&carrier->inbox_lock);
+    was_empty = NULL == carrier->inbox;
+    fiber->next = carrier->inbox;
+    carrier->inbox = fiber;
+    pthread_mutex_unlock(&carrier->inbox_lock);
+
+    // A non-empty inbox was not taken yet, its carrier was already woken
+    if (was_empty && sizeof(wakeup) != write(carrier->wake_fd, &wakeup, sizeof(wakeup)))
+    {
+        perror("Failed to wake a carrier");
+        exit(errno);
+    }
+}
+
+fiber_t *fiber_current()
+{
+    return NULL == current_carrier ? NULL : current_carrier->running;
+}
+
+void fiber_wait(int fd, short events)
+{
+    fiber_t *fiber = fiber_current();
+    struct pollfd poll_fd = {fd, events, 0};
+    struct epoll_event event = {0};
+    int operation = 0;
+
+    if (NULL == fiber)
+    {
+        poll(&poll_fd, 1, -1);
+        return;
+    }
+
+    // Oneshot, the fiber is queued once per wait. A closed fd leaves the epoll set by itself.
+    event.events = EPOLLONESHOT | (events & POLLIN ? EPOLLIN : 0) | (events & POLLOUT ? EPOLLOUT : 0);
+    event.data.ptr = fiber;
+    operation = fd == fiber->wait_fd ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (0 != epoll_ctl(fiber->carrier->epoll_fd, operation, fd, &event))
+    {
+        // The fd was closed and reused, or registered by an earlier wait on another fd
+        operation = ENOENT == errno ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+        if (0 != epoll_ctl(fiber->carrier->epoll_fd, operation, fd, &event))
+        {
+            perror("Failed to wait for a fiber's fd");
+            exit(errno);
+        }
+    }
+    fiber->wait_fd = fd;
+
+    swapcontext(&fiber->context, &fiber->carrier->context);
+}
+
+ssize_t fiber_recv(int fd, void *buffer, size_t length, int flags)
+{
+    ssize_t bytes_recv = 0;
+
+    while (-1 == (bytes_recv = recv(fd, buffer, length, flags)) && (EAGAIN == errno || EWOULDBLOCK == errno))
+    {
+        fiber_wait(fd, POLLIN);
+    }
+    return bytes_recv;
+}
+
+ssize_t fiber_send(int fd, const void *buffer, size_t length, int flags)
+{
+    ssize_t bytes_sent = 0;
+
+    while (-1 == (bytes_sent = send(fd, buffer, length, flags)) && (EAGAIN == errno || EWOULDBLOCK == errno))
+    {
+        fiber_wait(fd, POLLOUT);
+    }
+    return bytes_sent;
+}
@@ -0,0 +1,76 @@
+/**
+ ** Written by Amit Sides
+ **/
+
+#ifndef CORE_FIBER_H
+#define CORE_FIBER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <sys/types.h>
+
+#define FIBER_STACK_SIZE        (64 * 1024) // default, touched pages only (plus a guard page)
+#define FIBER_STACK_POOL        (1024)      // finished fibers' stacks kept per carrier for reuse
+#define FIBER_MAX_EVENTS        (256)
+
+struct fiber_carrier_s;
+
+// A green thread, runs on a single carrier for its whole life
+typedef struct fiber_s {
+    ucontext_t context;
+    void (*entry)(void *argument);
+    void *argument;
+    void *stack;                        // the usable part, the guard page is right below it
+    struct fiber_s *next;               // the run queue or the inbox
+    struct fiber_carrier_s *carrier;
+    int wait_fd;                        // registered in the carrier's epoll, -1 when none
+    bool finished;
+} fiber_t;
+
+// An OS thread running fibers: its run queue until it's empty, then the reactor (epoll) for the fibers
+// whose sockets became ready and for fibers spawned from other threads (the inbox, woken with an eventfd).
+typedef struct fiber_carrier_s {
+    pthread_t tid;
+    int index;
+    int epoll_fd;
+    int wake_fd;
+    ucontext_t context;                 // the carrier's loop, fibers switch back to it when they block
+    fiber_t *running;
+    fiber_t *ready_head;
+    fiber_t *ready_tail;
+    pthread_mutex_t inbox_lock;
+    fiber_t *inbox;
+    void *stack_pool;                   // finished fibers' stacks, linked through their first word. Owner only.
+    int pooled;
+    struct fiber_runtime_s *runtime;
+} fiber_carrier_t;
+
+typedef struct fiber_runtime_s {
+    fiber_carrier_t *carriers;
+    int carrier_count;
+    size_t stack_size;
+    uint32_t next_carrier;
+} fiber_runtime_t;
+
+// Starts the carriers, a stack_size of 0 uses FIBER_STACK_SIZE
+void fiber_runtime_init(fiber_runtime_t *runtime, int carrier_count, size_t stack_size);
+
+// Runs entry(argument) on a new fiber, carriers are picked round-robin. Callable from any thread.
+void fiber_spawn(fiber_runtime_t *runtime, void (*entry)(void *argument), void *argument);
+
+// The running fiber, NULL outside the fibers
+fiber_t *fiber_current();
+
+// Blocks the calling fiber until the fd is ready (POLLIN / POLLOUT), the carrier runs the other fibers meanwhile.
+// Outside a fiber it blocks the thread in poll().
+void fiber_wait(int fd, short events);
+
+// recv() and send() that block only the calling fiber, for non-blocking sockets.
+// Used by handlers that are written as blocking code, they work the same on a thread of their own.
+ssize_t fiber_recv(int fd, void *buffer, size_t length, int flags);
+ssize_t fiber_send(int fd, const void *buffer, size_t length, int flags);
+
+#endif //CORE_FIBER_H
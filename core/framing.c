@@ -0,0 +1,170 @@
+/**
+ ** Written by Amit Sides
+ **/
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define USE_X86_SIMD
+#endif
+
+#include "framing.h"
+
+typedef const char *(*scanner_t)(const char *begin, const char *end);
+
+static const char *scan_scalar(const char *begin, const char *end)
+{
+    for (; begin < end; begin++)
+    {
+        if ('\n' == *begin || '\0' == *begin)
+        {
+            break;
+        }
+    }
+    return begin;
+}
+
+#ifdef USE_X86_SIMD
+
+#ifdef __SSE2__
+static const char *scan_sse2(const char *begin, const char *end)
+{
+    const __m128i new_line = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+
+    // 16 bytes at a time, a set bit in the mask marks a delimiter
+    for (; begin + sizeof(__m128i) <= end; begin += sizeof(__m128i))
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)begin);
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, new_line), _mm_cmpeq_epi8(chunk, zero)));
+        if (0 != mask)
+        {
+            return begin + __builtin_ctz(mask);
+        }
+    }
+    return scan_scalar(begin, end);
+}
+#endif //__SSE2__
+
+__attribute__((target("avx2")))
+static const char *scan_avx2(const char *begin, const char *end)
+{
+    const __m256i new_line = _mm256_set1_epi8('\n');
+    const __m256i zero = _mm256_setzero_si256();
+
+    // 32 bytes at a time
+    for (; begin + sizeof(__m256i) <= end; begin += sizeof(__m256i))
+    {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)begin);
+        unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, new_line),
+                                                             _mm256_cmpeq_epi8(chunk, zero)));
+        if (0 != mask)
+        {
+            return begin + __builtin_ctz(mask);
+        }
+    }
+    return scan_scalar(begin, end);
+}
+
+#endif //USE_X86_SIMD
+
+static scanner_t select_scanner()
+{
+#ifdef USE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return scan_avx2;
+    }
+#ifdef __SSE2__
+    return scan_sse2;
+#endif
+#endif
+    return scan_scalar;
+}
+
+const char *frame_find_delimiter(const char *begin, const char *end)
+{
+    static scanner_t scanner = NULL;
+
+    if (NULL == scanner)
+    {
+        scanner = select_scanner();
+    }
+    return scanner(begin, end);
+}
+
+void frame_reset(frame_buffer_t *buffer)
+{
+    buffer->length = 0;
+    buffer->scanned = 0;
+}
+
+ssize_t frame_recv(int fd, frame_buffer_t *buffer)
+{
+    return recv(fd, buffer->data + buffer->length, FRAME_BUFFER_SIZE - buffer->length, 0);
+}
+
+char *frame_next(frame_buffer_t *buffer, size_t *offset)
+{
+    char *message = buffer->data + *offset;
+    char *start = message;
+    char *end = buffer->data + buffer->length;
+    char *delimiter = NULL;
+
+    if (*offset >= buffer->length)
+    {
+        return NULL;
+    }
+
+    // The partial tail of the previous read was already scanned
+    if (start < buffer->data + buffer->scanned)
+    {
+        start = buffer->data + buffer->scanned;
+    }
+
+    delimiter = (char *)frame_find_delimiter(start, end);
+    if (delimiter == end)
+    {
+        if (0 != *offset || FRAME_BUFFER_SIZE != buffer->length)
+        {
+            // Incomplete message, waiting for the rest of it
+            return NULL;
+        }
+
+        // The whole buffer is a single message, forcing a frame
+        delimiter = end;
+    }
+
+    *delimiter = '\0';
+    *offset = delimiter - buffer->data + 1;
+    if (*offset > buffer->length)
+    {
+        *offset = buffer->length;
+    }
+
+    // Telnet-like clients end lines with "\r\n"
+    if (delimiter > message && '\r' == delimiter[-1])
+    {
+        delimiter[-1] = '\0';
+    }
+
+    return message;
+}
+
+void frame_compact(frame_buffer_t *buffer, size_t offset)
+{
+    buffer->length -= offset;
+    if (0 != offset && 0 != buffer->length)
+    {
+        memmove(buffer->data, buffer->data + offset, buffer->length);
+    }
+
+    // Whatever is left had no delimiter in it
+    buffer->scanned = buffer->length;
+}
@@ -0,0 +1,38 @@
+/**
+ ** Written by Amit Sides
+ **/
+
+#ifndef CORE_FRAMING_H
+#define CORE_FRAMING_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define FRAME_BUFFER_SIZE   (4096)
+
+// Per-connection input buffer. A single recv may hold several messages, or only a part of one,
+// so complete messages are extracted from the buffer and the partial tail is kept for the next read.
+// Messages end with a new-line, or a null-terminator (the chat clients send their name with one).
+typedef struct frame_buffer_s {
+    size_t length;
+    size_t scanned;                     // bytes at the start already known not to hold a delimiter
+    char data[FRAME_BUFFER_SIZE + 1];   // +1 for the null-terminator of a forced (overlong) frame
+} frame_buffer_t;
+
+void frame_reset(frame_buffer_t *buffer);
+
+// recv() into the free space of the buffer, same return value and errno as recv()
+ssize_t frame_recv(int fd, frame_buffer_t *buffer);
+
+// Returns the next complete message (null-terminated, without the delimiter or a trailing '\r'),
+// or NULL when there are no more. offset should start at 0 and is advanced past every message.
+// A full buffer without any delimiter is returned as a single message, so a client can't stall.
+char *frame_next(frame_buffer_t *buffer, size_t *offset);
+
+// Drops the consumed messages, moving the partial tail to the start of the buffer
+void frame_compact(frame_buffer_t *buffer, size_t offset);
+
+// Returns the first '\n' or '\0' in [begin, end), or end. Uses AVX2 / SSE2 when available.
+const char *frame_find_delimiter(const char *begin, const char *end);
+
+#endif //CORE_FRAMING_H
@@ -0,0 +1,412 @@
+/**
+ ** Written by Amit Sides
+ **/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+#include "handoff.h"
+
+#define ITEM_HEADER_SIZE        (2 * sizeof(uint32_t))  // kind and state size
+
+// The listeners handed over in the background, a process has a single pair
+typedef struct listeners_s {
+    int upgrade_fd;
+    int listen_fd;
+    int admin_fd;
+} listeners_t;
+
+static listeners_t listeners = {-1, -1, -1};
+static int drain_fd = -1;
+
+static void reset_message(handoff_t *handoff)
+{
+    handoff->length = sizeof(uint32_t);     // the item count comes first
+    handoff->offset = sizeof(uint32_t);
+    handoff->fd_count = 0;
+    handoff->next_fd = 0;
+    handoff->items = 0;
+}
+
+static void set_address(struct sockaddr_un *address, const char *path)
+{
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (sizeof(address->sun_path) <= strlen(path))
+    {
+        fprintf(stderr, "Upgrade socket path is too long: %s\n", path);
+        exit(-1);
+    }
+    strcpy(address->sun_path, path);
+}
+
+static void send_message(handoff_t *handoff)
+{
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH)] = {0};
+    struct iovec vector = {handoff->message, handoff->length};
+    struct msghdr message = {0};
+    struct cmsghdr *header = NULL;
+
+    memcpy(handoff->message, &handoff->items, sizeof(handoff->items));
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+    if (0 < handoff->fd_count)
+    {
+        message.msg_control = control;
+        message.msg_controllen = CMSG_SPACE(sizeof(int) * handoff->fd_count);
+        header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(int) * handoff->fd_count);
+        memcpy(CMSG_DATA(header), handoff->fds, sizeof(int) * handoff->fd_count);
+    }
+
+    // A successor that died is reported by handoff_finish(), the fds are still ours
+    if (!handoff->failed && (ssize_t)handoff->length != sendmsg(handoff->fd, &message, MSG_NOSIGNAL))
+    {
+        perror("Failed to hand off");
+        handoff->failed = true;
+    }
+    reset_message(handoff);
+}
+
+static bool receive_message(handoff_t *handoff)
+{
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH)] = {0};
+    struct iovec vector = {handoff->message, sizeof(handoff->message)};
+    struct msghdr message = {0};
+    struct cmsghdr *header = NULL;
+    ssize_t length = 0;
+
+    reset_message(handoff);
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    // The fds stay close-on-exec, like the ones the previous process created
+    length = recvmsg(handoff->fd, &message, MSG_CMSG_CLOEXEC);
+    if ((ssize_t)sizeof(uint32_t) > length)
+    {
+        fprintf(stderr, "The previous server stopped in the middle of the handoff\n");
+        exit(-1);
+    }
+    if (message.msg_flags & (MSG_CTRUNC | MSG_TRUNC))
+    {
+        // The kernel drops the fds that don't fit, out of fds (ulimit -n)?
+        fprintf(stderr, "Handoff message truncated, raise the fd limit\n");
+        exit(-1);
+    }
+
+    handoff->length = length;
+    memcpy(&handoff->items, handoff->message, sizeof(handoff->items));
+    for (header = CMSG_FIRSTHDR(&message); NULL != header; header = CMSG_NXTHDR(&message, header))
+    {
+        if (SOL_SOCKET == header->cmsg_level && SCM_RIGHTS == header->cmsg_type)
+        {
+            handoff->fd_count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(handoff->fds, CMSG_DATA(header), sizeof(int) * handoff->fd_count);
+        }
+    }
+    if (handoff->fd_count != handoff->items)
+    {
+        fprintf(stderr, "Handoff message has %u items but %d fds\n", handoff->items, handoff->fd_count);
+        exit(-1);
+    }
+
+    // An empty message ends the handoff
+    return 0 < handoff->items;
+}
+
+int handoff_listen(const char *path)
+{
+    struct sockaddr_un address = {0};
+    int listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+
+    if (-1 == listen_fd)
+    {
+        perror("Failed to create the upgrade socket");
+        exit(errno);
+    }
+
+    // A previous process' socket file is left behind, it already handed off (or died)
+    set_address(&address, path);
+    unlink(path);
+    if (0 != bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) || 0 != listen(listen_fd, 1))
+    {
+        perror("Failed to listen on the upgrade socket");
+        exit(errno);
+    }
+    return listen_fd;
+}
+
+void handoff_accept(handoff_t *handoff, int listen_fd)
+{
+    memset(handoff, 0, sizeof(*handoff));
+    handoff->start_ns = metrics_now_ns();
+    handoff->fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (-1 == handoff->fd)
+    {
+        perror("Failed to accept the upgrade");
+        exit(errno);
+    }
+    reset_message(handoff);
+}
+
+void handoff_put(handoff_t *handoff, uint32_t kind, int fd, const void *state, size_t size)
+{
+    uint32_t state_size = size;
+
+    if (HANDOFF_STATE_SIZE < size)
+    {
+        fprintf(stderr, "Handoff state of %zu bytes is too big\n", size);
+        exit(-1);
+    }
+    if (HANDOFF_BATCH == handoff->fd_count || HANDOFF_MESSAGE_SIZE < handoff->length + ITEM_HEADER_SIZE + size)
+    {
+        send_message(handoff);
+    }
+
+    memcpy(handoff->message + handoff->length, &kind, sizeof(kind));
+    memcpy(handoff->message + handoff->length + sizeof(kind), &state_size, sizeof(state_size));
+    memcpy(handoff->message + handoff->length + ITEM_HEADER_SIZE, state, size);
+    handoff->length += ITEM_HEADER_SIZE + size;
+    handoff->fds[handoff->fd_count++] = fd;
+    handoff->items++;
+    handoff->total++;
+}
+
+bool handoff_finish(handoff_t *handoff)
+{
+    char acknowledge = 0;
+
+    if (0 < handoff->items)
+    {
+        send_message(handoff);
+    }
+    send_message(handoff);
+
+    // Until the successor acknowledges, the fds are still ours
+    if (handoff->failed || 1 != recv(handoff->fd, &acknowledge, sizeof(acknowledge), 0))
+    {
+        fprintf(stderr, "The new server failed to take over\n");
+        handoff->failed = true;
+    }
+    close(handoff->fd);
+    return !handoff->failed;
+}
+
+bool handoff_connect(handoff_t *handoff, const char *path)
+{
+    struct sockaddr_un address = {0};
+
+    memset(handoff, 0, sizeof(*handoff));
+    handoff->start_ns = metrics_now_ns();
+    handoff->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (-1 == handoff->fd)
+    {
+        perror("Failed to create the upgrade socket");
+        exit(errno);
+    }
+
+    set_address(&address, path);
+    if (0 != connect(handoff->fd, (struct sockaddr *)&address, sizeof(address)))
+    {
+        if (ENOENT != errno && ECONNREFUSED != errno)
+        {
+            perror("Failed to connect to the running server");
+            exit(errno);
+        }
+
+        // Nobody is running
+        close(handoff->fd);
+        handoff->fd = -1;
+        return false;
+    }
+
+    // Nothing received yet
+    reset_message(handoff);
+    handoff->length = 0;
+    return true;
+}
+
+bool handoff_get(handoff_t *handoff, uint32_t *kind, int *fd, void *state, size_t *size)
+{
+    uint32_t state_size = 0;
+
+    if (handoff->next_fd == handoff->fd_count && !receive_message(handoff))
+    {
+        return false;
+    }
+
+    memcpy(kind, handoff->message + handoff->offset, sizeof(*kind));
+    memcpy(&state_size, handoff->message + handoff->offset + sizeof(*kind), sizeof(state_size));
+    if (HANDOFF_STATE_SIZE < state_size || handoff->length < handoff->offset + ITEM_HEADER_SIZE + state_size)
+    {
+        fprintf(stderr, "Malformed handoff message\n");
+        exit(-1);
+    }
+    memcpy(state, handoff->message + handoff->offset + ITEM_HEADER_SIZE, state_size);
+    *size = state_size;
+    *fd = handoff->fds[handoff->next_fd++];
+    handoff->offset += ITEM_HEADER_SIZE + state_size;
+    handoff->total++;
+    return true;
+}
+
+void handoff_done(handoff_t *handoff)
+{
+    char acknowledge = 1;
+
+    if (1 != send(handoff->fd, &acknowledge, sizeof(acknowledge), MSG_NOSIGNAL))
+    {
+        perror("Failed to acknowledge the handoff");
+        exit(errno);
+    }
+    close(handoff->fd);
+}
+
+double handoff_elapsed_ms(handoff_t *handoff)
+{
+    return (double)(metrics_now_ns() - handoff->start_ns) / 1e6;
+}
+
+bool handoff_take_listeners(const char *path, int *listen_fd, int *admin_fd)
+{
+    static handoff_t handoff;
+    char state[HANDOFF_STATE_SIZE] = {0};
+    uint32_t kind = 0;
+    int fd = 0;
+    size_t size = 0;
+
+    if (!handoff_connect(&handoff, path))
+    {
+        return false;
+    }
+
+    while (handoff_get(&handoff, &kind, &fd, state, &size))
+    {
+        switch (kind)
+        {
+        case HANDOFF_LISTENER:
+            *listen_fd = fd;
+            break;
+        case HANDOFF_ADMIN:
+            *admin_fd = fd;
+            break;
+        default:
+            close(fd);
+        }
+    }
+    handoff_done(&handoff);
+    printf("Took over %zu fds from the previous server in %.3f ms\n", handoff.total, handoff_elapsed_ms(&handoff));
+    return true;
+}
+
+static void *listeners_thread(void *arguments)
+{
+    static handoff_t handoff;
+    struct pollfd upgrade_poll = {listeners.upgrade_fd, POLLIN, 0};
+
+    while (true)
+    {
+        // Waiting for the successor first, the handoff is timed from the accept
+        if (0 >= poll(&upgrade_poll, 1, -1))
+        {
+            continue;
+        }
+        handoff_accept(&handoff, listeners.upgrade_fd);
+        handoff_put(&handoff, HANDOFF_LISTENER, listeners.listen_fd, NULL, 0);
+        if (-1 != listeners.admin_fd)
+        {
+            handoff_put(&handoff, HANDOFF_ADMIN, listeners.admin_fd, NULL, 0);
+        }
+        if (handoff_finish(&handoff))
+        {
+            break;
+        }
+        printf("Upgrade failed, still serving\n");
+    }
+
+    // The admin listener stays open, its thread may be waiting in accept. Until this process exits, either
+    // process answers a scrape.
+    printf("Handed off the listeners in %.3f ms, draining\n", handoff_elapsed_ms(&handoff));
+    close(listeners.upgrade_fd);
+    if (0 != eventfd_write(drain_fd, 1))
+    {
+        perror("Failed to stop accepting");
+        exit(errno);
+    }
+    return NULL;
+}
+
+void handoff_listeners_in_background(const char *path, int listen_fd, int admin_fd)
+{
+    pthread_t tid;
+
+    // Both processes wait on the listener during an upgrade, and the other one may take the connection this one
+    // was woken for. Accepting mustn't block then, the accept loops go back to handoff_wait_accept().
+    if (0 != fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK))
+    {
+        perror("Failed to make the listener non-blocking");
+        exit(errno);
+    }
+
+    listeners.upgrade_fd = handoff_listen(path);
+    listeners.listen_fd = listen_fd;
+    listeners.admin_fd = admin_fd;
+    drain_fd = eventfd(0, EFD_CLOEXEC);
+    if (-1 == drain_fd)
+    {
+        perror("eventfd failed");
+        exit(errno);
+    }
+
+    errno = pthread_create(&tid, NULL, listeners_thread, NULL);
+    if (0 != errno)
+    {
+        perror("Failed to create the upgrade thread");
+        exit(errno);
+    }
+    pthread_detach(tid);
+}
+
+int handoff_drain_fd()
+{
+    return drain_fd;
+}
+
+bool handoff_wait_accept(int listen_fd)
+{
+    struct pollfd poll_fds[2] = {{listen_fd, POLLIN, 0}, {drain_fd, POLLIN, 0}};
+
+    if (-1 == drain_fd)
+    {
+        // No upgrades, accept blocks
+        return true;
+    }
+
+    while (0 > poll(poll_fds, 2, -1))
+    {
+        if (EINTR != errno)
+        {
+            perror("poll failed");
+            exit(errno);
+        }
+    }
+
+    // A connection pending together with the handoff goes to the successor, it is still in the backlog
+    return 0 == poll_fds[1].revents;
+}
@@ -0,0 +1,79 @@
+/**
+ ** Written by Amit Sides
+ **/
+
+#ifndef CORE_HANDOFF_H
+#define CORE_HANDOFF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define HANDOFF_BATCH           (250)           // fds per message, the kernel takes up to SCM_MAX_FD (253)
+#define HANDOFF_MESSAGE_SIZE    (64 * 1024)     // state bytes per message
+#define HANDOFF_STATE_SIZE      (8 * 1024)      // the largest state of a single fd
+
+// Kinds of handed over fds, a server may add its own
+#define HANDOFF_LISTENER        (1)
+#define HANDOFF_CLIENT          (2)
+#define HANDOFF_ADMIN           (3)
+
+// Hot upgrade: a new server process connects to the running one over a Unix socket, which passes it every
+// fd it owns (SCM_RIGHTS) with the fd's state, and exits once the new process acknowledged taking them.
+// The listening socket itself moves, so connections keep queueing in its backlog and none is refused.
+// Messages are a count, followed by the items (kind, state size, state), with the items' fds attached.
+typedef struct handoff_s {
+    int fd;                             // the connection between the two processes
+    int fds[HANDOFF_BATCH];
+    int fd_count;
+    char message[HANDOFF_MESSAGE_SIZE];
+    size_t length;                      // bytes in the message
+    size_t offset;                      // receiving, the next item in the message
+    int next_fd;                        // receiving, the next item's fd
+    uint32_t items;                     // items in the message
+    size_t total;                       // items handed over so far
+    uint64_t start_ns;
+    bool failed;                        // the successor went away
+} handoff_t;
+
+// The running server: listens for its successor. Poll the returned fd, readable means an upgrade.
+int handoff_listen(const char *path);
+
+// The running server: accepts the successor, then put() every fd and finish()
+void handoff_accept(handoff_t *handoff, int listen_fd);
+void handoff_put(handoff_t *handoff, uint32_t kind, int fd, const void *state, size_t size);
+
+// Waits for the successor to take over. On true the caller exits right after (without shutting the fds down),
+// on false the successor failed and the caller keeps serving.
+bool handoff_finish(handoff_t *handoff);
+
+// A starting server: connects to the running one, false when there is none (start fresh)
+bool handoff_connect(handoff_t *handoff, const char *path);
+
+// A starting server: the next fd and its state (up to HANDOFF_STATE_SIZE bytes), false after the last one
+bool handoff_get(handoff_t *handoff, uint32_t *kind, int *fd, void *state, size_t *size);
+
+// A starting server: tells the previous one everything was taken, it exits
+void handoff_done(handoff_t *handoff);
+
+// Milliseconds since the handoff started (accept or connect)
+double handoff_elapsed_ms(handoff_t *handoff);
+
+// Servers whose connections live on their threads' stacks (the echo servers) hand over the listeners only.
+// A thread serves the upgrade socket, and once the successor took the listener and the admin listener, the
+// running process stops accepting and drains: it serves its connections until they close, then exits.
+
+// A starting server: takes the listener and the admin listener (-1 without one) of the server running on the
+// path, false when there is none (start fresh)
+bool handoff_take_listeners(const char *path, int *listen_fd, int *admin_fd);
+
+// The running server: listens on the path and hands the listeners over from a detached thread
+void handoff_listeners_in_background(const char *path, int listen_fd, int admin_fd);
+
+// Readable once the listeners were handed over (-1 without upgrades), for servers that epoll their listener
+int handoff_drain_fd();
+
+// Waits for a pending connection on the listener, false once the listeners were handed over
+bool handoff_wait_accept(int listen_fd);
+
+#endif //CORE_HANDOFF_H
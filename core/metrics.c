@@ -0,0 +1,461 @@
+/**
+ ** Written by Amit Sides
+ **/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+#include "metrics.h"
+
+#define ADMIN_INTERFACE         ("127.0.0.1")
+#define ADMIN_UNIX_PREFIX       ("unix:")
+#define ADMIN_REQUEST_TIMEOUT   (50) // ms to wait for the scraper's request
+#define ADMIN_RESPONSE_SIZE     (16 * 1024)
+
+#define ATOMIC_ADD(counter, value)  __atomic_fetch_add(&(counter), (value), __ATOMIC_RELAXED)
+#define ATOMIC_STORE(var, value)    __atomic_store_n(&(var), (value), __ATOMIC_RELAXED)
+#define ATOMIC_LOAD(var)            __atomic_load_n(&(var), __ATOMIC_RELAXED)
+
+metrics_t metrics = {0};
+
+// Only touched by the admin listener, used to calculate accepts/sec between scrapes
+static uint64_t last_scrape_ns = 0;
+static uint64_t last_scrape_accepts = 0;
+
+uint64_t metrics_now_ns()
+{
+    struct timespec now = {0};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+uint64_t metrics_now_ms()
+{
+    return metrics_now_ns() / 1000000;
+}
+
+void metrics_init(const char *server_name)
+{
+    memset(&metrics, 0, sizeof(metrics));
+    metrics.server_name = server_name;
+    last_scrape_ns = metrics_now_ns();
+    last_scrape_accepts = 0;
+}
+
+static void histogram_observe(metrics_histogram_t *histogram, uint64_t value)
+{
+    int index = 0;
+
+    // Bucket i holds values <= 2^i
+    if (1 < value)
+    {
+        index = 64 - __builtin_clzll(value - 1);
+    }
+    if (METRICS_HISTOGRAM_BUCKETS - 1 < index)
+    {
+        index = METRICS_HISTOGRAM_BUCKETS - 1;
+    }
+
+    ATOMIC_ADD(histogram->buckets[index], 1);
+    ATOMIC_ADD(histogram->sum, value);
+    ATOMIC_ADD(histogram->count, 1);
+}
+
+void metrics_accepted()
+{
+    ATOMIC_ADD(metrics.accepts, 1);
+    ATOMIC_ADD(metrics.connections, 1);
+}
+
+void metrics_disconnected()
+{
+    ATOMIC_ADD(metrics.connections, -1);
+}
+
+void metrics_message_in(size_t bytes)
+{
+    ATOMIC_ADD(metrics.messages_in, 1);
+    ATOMIC_ADD(metrics.bytes_in, bytes);
+}
+
+void metrics_message_out(size_t bytes)
+{
+    ATOMIC_ADD(metrics.messages_out, 1);
+    ATOMIC_ADD(metrics.bytes_out, bytes);
+}
+
+// A batch at once (recvmmsg/sendmmsg), one atomic update per counter instead of one per message
+void metrics_messages_in(size_t messages, size_t bytes)
+{
+    ATOMIC_ADD(metrics.messages_in, messages);
+    ATOMIC_ADD(metrics.bytes_in, bytes);
+}
+
+void metrics_messages_out(size_t messages, size_t bytes)
+{
+    ATOMIC_ADD(metrics.messages_out, messages);
+    ATOMIC_ADD(metrics.bytes_out, bytes);
+}
+
+void metrics_fanout(size_t recipients)
+{
+    histogram_observe(&metrics.fanout, recipients);
+}
+
+void metrics_queue_depth(int depth)
+{
+    ATOMIC_STORE(metrics.queue_depth, depth);
+}
+
+void metrics_handling_time(uint64_t start_ns)
+{
+    histogram_observe(&metrics.handling_us, (metrics_now_ns() - start_ns) / 1000);
+}
+
+void metrics_discovers(size_t answered, size_t suppressed)
+{
+    ATOMIC_ADD(metrics.discovers_answered, answered);
+    ATOMIC_ADD(metrics.discovers_suppressed, suppressed);
+}
+
+void metrics_announced()
+{
+    ATOMIC_ADD(metrics.announcements, 1);
+}
+
+// A connection of a previous server process, a connection but not an accept
+void metrics_taken_over()
+{
+    ATOMIC_ADD(metrics.taken_over, 1);
+    ATOMIC_ADD(metrics.connections, 1);
+}
+
+// An accepted connection that was closed right away, it never counts as a connection
+void metrics_rejected()
+{
+    ATOMIC_ADD(metrics.rejected, 1);
+}
+
+void metrics_shed()
+{
+    ATOMIC_ADD(metrics.shed, 1);
+}
+
+void metrics_shedding(bool shedding)
+{
+    ATOMIC_STORE(metrics.shedding, shedding ? 1 : 0);
+}
+
+void metrics_slo_violation()
+{
+    ATOMIC_ADD(metrics.slo_violations, 1);
+}
+
+void metrics_relayed_in(uint64_t sent_ns)
+{
+    uint64_t now = metrics_now_ns();
+
+    ATOMIC_ADD(metrics.relayed_in, 1);
+    histogram_observe(&metrics.relay_us, now > sent_ns ? (now - sent_ns) / 1000 : 0);
+}
+
+void metrics_relayed_out(size_t peers)
+{
+    ATOMIC_ADD(metrics.relayed_out, peers);
+}
+
+void metrics_relay_duplicate()
+{
+    ATOMIC_ADD(metrics.relay_duplicates, 1);
+}
+
+static int format_histogram(char *buffer, size_t size, const char *name, const char *help,
+                            metrics_histogram_t *histogram, double scale)
+{
+    int length = 0;
+    uint64_t cumulative = 0;
+
+    length += snprintf(buffer + length, size - length, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for(int i=0; i < METRICS_HISTOGRAM_BUCKETS - 1 && length < size; i++)
+    {
+        cumulative += ATOMIC_LOAD(histogram->buckets[i]);
+        length += snprintf(buffer + length, size - length, "%s_bucket{server=\"%s\",le=\"%g\"} %lu\n",
+                           name, metrics.server_name, (double)(1ull << i) * scale, cumulative);
+    }
+    if (length < size)
+    {
+        cumulative += ATOMIC_LOAD(histogram->buckets[METRICS_HISTOGRAM_BUCKETS - 1]);
+        length += snprintf(buffer + length, size - length,
+                           "%s_bucket{server=\"%s\",le=\"+Inf\"} %lu\n"
+                           "%s_sum{server=\"%s\"} %g\n"
+                           "%s_count{server=\"%s\"} %lu\n",
+                           name, metrics.server_name, cumulative,
+                           name, metrics.server_name, (double)ATOMIC_LOAD(histogram->sum) * scale,
+                           name, metrics.server_name, ATOMIC_LOAD(histogram->count));
+    }
+
+    return length;
+}
+
+// The process' virtual and resident size in bytes, both 0 when /proc isn't there
+static void read_process_memory(uint64_t *virtual_bytes, uint64_t *resident_bytes)
+{
+    FILE *statm = fopen("/proc/self/statm", "r");
+    unsigned long size = 0;
+    unsigned long resident = 0;
+
+    *virtual_bytes = 0;
+    *resident_bytes = 0;
+    if (NULL == statm)
+    {
+        return;
+    }
+    if (2 == fscanf(statm, "%lu %lu", &size, &resident))
+    {
+        *virtual_bytes = (uint64_t)size * sysconf(_SC_PAGESIZE);
+        *resident_bytes = (uint64_t)resident * sysconf(_SC_PAGESIZE);
+    }
+    fclose(statm);
+}
+
+static int format_metrics(char *buffer, size_t size)
+{
+    int length = 0;
+    uint64_t now = metrics_now_ns();
+    uint64_t accepts = ATOMIC_LOAD(metrics.accepts);
+    double accepts_per_second = 0;
+    uint64_t virtual_bytes = 0;
+    uint64_t resident_bytes = 0;
+
+    read_process_memory(&virtual_bytes, &resident_bytes);
+    if (now > last_scrape_ns)
+    {
+        accepts_per_second = (double)(accepts - last_scrape_accepts) * 1e9 / (double)(now - last_scrape_ns);
+    }
+    last_scrape_ns = now;
+    last_scrape_accepts = accepts;
+
+    length += snprintf(buffer + length, size - length,
+                       "# TYPE server_connections gauge\nserver_connections{server=\"%s\"} %ld\n"
+                       "# TYPE server_accepts_total counter\nserver_accepts_total{server=\"%s\"} %lu\n"
+                       "# TYPE server_accepts_per_second gauge\nserver_accepts_per_second{server=\"%s\"} %g\n"
+                       "# TYPE server_messages_in_total counter\nserver_messages_in_total{server=\"%s\"} %lu\n"
+                       "# TYPE server_messages_out_total counter\nserver_messages_out_total{server=\"%s\"} %lu\n"
+                       "# TYPE server_bytes_in_total counter\nserver_bytes_in_total{server=\"%s\"} %lu\n"
+                       "# TYPE server_bytes_out_total counter\nserver_bytes_out_total{server=\"%s\"} %lu\n"
+                       "# TYPE server_queue_depth gauge\nserver_queue_depth{server=\"%s\"} %ld\n"
+                       "# TYPE server_discovers_answered_total counter\nserver_discovers_answered_total{server=\"%s\"} %lu\n"
+                       "# TYPE server_discovers_suppressed_total counter\nserver_discovers_suppressed_total{server=\"%s\"} %lu\n"
+                       "# TYPE server_announcements_total counter\nserver_announcements_total{server=\"%s\"} %lu\n"
+                       "# TYPE server_taken_over_total counter\nserver_taken_over_total{server=\"%s\"} %lu\n"
+                       "# TYPE server_rejected_total counter\nserver_rejected_total{server=\"%s\"} %lu\n"
+                       "# TYPE server_shed_total counter\nserver_shed_total{server=\"%s\"} %lu\n"
+                       "# TYPE server_shedding gauge\nserver_shedding{server=\"%s\"} %ld\n"
+                       "# TYPE server_slo_violations_total counter\nserver_slo_violations_total{server=\"%s\"} %lu\n"
+                       "# TYPE server_relayed_in_total counter\nserver_relayed_in_total{server=\"%s\"} %lu\n"
+                       "# TYPE server_relayed_out_total counter\nserver_relayed_out_total{server=\"%s\"} %lu\n"
+                       "# TYPE server_relay_duplicates_total counter\nserver_relay_duplicates_total{server=\"%s\"} %lu\n"
+                       "# TYPE process_virtual_memory_bytes gauge\nprocess_virtual_memory_bytes{server=\"%s\"} %lu\n"
+                       "# TYPE process_resident_memory_bytes gauge\nprocess_resident_memory_bytes{server=\"%s\"} %lu\n",
+                       metrics.server_name, ATOMIC_LOAD(metrics.connections),
+                       metrics.server_name, accepts,
+                       metrics.server_name, accepts_per_second,
+                       metrics.server_name, ATOMIC_LOAD(metrics.messages_in),
+                       metrics.server_name, ATOMIC_LOAD(metrics.messages_out),
+                       metrics.server_name, ATOMIC_LOAD(metrics.bytes_in),
+                       metrics.server_name, ATOMIC_LOAD(metrics.bytes_out),
+                       metrics.server_name, ATOMIC_LOAD(metrics.queue_depth),
+                       metrics.server_name, ATOMIC_LOAD(metrics.discovers_answered),
+                       metrics.server_name, ATOMIC_LOAD(metrics.discovers_suppressed),
+                       metrics.server_name, ATOMIC_LOAD(metrics.announcements),
+                       metrics.server_name, ATOMIC_LOAD(metrics.taken_over),
+                       metrics.server_name, ATOMIC_LOAD(metrics.rejected),
+                       metrics.server_name, ATOMIC_LOAD(metrics.shed),
+                       metrics.server_name, ATOMIC_LOAD(metrics.shedding),
+                       metrics.server_name, ATOMIC_LOAD(metrics.slo_violations),
+                       metrics.server_name, ATOMIC_LOAD(metrics.relayed_in),
+                       metrics.server_name, ATOMIC_LOAD(metrics.relayed_out),
+                       metrics.server_name, ATOMIC_LOAD(metrics.relay_duplicates),
+                       metrics.server_name, virtual_bytes,
+                       metrics.server_name, resident_bytes);
+    if (length < size)
+    {
+        length += format_histogram(buffer + length, size - length, "server_fanout_recipients",
+                                   "Recipients per delivered message", &metrics.fanout, 1);
+    }
+    if (length < size)
+    {
+        length += format_histogram(buffer + length, size - length, "server_message_handling_seconds",
+                                   "Time spent handling a single message", &metrics.handling_us, 1e-6);
+    }
+    if (length < size)
+    {
+        length += format_histogram(buffer + length, size - length, "server_relay_latency_seconds",
+                                   "Time from the origin server to this one", &metrics.relay_us, 1e-6);
+    }
+
+    if (length >= size)
+    {
+        length = size - 1;
+    }
+    return length;
+}
+
+int metrics_setup_admin(const char *address)
+{
+    int admin_fd = 0;
+    int enabled = 1;
+
+    if (0 == strncmp(address, ADMIN_UNIX_PREFIX, sizeof(ADMIN_UNIX_PREFIX) - 1))
+    {
+        struct sockaddr_un unix_address = {0};
+        const char *path = address + sizeof(ADMIN_UNIX_PREFIX) - 1;
+
+        if (sizeof(unix_address.sun_path) <= strlen(path))
+        {
+            fprintf(stderr, "Error: admin socket path '%s' is too long\n", path);
+            exit(-1);
+        }
+
+        admin_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (-1 == admin_fd)
+        {
+            perror("Failed to create admin socket");
+            exit(errno);
+        }
+
+        // Removing a stale socket from a previous run
+        unlink(path);
+        unix_address.sun_family = AF_UNIX;
+        strcpy(unix_address.sun_path, path);
+        if (0 != bind(admin_fd, (struct sockaddr *)&unix_address, sizeof(unix_address)))
+        {
+            perror("Failed to bind admin socket");
+            exit(errno);
+        }
+    }
+    else
+    {
+        struct sockaddr_in admin_address = {0};
+        int port = atoi(address);
+
+        if (0 >= port)
+        {
+            fprintf(stderr, "Error: admin address must be <port> or unix:<path>\n");
+            exit(-1);
+        }
+
+        admin_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (-1 == admin_fd)
+        {
+            perror("Failed to create admin socket");
+            exit(errno);
+        }
+
+        if (0 != setsockopt(admin_fd, SOL_SOCKET, SO_REUSEADDR, &enabled, sizeof(enabled)))
+        {
+            perror("Failed to set SO_REUSEADDR");
+            exit(errno);
+        }
+
+        // The admin listener is only reachable locally
+        admin_address.sin_family = AF_INET;
+        admin_address.sin_addr.s_addr = inet_addr(ADMIN_INTERFACE);
+        admin_address.sin_port = htons(port);
+        if (0 != bind(admin_fd, (struct sockaddr *)&admin_address, sizeof(admin_address)))
+        {
+            perror("Failed to bind admin socket");
+            exit(errno);
+        }
+    }
+
+    if (0 != listen(admin_fd, SOMAXCONN))
+    {
+        perror("Failed to listen on admin socket");
+        exit(errno);
+    }
+
+    printf("Serving metrics on %s...\n", address);
+    return admin_fd;
+}
+
+// Serves a scraper, blocking for up to ADMIN_REQUEST_TIMEOUT on its request
+static void handle_admin(int admin_fd)
+{
+    int scraper_fd = 0;
+    int length = 0;
+    int header_length = 0;
+    char request[1024] = {0};
+    char body[ADMIN_RESPONSE_SIZE] = {0};
+    char header[128] = {0};
+    struct pollfd scraper_poll = {0};
+
+    scraper_fd = accept4(admin_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (-1 == scraper_fd)
+    {
+        perror("admin accept failed");
+        return;
+    }
+
+    // Waiting (briefly) for the request, so closing the socket won't reset the connection.
+    // The request itself doesn't matter, every path gets the metrics.
+    scraper_poll.fd = scraper_fd;
+    scraper_poll.events = POLLIN;
+    if (0 < poll(&scraper_poll, 1, ADMIN_REQUEST_TIMEOUT))
+    {
+        recv(scraper_fd, request, sizeof(request), 0);
+    }
+
+    length = format_metrics(body, sizeof(body));
+    header_length = snprintf(header, sizeof(header),
+                             "HTTP/1.0 200 OK\r\n"
+                             "Content-Type: text/plain; version=0.0.4\r\n"
+                             "Content-Length: %d\r\n\r\n", length);
+
+    // Best effort, a scraper that can't take ~10KB at once will retry
+    send(scraper_fd, header, header_length, MSG_NOSIGNAL);
+    send(scraper_fd, body, length, MSG_NOSIGNAL);
+    shutdown(scraper_fd, SHUT_WR);
+    close(scraper_fd);
+}
+
+static void *admin_thread(void *admin_fd)
+{
+    while(true)
+    {
+        handle_admin((int)(intptr_t)admin_fd);
+    }
+    return NULL;
+}
+
+void metrics_start_admin_thread(int admin_fd)
+{
+    pthread_t tid;
+
+    // The scraper is served with blocking calls, so it must not live on the serving thread
+    errno = pthread_create(&tid, NULL, admin_thread, (void *)(intptr_t)admin_fd);
+    if (0 != errno)
+    {
+        perror("Failed to create admin thread");
+        exit(errno);
+    }
+
+    errno = pthread_detach(tid);
+    if (0 != errno)
+    {
+        perror("Failed to detach admin thread");
+        exit(errno);
+    }
+}
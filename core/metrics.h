@@ -0,0 +1,80 @@
+/**
+ ** Written by Amit Sides
+ **/
+
+#ifndef CORE_METRICS_H
+#define CORE_METRICS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define METRICS_HISTOGRAM_BUCKETS   (22) // 2^0 .. 2^20, the last one is +Inf
+
+typedef struct metrics_histogram_s {
+    uint64_t buckets[METRICS_HISTOGRAM_BUCKETS];
+    uint64_t sum;
+    uint64_t count;
+} metrics_histogram_t;
+
+typedef struct metrics_s {
+    const char *server_name;
+    int64_t connections;                // gauge
+    int64_t queue_depth;                // gauge, ready fds in the last loop iteration
+    int64_t shedding;                   // gauge, 1 while new connections are shed for the latency SLO
+    uint64_t accepts;
+    uint64_t messages_in;
+    uint64_t messages_out;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t discovers_answered;        // discovery servers only
+    uint64_t discovers_suppressed;      // duplicated or rate limited DISCOVERs
+    uint64_t announcements;             // unsolicited ALIVEs
+    uint64_t taken_over;                // connections handed over by a previous server process
+    uint64_t rejected;                  // connections closed right after accept by admission control
+    uint64_t shed;                      // connections closed right after accept, the latency SLO was breached
+    uint64_t slo_violations;            // messages handled slower than the latency SLO
+    uint64_t relayed_in;                // federated servers only
+    uint64_t relayed_out;
+    uint64_t relay_duplicates;          // messages that arrived again over another path
+    metrics_histogram_t fanout;         // recipients per delivered message
+    metrics_histogram_t handling_us;    // time spent handling a single message (microseconds)
+    metrics_histogram_t relay_us;       // from the origin server to this one (microseconds)
+} metrics_t;
+
+// All the update functions use relaxed atomics, so they can be called from any thread
+// without taking a lock. The admin listener only reads the values.
+extern metrics_t metrics;
+
+void metrics_init(const char *server_name);
+
+void metrics_accepted();
+void metrics_disconnected();
+void metrics_message_in(size_t bytes);
+void metrics_message_out(size_t bytes);
+void metrics_messages_in(size_t messages, size_t bytes);
+void metrics_messages_out(size_t messages, size_t bytes);
+void metrics_fanout(size_t recipients);
+void metrics_queue_depth(int depth);
+void metrics_handling_time(uint64_t start_ns);
+void metrics_discovers(size_t answered, size_t suppressed);
+void metrics_announced();
+void metrics_taken_over();
+void metrics_rejected();
+void metrics_shed();
+void metrics_shedding(bool shedding);
+void metrics_slo_violation();
+void metrics_relayed_in(uint64_t sent_ns);
+void metrics_relayed_out(size_t peers);
+void metrics_relay_duplicate();
+
+uint64_t metrics_now_ns();
+uint64_t metrics_now_ms();
+
+// Admin listener. address is either "<port>" or "unix:<path>".
+// Returns the listening fd, every server serves it with metrics_start_admin_thread(), so scrapers never
+// wait on (or hold) the serving threads and event loops.
+int metrics_setup_admin(const char *address);
+void metrics_start_admin_thread(int admin_fd);
+
+#endif //CORE_METRICS_H
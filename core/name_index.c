@@ -0,0 +1,132 @@
+/**
+ ** Written by Amit Sides
+ **/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "name_index.h"
+
+static uint32_t hash_name(const char *name)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+
+    for (; '\0' != *name; name++)
+    {
+        hash ^= (unsigned char)*name;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Returns the entry holding the name, or the empty entry where it would be inserted
+static name_entry_t *lookup(name_index_t *index, const char *name, uint32_t hash)
+{
+    size_t mask = index->capacity - 1;
+    size_t position = hash & mask;
+
+    // The table is never more than half full, so there is always an empty entry to stop at
+    while (NAME_INDEX_NOT_FOUND != index->entries[position].slot)
+    {
+        name_entry_t *entry = &index->entries[position];
+        if (entry->hash == hash && 0 == strncmp(entry->name, name, NAME_INDEX_MAX_NAME))
+        {
+            return entry;
+        }
+        position = (position + 1) & mask;
+    }
+    return &index->entries[position];
+}
+
+void name_index_init(name_index_t *index, size_t maximum_names)
+{
+    index->capacity = 1;
+    while (index->capacity < maximum_names * 2)
+    {
+        index->capacity <<= 1;
+    }
+    index->count = 0;
+
+    index->entries = malloc(index->capacity * sizeof(*index->entries));
+    if (NULL == index->entries)
+    {
+        perror("malloc failed");
+        exit(errno);
+    }
+    for(size_t i=0; i < index->capacity; i++)
+    {
+        index->entries[i].slot = NAME_INDEX_NOT_FOUND;
+    }
+}
+
+void name_index_free(name_index_t *index)
+{
+    free(index->entries);
+    index->entries = NULL;
+    index->capacity = 0;
+    index->count = 0;
+}
+
+bool name_index_insert(name_index_t *index, const char *name, int slot)
+{
+    uint32_t hash = hash_name(name);
+    name_entry_t *entry = lookup(index, name, hash);
+
+    if (NAME_INDEX_NOT_FOUND != entry->slot || index->count * 2 >= index->capacity)
+    {
+        // Taken (or the index is full, which can't happen with one name per client)
+        return false;
+    }
+
+    entry->hash = hash;
+    entry->slot = slot;
+    strncpy(entry->name, name, NAME_INDEX_MAX_NAME);
+    entry->name[NAME_INDEX_MAX_NAME] = '\0';
+    index->count++;
+    return true;
+}
+
+int name_index_find(name_index_t *index, const char *name)
+{
+    return lookup(index, name, hash_name(name))->slot;
+}
+
+void name_index_remove(name_index_t *index, const char *name)
+{
+    size_t mask = index->capacity - 1;
+    name_entry_t *entry = lookup(index, name, hash_name(name));
+    size_t hole = entry - index->entries;
+    size_t position = hole;
+
+    if (NAME_INDEX_NOT_FOUND == entry->slot)
+    {
+        return;
+    }
+    entry->slot = NAME_INDEX_NOT_FOUND;
+    index->count--;
+
+    // Backward-shift deletion: moving following entries into the hole, so lookups
+    // never stop early at it (no tombstones needed)
+    while (true)
+    {
+        size_t home = 0;
+
+        position = (position + 1) & mask;
+        if (NAME_INDEX_NOT_FOUND == index->entries[position].slot)
+        {
+            return;
+        }
+
+        // The entry can fill the hole only if the hole is between its home and its position
+        home = index->entries[position].hash & mask;
+        if (((position - home) & mask) >= ((position - hole) & mask))
+        {
+            index->entries[hole] = index->entries[position];
+            index->entries[position].slot = NAME_INDEX_NOT_FOUND;
+            hole = position;
+        }
+    }
+}
@@ -0,0 +1,36 @@
+/**
+ ** Written by Amit Sides
+ **/
+
+#ifndef CORE_NAME_INDEX_H
+#define CORE_NAME_INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define NAME_INDEX_MAX_NAME     (32)
+#define NAME_INDEX_NOT_FOUND    (-1)
+
+typedef struct name_entry_s {
+    uint32_t hash;
+    int slot;                               // NAME_INDEX_NOT_FOUND marks an empty entry
+    char name[NAME_INDEX_MAX_NAME + 1];
+} name_entry_t;
+
+// Hash index from a client name to its slot in the clients array (open addressing, linear probing)
+typedef struct name_index_s {
+    name_entry_t *entries;
+    size_t capacity;                        // power of two, at least twice the amount of clients
+    size_t count;
+} name_index_t;
+
+void name_index_init(name_index_t *index, size_t maximum_names);
+void name_index_free(name_index_t *index);
+
+// Returns false if the name is already taken
+bool name_index_insert(name_index_t *index, const char *name, int slot);
+int name_index_find(name_index_t *index, const char *name);
+void name_index_remove(name_index_t *index, const char *name);
+
+#endif //CORE_NAME_INDEX_H
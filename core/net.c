@@ -0,0 +1,328 @@
+/**
+ ** Written by Amit Sides
+ **/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "net.h"
+
+#define PROFILE_SPEC_SIZE       (256)
+
+// default keeps the servers' original behavior (Nagle, kernel buffers, a backlog of 0)
+static const net_profile_t profiles[] = {
+    {"default", false, false, 0, 0, 0, 0},
+    {"latency", true, true, 0, 0, 50, SOMAXCONN},
+    {"throughput", false, false, 4 * 1024 * 1024, 4 * 1024 * 1024, 0, SOMAXCONN},
+};
+
+static net_profile_t profile = {"default", false, false, 0, 0, 0, 0};
+static const char *listen_address = NET_DEFAULT_ADDRESS;
+
+static int parse_value(const char *option, const char *value)
+{
+    char *end = NULL;
+    long number = strtol(value, &end, 10);
+
+    // Sizes may be given in kilobytes or megabytes
+    if ('k' == *end || 'K' == *end)
+    {
+        number *= 1024;
+        end++;
+    }
+    else if ('m' == *end || 'M' == *end)
+    {
+        number *= 1024 * 1024;
+        end++;
+    }
+
+    if (end == value || '\0' != *end || 0 > number)
+    {
+        fprintf(stderr, "Invalid value '%s' for the socket option %s\n", value, option);
+        exit(-1);
+    }
+    return (int)number;
+}
+
+static void parse_option(char *option)
+{
+    char *value = strchr(option, '=');
+
+    if (NULL == value)
+    {
+        fprintf(stderr, "Socket option '%s' has no value\n", option);
+        exit(-1);
+    }
+    *value++ = '\0';
+
+    if (0 == strcmp(option, "nodelay"))
+    {
+        profile.nodelay = 0 != parse_value(option, value);
+    }
+    else if (0 == strcmp(option, "quickack"))
+    {
+        profile.quickack = 0 != parse_value(option, value);
+    }
+    else if (0 == strcmp(option, "rcvbuf"))
+    {
+        profile.receive_buffer = parse_value(option, value);
+    }
+    else if (0 == strcmp(option, "sndbuf"))
+    {
+        profile.send_buffer = parse_value(option, value);
+    }
+    else if (0 == strcmp(option, "busy_poll"))
+    {
+        profile.busy_poll = parse_value(option, value);
+    }
+    else if (0 == strcmp(option, "backlog"))
+    {
+        profile.backlog = parse_value(option, value);
+    }
+    else
+    {
+        fprintf(stderr, "Unknown socket option '%s'\n", option);
+        exit(-1);
+    }
+}
+
+void net_configure(const char *profile_spec, const char *address)
+{
+    char spec[PROFILE_SPEC_SIZE] = {0};
+    char *name = NULL;
+    char *option = NULL;
+    char *saved = NULL;
+    bool found = false;
+
+    if (NULL != address)
+    {
+        listen_address = address;
+    }
+    if (NULL == profile_spec)
+    {
+        return;
+    }
+
+    snprintf(spec, sizeof(spec), "%s", profile_spec);
+    name = strtok_r(spec, ",", &saved);
+    for(int i=0; NULL != name && i < sizeof(profiles) / sizeof(*profiles); i++)
+    {
+        if (0 == strcmp(name, profiles[i].name))
+        {
+            profile = profiles[i];
+            found = true;
+            break;
+        }
+    }
+    if (!found)
+    {
+        fprintf(stderr, "Unknown socket profile '%s'\n", NULL == name ? "" : name);
+        exit(-1);
+    }
+
+    // Options override the profile's
+    while (NULL != (option = strtok_r(NULL, ",", &saved)))
+    {
+        parse_option(option);
+    }
+}
+
+static void set_option(int fd, int level, int name, int value, const char *description)
+{
+    if (0 != setsockopt(fd, level, name, &value, sizeof(value)))
+    {
+        perror(description);
+        exit(errno);
+    }
+}
+
+// Options inherited by the accepted sockets
+static void configure_listener(int server_fd)
+{
+    if (0 != profile.receive_buffer)
+    {
+        set_option(server_fd, SOL_SOCKET, SO_RCVBUF, profile.receive_buffer, "Failed to set SO_RCVBUF");
+    }
+    if (0 != profile.send_buffer)
+    {
+        set_option(server_fd, SOL_SOCKET, SO_SNDBUF, profile.send_buffer, "Failed to set SO_SNDBUF");
+    }
+    if (profile.nodelay)
+    {
+        set_option(server_fd, IPPROTO_TCP, TCP_NODELAY, 1, "Failed to set TCP_NODELAY");
+    }
+}
+
+// Constructs the server's address, returns its size. IPv6 addresses have a colon.
+static socklen_t resolve_address(int port, struct sockaddr_storage *server_address)
+{
+    struct sockaddr_in *ipv4_address = (struct sockaddr_in *)server_address;
+    struct sockaddr_in6 *ipv6_address = (struct sockaddr_in6 *)server_address;
+
+    memset(server_address, 0, sizeof(*server_address));
+    if (NULL != strchr(listen_address, ':'))
+    {
+        ipv6_address->sin6_family = AF_INET6;
+        ipv6_address->sin6_port = htons(port);
+        if (1 != inet_pton(AF_INET6, listen_address, &ipv6_address->sin6_addr))
+        {
+            fprintf(stderr, "Invalid listen address '%s'\n", listen_address);
+            exit(-1);
+        }
+        return sizeof(*ipv6_address);
+    }
+    else
+    {
+        ipv4_address->sin_family = AF_INET;
+        ipv4_address->sin_port = htons(port);
+        if (1 != inet_pton(AF_INET, listen_address, &ipv4_address->sin_addr))
+        {
+            fprintf(stderr, "Invalid listen address '%s'\n", listen_address);
+            exit(-1);
+        }
+        return sizeof(*ipv4_address);
+    }
+}
+
+int net_listen(int port)
+{
+    struct sockaddr_storage server_address = {0};
+    socklen_t server_address_size = resolve_address(port, &server_address);
+    int family = server_address.ss_family;
+    int server_fd = 0;
+
+    // Creates the server socket
+    server_fd = socket(family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (-1 == server_fd) {
+        perror("Failed to create server socket");
+        exit(errno);
+    }
+
+    // Sets socket option SO_REUSEADDR, other processes will be able to listen on this port
+    // (enables quick restart of the server)
+    set_option(server_fd, SOL_SOCKET, SO_REUSEADDR, 1, "Failed to set SO_REUSEADDR");
+
+    // Dual-stack: IPv4 clients connect to an IPv6 socket as ::ffff:a.b.c.d
+    if (AF_INET6 == family)
+    {
+        set_option(server_fd, IPPROTO_IPV6, IPV6_V6ONLY, 0, "Failed to clear IPV6_V6ONLY");
+    }
+    configure_listener(server_fd);
+
+    // Bind server socket to the network interface
+    if (0 != bind(server_fd, (struct sockaddr *)&server_address, server_address_size)) {
+        perror("Failed to bind");
+        exit(errno);
+    }
+
+    // Listen for incoming clients
+    if (0 != listen(server_fd, profile.backlog)) {
+        perror("Failed to listen");
+        exit(errno);
+    }
+
+    printf("Listening for incoming connections on %s:%d (%s profile)...\n", listen_address, port, profile.name);
+    return server_fd;
+}
+
+int net_bind_udp(int port, bool reuse_port)
+{
+    struct sockaddr_storage server_address = {0};
+    socklen_t server_address_size = resolve_address(port, &server_address);
+    int family = server_address.ss_family;
+    int server_fd = socket(family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+    if (-1 == server_fd)
+    {
+        perror("Failed to create server socket");
+        exit(errno);
+    }
+
+    // Every socket bound with SO_REUSEPORT gets its share of the flows, hashed by the peers' addresses
+    if (reuse_port)
+    {
+        set_option(server_fd, SOL_SOCKET, SO_REUSEPORT, 1, "Failed to set SO_REUSEPORT");
+    }
+    if (AF_INET6 == family)
+    {
+        set_option(server_fd, IPPROTO_IPV6, IPV6_V6ONLY, 0, "Failed to clear IPV6_V6ONLY");
+    }
+
+    // Datagrams that don't fit in the receive buffer are dropped, the throughput profile's buffers help
+    if (0 != profile.receive_buffer)
+    {
+        set_option(server_fd, SOL_SOCKET, SO_RCVBUF, profile.receive_buffer, "Failed to set SO_RCVBUF");
+    }
+    if (0 != profile.send_buffer)
+    {
+        set_option(server_fd, SOL_SOCKET, SO_SNDBUF, profile.send_buffer, "Failed to set SO_SNDBUF");
+    }
+    if (0 != profile.busy_poll &&
+        0 != setsockopt(server_fd, SOL_SOCKET, SO_BUSY_POLL, &profile.busy_poll, sizeof(profile.busy_poll)))
+    {
+        perror("Failed to set SO_BUSY_POLL");
+        profile.busy_poll = 0;
+    }
+
+    if (0 != bind(server_fd, (struct sockaddr *)&server_address, server_address_size))
+    {
+        perror("Failed to bind");
+        exit(errno);
+    }
+    return server_fd;
+}
+
+void net_accepted(int client_fd)
+{
+    // Also set on the listener, but not every kernel copies it to the accepted sockets
+    if (profile.nodelay)
+    {
+        set_option(client_fd, IPPROTO_TCP, TCP_NODELAY, 1, "Failed to set TCP_NODELAY");
+    }
+
+    // Raising the busy polling time needs CAP_NET_ADMIN, a server without it still runs
+    if (0 != profile.busy_poll &&
+        0 != setsockopt(client_fd, SOL_SOCKET, SO_BUSY_POLL, &profile.busy_poll, sizeof(profile.busy_poll)))
+    {
+        perror("Failed to set SO_BUSY_POLL");
+        profile.busy_poll = 0;
+    }
+
+    net_received(client_fd);
+}
+
+void net_received(int client_fd)
+{
+    int enabled = 1;
+
+    // Best-effort, the kernel may turn it off again by itself
+    if (profile.quickack)
+    {
+        setsockopt(client_fd, IPPROTO_TCP, TCP_QUICKACK, &enabled, sizeof(enabled));
+    }
+}
+
+const char *net_format_address(const struct sockaddr_storage *address, char *buffer, size_t size)
+{
+    char ip[INET6_ADDRSTRLEN] = {0};
+
+    if (AF_INET6 == address->ss_family)
+    {
+        const struct sockaddr_in6 *ipv6_address = (const struct sockaddr_in6 *)address;
+        inet_ntop(AF_INET6, &ipv6_address->sin6_addr, ip, sizeof(ip));
+        snprintf(buffer, size, "[%s]:%d", ip, ntohs(ipv6_address->sin6_port));
+    }
+    else
+    {
+        const struct sockaddr_in *ipv4_address = (const struct sockaddr_in *)address;
+        inet_ntop(AF_INET, &ipv4_address->sin_addr, ip, sizeof(ip));
+        snprintf(buffer, size, "%s:%d", ip, ntohs(ipv4_address->sin_port));
+    }
+    return buffer;
+}
@@ -0,0 +1,48 @@
+/**
+ ** Written by Amit Sides
+ **/
+
+#ifndef CORE_NET_H
+#define CORE_NET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/socket.h>
+
+#define NET_DEFAULT_ADDRESS     ("0.0.0.0")
+#define NET_ADDRESS_SIZE        (64)        // "[<IPv6>]:<port>" + null-terminator
+#define NET_PROFILE_USAGE       ("  -P  socket profile: default, latency or throughput, optionally followed by\n" \
+                                 "      ,nodelay=0|1 ,quickack=0|1 ,rcvbuf=<bytes> ,sndbuf=<bytes> ,busy_poll=<us> ,backlog=<n>\n" \
+                                 "  -B  address to listen on, \"::\" listens on IPv6 and IPv4 (dual-stack)\n")
+
+// Socket options of a server, tuned per deployment. Buffers of 0 keep the kernel's (auto-tuned) sizes.
+typedef struct net_profile_s {
+    const char *name;
+    bool nodelay;                       // TCP_NODELAY, no Nagle delay for small messages
+    bool quickack;                      // TCP_QUICKACK, no delayed ACKs. Not permanent, re-armed after every read.
+    int receive_buffer;                 // SO_RCVBUF, set on the listener so the window scale fits
+    int send_buffer;                    // SO_SNDBUF
+    int busy_poll;                      // SO_BUSY_POLL microseconds, 0 disables
+    int backlog;
+} net_profile_t;
+
+// Selects the profile, "<name>[,<option>=<value>...]", and the address to listen on (NULL for the default).
+// Call before net_listen(), normally from the servers' -P and -B options.
+void net_configure(const char *profile, const char *address);
+
+// Creates the server socket (socket, options, bind, listen), exits on failure
+int net_listen(int port);
+
+// Creates a UDP server socket (socket, buffers, bind), optionally shared with SO_REUSEPORT. Exits on failure.
+int net_bind_udp(int port, bool reuse_port);
+
+// Applies the per-connection options to an accepted socket
+void net_accepted(int client_fd);
+
+// Re-arms TCP_QUICKACK after a read, when the profile uses it
+void net_received(int client_fd);
+
+// "<ip>:<port>" of an IPv4 or IPv6 address
+const char *net_format_address(const struct sockaddr_storage *address, char *buffer, size_t size);
+
+#endif //CORE_NET_H
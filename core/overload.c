@@ -0,0 +1,166 @@
+/**
+ ** Written by Amit Sides
+ **/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "overload.h"
+#include "metrics.h"
+
+#define OVERLOAD_SPEC_SIZE      (128)
+
+static long parse_number(const char *value, const char *description)
+{
+    char *end = NULL;
+    long number = strtol(value, &end, 10);
+
+    if (end == value || '\0' != *end || 0 >= number)
+    {
+        fprintf(stderr, "Invalid %s '%s'\n", description, value);
+        exit(-1);
+    }
+    return number;
+}
+
+void overload_configure(overload_t *overload, const char *spec)
+{
+    char options[OVERLOAD_SPEC_SIZE] = {0};
+    char *option = NULL;
+    char *saved = NULL;
+
+    memset(overload, 0, sizeof(*overload));
+    if (NULL == spec)
+    {
+        return;
+    }
+
+    snprintf(options, sizeof(options), "%s", spec);
+    option = strtok_r(options, ",", &saved);
+    overload->slo_ns = parse_number(NULL == option ? "" : option, "latency SLO") * 1000;
+    overload->resume_ns = overload->slo_ns * OVERLOAD_RESUME_PERCENT / 100;
+    overload->window_ns = OVERLOAD_WINDOW_MS * 1000000ull;
+    while (NULL != (option = strtok_r(NULL, ",", &saved)))
+    {
+        if (0 == strcmp(option, "banner"))
+        {
+            overload->banner = true;
+        }
+        else if (0 == strncmp(option, "window=", sizeof("window=") - 1))
+        {
+            overload->window_ns = parse_number(option + sizeof("window=") - 1, "SLO window") * 1000000ull;
+        }
+        else
+        {
+            fprintf(stderr, "Unknown SLO option '%s'\n", option);
+            exit(-1);
+        }
+    }
+    printf("Shedding new connections while the p99 latency is over %luus (%s)\n",
+           overload->slo_ns / 1000, overload->banner ? "busy banner" : "reset");
+}
+
+void overload_observe(overload_t *overload, uint64_t latency_ns)
+{
+    uint64_t epoch = 0;
+    uint64_t previous = 0;
+    overload_window_t *window = NULL;
+
+    if (0 == overload->slo_ns)
+    {
+        return;
+    }
+
+    // The first message of a window claims its slot and clears the counts of two windows ago
+    epoch = metrics_now_ns() / overload->window_ns;
+    window = &overload->windows[epoch & 1];
+    previous = __atomic_load_n(&window->epoch, __ATOMIC_RELAXED);
+    if (previous != epoch && __atomic_compare_exchange_n(&window->epoch, &previous, epoch, false,
+                                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        __atomic_store_n(&window->samples, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&window->over_slo, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&window->over_resume, 0, __ATOMIC_RELAXED);
+    }
+
+    __atomic_fetch_add(&window->samples, 1, __ATOMIC_RELAXED);
+    if (latency_ns > overload->resume_ns)
+    {
+        __atomic_fetch_add(&window->over_resume, 1, __ATOMIC_RELAXED);
+    }
+    if (latency_ns > overload->slo_ns)
+    {
+        __atomic_fetch_add(&window->over_slo, 1, __ATOMIC_RELAXED);
+        metrics_slo_violation();
+    }
+}
+
+// Decides on the last complete window: sheds when its p99 breached the SLO, resumes when it's back under the
+// resume threshold (or nothing was handled). In between the state stays, so the server doesn't flap.
+static void decide(overload_t *overload, uint64_t epoch)
+{
+    overload_window_t *window = &overload->windows[(epoch - 1) & 1];
+    uint64_t samples = 0;
+    uint64_t over_slo = 0;
+    uint64_t over_resume = 0;
+
+    if (epoch - 1 == __atomic_load_n(&window->epoch, __ATOMIC_RELAXED))
+    {
+        samples = __atomic_load_n(&window->samples, __ATOMIC_RELAXED);
+        over_slo = __atomic_load_n(&window->over_slo, __ATOMIC_RELAXED);
+        over_resume = __atomic_load_n(&window->over_resume, __ATOMIC_RELAXED);
+    }
+
+    overload->decided_epoch = epoch;
+    if (!overload->shedding && OVERLOAD_MIN_SAMPLES <= samples && over_slo * 100 > samples)
+    {
+        printf("p99 latency over the SLO (%lu of %lu messages), shedding new connections\n", over_slo, samples);
+        overload->shedding = true;
+        metrics_shedding(true);
+    }
+    else if (overload->shedding && over_resume * 100 <= samples)
+    {
+        printf("p99 latency back under %luus, admitting new connections\n", overload->resume_ns / 1000);
+        overload->shedding = false;
+        metrics_shedding(false);
+    }
+}
+
+bool overload_admit(overload_t *overload)
+{
+    uint64_t epoch = 0;
+
+    if (0 == overload->slo_ns)
+    {
+        return true;
+    }
+
+    epoch = metrics_now_ns() / overload->window_ns;
+    if (epoch != overload->decided_epoch)
+    {
+        decide(overload, epoch);
+    }
+    return !overload->shedding;
+}
+
+void overload_shed(overload_t *overload, int client_fd)
+{
+    struct linger reset = {1, 0};
+
+    if (overload->banner)
+    {
+        // Best effort, a full send buffer doesn't hold the accepting thread
+        send(client_fd, OVERLOAD_BUSY_BANNER, sizeof(OVERLOAD_BUSY_BANNER) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    else
+    {
+        // A reset instead of the FIN handshake, nothing is left in TIME_WAIT
+        setsockopt(client_fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+    }
+    close(client_fd);
+    metrics_shed();
+}
@@ -0,0 +1,52 @@
+/**
+ ** Written by Amit Sides
+ **/
+
+#ifndef CORE_OVERLOAD_H
+#define CORE_OVERLOAD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define OVERLOAD_WINDOW_MS          (100)   // default, the p99 is checked over windows of this length
+#define OVERLOAD_RESUME_PERCENT     (75)    // shedding stops once the p99 is back under this share of the SLO
+#define OVERLOAD_MIN_SAMPLES        (100)   // a window with fewer messages doesn't start shedding
+#define OVERLOAD_BUSY_BANNER        ("Server busy, please try again later\n")
+#define OVERLOAD_USAGE              ("  -L  p99 latency SLO in microseconds, new connections are shed while it's breached:\n" \
+                                     "      <us>[,banner][,window=<ms>], banner tells them the server is busy before closing\n")
+
+// Latency-SLO admission control. The server observes every message's latency (queueing and handling),
+// and at accept the last window's p99 decides: over the SLO, new connections are shed (reset, or closed after
+// a busy banner) until it's back under OVERLOAD_RESUME_PERCENT of it, so the admitted clients keep meeting it.
+// Only counts are kept: the p99 is over a threshold when more than 1% of the messages are.
+typedef struct overload_window_s {
+    uint64_t epoch;                     // windows since the clock started, the window's counts are of this one
+    uint64_t samples;
+    uint64_t over_slo;
+    uint64_t over_resume;
+} overload_window_t;
+
+typedef struct overload_s {
+    uint64_t slo_ns;                    // 0 when disabled
+    uint64_t resume_ns;
+    uint64_t window_ns;
+    bool banner;
+    overload_window_t windows[2];       // the current window and the last one, by the epoch's parity.
+                                        // Updated with relaxed atomics from any thread, approximate.
+    uint64_t decided_epoch;             // the rest is only touched by the accepting thread
+    bool shedding;
+} overload_t;
+
+// Parses the SLO, "<us>[,banner][,window=<ms>]". NULL disables shedding.
+void overload_configure(overload_t *overload, const char *spec);
+
+// A message was handled, latency_ns since it was ready (the socket became readable). Callable from any thread.
+void overload_observe(overload_t *overload, uint64_t latency_ns);
+
+// A new connection was accepted, false when it should be shed. Called from the accepting thread only.
+bool overload_admit(overload_t *overload);
+
+// Closes a shed connection, with a reset or after the busy banner
+void overload_shed(overload_t *overload, int client_fd);
+
+#endif //CORE_OVERLOAD_H
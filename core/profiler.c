@@ -0,0 +1,295 @@
+/**
+ ** Written by Amit Sides
+ **/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define USE_RDTSC
+#endif
+
+#include "profiler.h"
+
+#define CALIBRATION_TIME_NS     (10 * 1000 * 1000)
+#define TRACE_BUFFER_SIZE       (1024 * 1024)
+
+typedef struct profile_histogram_s {
+    uint64_t buckets[PROFILER_HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+} profile_histogram_t;
+
+static const char *section_names[PROFILE_SECTIONS] = {
+    "wait", "handle_new_client", "handle_messages", "handle_broadcast", "recv", "snprintf", "fanout_send",
+};
+
+static volatile sig_atomic_t enable_requested = false;
+static volatile sig_atomic_t report_requested = false;
+static bool enabled = false;
+
+static profile_histogram_t histograms[PROFILE_SECTIONS] = {0};
+static uint64_t idle_wakeups = 0;
+
+static const char *trace_path = NULL;
+static FILE *trace_file = NULL;
+static bool trace_first_event = true;
+
+static uint64_t base_ticks = 0;
+static double ns_per_tick = 1.0;
+
+static uint64_t clock_ns()
+{
+    struct timespec now = {0};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static inline uint64_t read_ticks()
+{
+#ifdef USE_RDTSC
+    return __rdtsc();
+#else
+    return clock_ns();
+#endif
+}
+
+static void calibrate()
+{
+#ifdef USE_RDTSC
+    uint64_t start_ns = clock_ns();
+    uint64_t start_ticks = __rdtsc();
+    uint64_t end_ns = 0;
+
+    // Spinning for a short while to find out how long a tick is
+    do
+    {
+        end_ns = clock_ns();
+    } while (end_ns - start_ns < CALIBRATION_TIME_NS);
+
+    ns_per_tick = (double)(end_ns - start_ns) / (double)(__rdtsc() - start_ticks);
+#endif
+    base_ticks = read_ticks();
+}
+
+static void handle_toggle_signal(int signal_number)
+{
+    enable_requested = !enable_requested;
+}
+
+static void handle_report_signal(int signal_number)
+{
+    report_requested = true;
+}
+
+static void open_trace()
+{
+    if (NULL == trace_path)
+    {
+        return;
+    }
+
+    trace_file = fopen(trace_path, "w");
+    if (NULL == trace_file)
+    {
+        perror("Failed to open trace file");
+        return;
+    }
+
+    // A big buffer, so tracing won't add a write() to every event
+    setvbuf(trace_file, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+    fprintf(trace_file, "[\n");
+    trace_first_event = true;
+}
+
+static void close_trace()
+{
+    if (NULL == trace_file)
+    {
+        return;
+    }
+
+    fprintf(trace_file, "\n]\n");
+    fclose(trace_file);
+    trace_file = NULL;
+    fprintf(stderr, "Trace written to %s\n", trace_path);
+}
+
+static void apply_requests()
+{
+    if (report_requested)
+    {
+        report_requested = false;
+        profiler_report();
+    }
+
+    if (enable_requested && !enabled)
+    {
+        fprintf(stderr, "Profiler enabled\n");
+        memset(histograms, 0, sizeof(histograms));
+        idle_wakeups = 0;
+        enabled = true;
+    }
+    else if (!enable_requested && enabled)
+    {
+        enabled = false;
+        profiler_report();
+
+        // The trace keeps growing across toggles, flushing so it is complete up to this point
+        if (NULL != trace_file)
+        {
+            fflush(trace_file);
+            fprintf(stderr, "Trace flushed to %s\n", trace_path);
+        }
+    }
+}
+
+static void record(profile_section_t section, uint64_t start, bool traced)
+{
+    uint64_t end = read_ticks();
+    uint64_t duration_ns = (uint64_t)((double)(end - start) * ns_per_tick);
+    profile_histogram_t *histogram = &histograms[section];
+    int index = 0;
+
+    if (0 < duration_ns)
+    {
+        index = 64 - __builtin_clzll(duration_ns);
+    }
+    if (PROFILER_HISTOGRAM_BUCKETS - 1 < index)
+    {
+        index = PROFILER_HISTOGRAM_BUCKETS - 1;
+    }
+    histogram->buckets[index]++;
+    histogram->count++;
+    histogram->total_ns += duration_ns;
+    if (histogram->max_ns < duration_ns)
+    {
+        histogram->max_ns = duration_ns;
+    }
+
+    if (traced && NULL != trace_file)
+    {
+        // Complete ("X") events, timestamps are in microseconds
+        fprintf(trace_file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f}",
+                trace_first_event ? "" : ",\n", section_names[section], getpid(),
+                (double)(start - base_ticks) * ns_per_tick / 1000.0, (double)duration_ns / 1000.0);
+        trace_first_event = false;
+    }
+}
+
+void profiler_init(const char *path, bool start_enabled)
+{
+    struct sigaction action = {0};
+
+    trace_path = path;
+    calibrate();
+
+    action.sa_flags = SA_RESTART;
+    action.sa_handler = handle_toggle_signal;
+    if (0 != sigaction(SIGUSR1, &action, NULL))
+    {
+        perror("Failed to set SIGUSR1 handler");
+        exit(errno);
+    }
+    action.sa_handler = handle_report_signal;
+    if (0 != sigaction(SIGUSR2, &action, NULL))
+    {
+        perror("Failed to set SIGUSR2 handler");
+        exit(errno);
+    }
+
+    // The closing bracket is optional for trace viewers, but makes the file valid JSON
+    open_trace();
+    atexit(close_trace);
+
+    enable_requested = start_enabled;
+    apply_requests();
+    fprintf(stderr, "Profiler ready (pid %d): kill -USR1 to toggle, kill -USR2 to report\n", getpid());
+}
+
+uint64_t profiler_begin()
+{
+    if (enable_requested != enabled || report_requested)
+    {
+        apply_requests();
+    }
+
+    if (!enabled)
+    {
+        return 0;
+    }
+    return read_ticks();
+}
+
+void profiler_end(profile_section_t section, uint64_t start)
+{
+    if (!enabled || 0 == start)
+    {
+        return;
+    }
+    record(section, start, true);
+}
+
+void profiler_end_wait(uint64_t start, int ready)
+{
+    if (!enabled || 0 == start)
+    {
+        return;
+    }
+    if (0 == ready)
+    {
+        idle_wakeups++;
+    }
+    record(PROFILE_WAIT, start, 0 != ready);
+}
+
+static uint64_t percentile(profile_histogram_t *histogram, double fraction)
+{
+    uint64_t target = (uint64_t)((double)histogram->count * fraction);
+    uint64_t seen = 0;
+
+    for(int i=0; i < PROFILER_HISTOGRAM_BUCKETS; i++)
+    {
+        seen += histogram->buckets[i];
+        if (seen > target)
+        {
+            // Upper bound of the bucket
+            return 1ull << i;
+        }
+    }
+    return histogram->max_ns;
+}
+
+void profiler_report()
+{
+    uint64_t total_ns = 0;
+
+    // Nested sections (recv, snprintf, fanout_send) are included in handle_messages,
+    // so only the top level sections are summed up.
+    for(int i=PROFILE_WAIT; i <= PROFILE_BROADCAST; i++)
+    {
+        total_ns += histograms[i].total_ns;
+    }
+
+    fprintf(stderr, "%-18s %12s %12s %7s %10s %10s %10s\n",
+            "section", "count", "total(ms)", "share", "p50(ns)", "p99(ns)", "max(ns)");
+    for(int i=0; i < PROFILE_SECTIONS; i++)
+    {
+        profile_histogram_t *histogram = &histograms[i];
+        fprintf(stderr, "%-18s %12lu %12.3f %6.2f%% %10lu %10lu %10lu\n",
+                section_names[i], histogram->count, (double)histogram->total_ns / 1e6,
+                0 == total_ns ? 0.0 : 100.0 * (double)histogram->total_ns / (double)total_ns,
+                percentile(histogram, 0.5), percentile(histogram, 0.99), histogram->max_ns);
+    }
+    fprintf(stderr, "idle wake-ups: %lu\n", idle_wakeups);
+}
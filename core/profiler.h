@@ -0,0 +1,39 @@
+/**
+ ** Written by Amit Sides
+ **/
+
+#ifndef CORE_PROFILER_H
+#define CORE_PROFILER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define PROFILER_HISTOGRAM_BUCKETS  (40) // log2 buckets of nanoseconds
+
+typedef enum profile_section_e {
+    PROFILE_WAIT,           // poll / select
+    PROFILE_NEW_CLIENT,     // handle_new_client()
+    PROFILE_MESSAGES,       // handle_messages()
+    PROFILE_BROADCAST,      // handle_broadcast()
+    PROFILE_RECV,           // recv of a single client message
+    PROFILE_FORMAT,         // snprintf of the outgoing message
+    PROFILE_FANOUT,         // send_to_all_clients()
+    PROFILE_SECTIONS
+} profile_section_t;
+
+// Starts the profiler. Profiling can be toggled at runtime with SIGUSR1,
+// SIGUSR2 prints the histograms to stderr.
+// trace_path may be NULL, otherwise a Chrome trace (chrome://tracing, ui.perfetto.dev)
+// is written while the profiler is enabled, and flushed whenever it is disabled.
+void profiler_init(const char *trace_path, bool enabled);
+
+// Returns a timestamp to pass to profiler_end(), or 0 when the profiler is disabled
+uint64_t profiler_begin();
+void profiler_end(profile_section_t section, uint64_t start);
+
+// Like profiler_end(), but idle wake-ups (ready == 0) are kept out of the trace file
+void profiler_end_wait(uint64_t start, int ready);
+
+void profiler_report();
+
+#endif //CORE_PROFILER_H
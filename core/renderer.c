@@ -0,0 +1,141 @@
+/**
+ ** Written by Amit Sides
+ **/
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "renderer.h"
+
+#define ERASE_LINE              ("\33[2K\r")
+#define ERASE_TO_END            ("\33[K")
+#define FRAME_INTERVAL          (1000 / RENDER_FPS)
+
+void renderer_init(renderer_t *renderer)
+{
+    memset(renderer, 0, sizeof(*renderer));
+}
+
+static bool is_dirty(renderer_t *renderer)
+{
+    return renderer->redraw || 0 != renderer->output_length || renderer->line_length != renderer->shown_length ||
+           0 != memcmp(renderer->line, renderer->shown, renderer->line_length);
+}
+
+void renderer_print(renderer_t *renderer, const char *text, size_t length)
+{
+    if (sizeof(renderer->output) - renderer->output_length < length)
+    {
+        // A frame is late, better to draw now than to drop messages
+        renderer_flush(renderer, true);
+    }
+    if (sizeof(renderer->output) < length)
+    {
+        length = sizeof(renderer->output);
+    }
+
+    memcpy(renderer->output + renderer->output_length, text, length);
+    renderer->output_length += length;
+}
+
+void renderer_line(renderer_t *renderer, const char *prompt, const char *input, size_t input_length)
+{
+    size_t prompt_length = strlen(prompt);
+
+    if (sizeof(renderer->line) < prompt_length + input_length)
+    {
+        input_length = sizeof(renderer->line) - prompt_length;
+    }
+    memcpy(renderer->line, prompt, prompt_length);
+    memcpy(renderer->line + prompt_length, input, input_length);
+    renderer->line_length = prompt_length + input_length;
+}
+
+void renderer_invalidate(renderer_t *renderer)
+{
+    renderer->redraw = true;
+}
+
+int renderer_timeout(renderer_t *renderer)
+{
+    uint64_t elapsed = metrics_now_ms() - renderer->last_frame_ms;
+
+    if (!is_dirty(renderer))
+    {
+        return -1;
+    }
+    return FRAME_INTERVAL <= elapsed ? 0 : FRAME_INTERVAL - elapsed;
+}
+
+static size_t append(char *frame, size_t length, const char *data, size_t data_length)
+{
+    memcpy(frame + length, data, data_length);
+    return length + data_length;
+}
+
+// Builds the frame in memory: the whole line after messages, otherwise only from the first changed character
+static size_t build_frame(renderer_t *renderer, char *frame)
+{
+    size_t length = 0;
+    size_t common = 0;
+
+    if (renderer->redraw || 0 != renderer->output_length)
+    {
+        length = append(frame, length, ERASE_LINE, sizeof(ERASE_LINE) - 1);
+        length = append(frame, length, renderer->output, renderer->output_length);
+        return append(frame, length, renderer->line, renderer->line_length);
+    }
+
+    while (common < renderer->line_length && common < renderer->shown_length &&
+           renderer->line[common] == renderer->shown[common])
+    {
+        common++;
+    }
+
+    if (common < renderer->shown_length)
+    {
+        // Back to the first difference, and erasing the rest of the old line
+        length += sprintf(frame + length, "\33[%zuD", renderer->shown_length - common);
+        length = append(frame, length, ERASE_TO_END, sizeof(ERASE_TO_END) - 1);
+    }
+    return append(frame, length, renderer->line + common, renderer->line_length - common);
+}
+
+void renderer_flush(renderer_t *renderer, bool force)
+{
+    static char frame[RENDER_OUTPUT_SIZE + RENDER_LINE_SIZE + 64];
+    size_t length = 0;
+    size_t written = 0;
+    ssize_t result = 0;
+
+    if (!is_dirty(renderer) || (!force && 0 != renderer_timeout(renderer)))
+    {
+        return;
+    }
+
+    length = build_frame(renderer, frame);
+    while (written < length)
+    {
+        result = write(STDOUT_FILENO, frame + written, length - written);
+        if (-1 == result)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            // Nothing to report the error on
+            break;
+        }
+        written += result;
+    }
+
+    // The terminal shows the back buffer now
+    memcpy(renderer->shown, renderer->line, renderer->line_length);
+    renderer->shown_length = renderer->line_length;
+    renderer->output_length = 0;
+    renderer->redraw = false;
+    renderer->last_frame_ms = metrics_now_ms();
+}
@@ -0,0 +1,48 @@
+/**
+ ** Written by Amit Sides
+ **/
+
+#ifndef CORE_RENDERER_H
+#define CORE_RENDERER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define RENDER_FPS              (60)        // frames per second at most
+#define RENDER_OUTPUT_SIZE      (64 * 1024) // messages kept for the next frame
+#define RENDER_LINE_SIZE        (1024)      // the prompt line
+
+// Double-buffered terminal output of the chat clients. Messages scroll above a prompt line with the
+// input being typed. Every change goes to the back buffer, and a frame (at most RENDER_FPS a second) is
+// diffed against the front buffer, what the terminal shows, and written with a single write().
+// Typing a character costs a single byte of output instead of redrawing the whole line.
+typedef struct renderer_s {
+    char output[RENDER_OUTPUT_SIZE];    // messages printed since the last frame
+    size_t output_length;
+    char line[RENDER_LINE_SIZE];        // back buffer
+    size_t line_length;
+    char shown[RENDER_LINE_SIZE];       // front buffer
+    size_t shown_length;
+    bool redraw;                        // the terminal was written to directly, the front buffer is stale
+    uint64_t last_frame_ms;
+} renderer_t;
+
+void renderer_init(renderer_t *renderer);
+
+// Prints text above the prompt line
+void renderer_print(renderer_t *renderer, const char *text, size_t length);
+
+// Sets the prompt line
+void renderer_line(renderer_t *renderer, const char *prompt, const char *input, size_t input_length);
+
+// Redraws everything in the next frame, after writing to the terminal without the renderer
+void renderer_invalidate(renderer_t *renderer);
+
+// Milliseconds until the next frame is due, 0 if it is due, or -1 when there's nothing to draw. A poll timeout.
+int renderer_timeout(renderer_t *renderer);
+
+// Writes a frame if one is due (or right away with force, e.g. before exiting)
+void renderer_flush(renderer_t *renderer, bool force);
+
+#endif //CORE_RENDERER_H
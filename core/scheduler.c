@@ -0,0 +1,342 @@
+/**
+ ** Written by Amit Sides
+ **/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "scheduler.h"
+#include "affinity.h"
+
+#define DEQUE_MASK              (SCHEDULER_DEQUE_SIZE - 1)
+
+// The worker running on this thread, NULL outside the workers
+static __thread scheduler_worker_t *current_worker = NULL;
+
+static long futex(uint32_t *word, int operation, uint32_t value)
+{
+    return syscall(SYS_futex, word, operation, value, NULL, NULL, 0);
+}
+
+// Owner only. Returns false when the deque is full.
+static bool deque_push(deque_t *deque, task_t *task)
+{
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+
+    if (SCHEDULER_DEQUE_SIZE <= bottom - top)
+    {
+        return false;
+    }
+    __atomic_store_n(&deque->tasks[bottom & DEQUE_MASK], task, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+// Owner only, the newest task
+static task_t *deque_pop(deque_t *deque)
+{
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    int64_t top = 0;
+    task_t *task = NULL;
+
+    __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+    if (top > bottom)
+    {
+        // Empty
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    task = __atomic_load_n(&deque->tasks[bottom & DEQUE_MASK], __ATOMIC_RELAXED);
+    if (top == bottom)
+    {
+        // The last task, racing the thieves for it
+        if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        {
+            task = NULL;
+        }
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+    return task;
+}
+
+// Any thread, the oldest task. NULL when empty or when another thief won the race.
+static task_t *deque_steal(deque_t *deque)
+{
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    int64_t bottom = 0;
+    task_t *task = NULL;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+    if (top >= bottom)
+    {
+        return NULL;
+    }
+
+    task = __atomic_load_n(&deque->tasks[top & DEQUE_MASK], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    {
+        return NULL;
+    }
+    return task;
+}
+
+static bool deque_empty(deque_t *deque)
+{
+    return __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE) >= __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+}
+
+static void inject(scheduler_t *scheduler, task_t *task)
+{
+    task->next = NULL;
+    pthread_mutex_lock(&scheduler->injection_lock);
+    if (NULL == scheduler->injection_tail)
+    {
+        __atomic_store_n(&scheduler->injection_head, task, __ATOMIC_RELEASE);
+    }
+    else
+    {
+        scheduler->injection_tail->next = task;
+    }
+    scheduler->injection_tail = task;
+    pthread_mutex_unlock(&scheduler->injection_lock);
+}
+
+static task_t *take_injected(scheduler_t *scheduler)
+{
+    task_t *task = NULL;
+
+    // Checked without the lock first, the workers poll it whenever their deque is empty
+    if (NULL == __atomic_load_n(&scheduler->injection_head, __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&scheduler->injection_lock);
+    task = scheduler->injection_head;
+    if (NULL != task)
+    {
+        __atomic_store_n(&scheduler->injection_head, task->next, __ATOMIC_RELAXED);
+        if (NULL == task->next)
+        {
+            scheduler->injection_tail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&scheduler->injection_lock);
+    return task;
+}
+
+static bool has_work(scheduler_t *scheduler)
+{
+    if (NULL != __atomic_load_n(&scheduler->injection_head, __ATOMIC_ACQUIRE))
+    {
+        return true;
+    }
+    for(int i=0; i < scheduler->worker_count; i++)
+    {
+        if (!deque_empty(&scheduler->workers[i].deque))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Wakes a parked worker, if there is one. The seq_cst fence pairs with the one in park():
+// either the worker sees the new task, or this sees the worker sleeping.
+static void notify(scheduler_t *scheduler)
+{
+    __atomic_fetch_add(&scheduler->epoch, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (0 != __atomic_load_n(&scheduler->sleepers, __ATOMIC_SEQ_CST))
+    {
+        futex(&scheduler->epoch, FUTEX_WAKE_PRIVATE, 1);
+    }
+}
+
+static void park(scheduler_t *scheduler)
+{
+    uint32_t epoch = __atomic_load_n(&scheduler->epoch, __ATOMIC_ACQUIRE);
+
+    __atomic_fetch_add(&scheduler->sleepers, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    // A submission after reading the epoch changes it, so the wait returns right away
+    if (!has_work(scheduler) && !__atomic_load_n(&scheduler->stopping, __ATOMIC_ACQUIRE))
+    {
+        futex(&scheduler->epoch, FUTEX_WAIT_PRIVATE, epoch);
+    }
+    __atomic_fetch_sub(&scheduler->sleepers, 1, __ATOMIC_SEQ_CST);
+}
+
+static uint32_t next_random(scheduler_worker_t *worker)
+{
+    worker->random ^= worker->random << 13;
+    worker->random ^= worker->random >> 17;
+    worker->random ^= worker->random << 5;
+    return worker->random;
+}
+
+static task_t *steal(scheduler_worker_t *worker)
+{
+    scheduler_t *scheduler = worker->scheduler;
+    task_t *task = NULL;
+    int victim = 0;
+
+    if (1 == scheduler->worker_count)
+    {
+        return NULL;
+    }
+
+    // Starting from a random victim, so thieves don't all gang up on worker 0
+    victim = next_random(worker) % scheduler->worker_count;
+    for(int i=0; i < scheduler->worker_count; i++, victim = (victim + 1) % scheduler->worker_count)
+    {
+        if (victim == worker->index)
+        {
+            continue;
+        }
+        task = deque_steal(&scheduler->workers[victim].deque);
+        if (NULL != task)
+        {
+            worker->stolen++;
+            return task;
+        }
+    }
+    return NULL;
+}
+
+static task_t *find_task(scheduler_worker_t *worker)
+{
+    task_t *task = deque_pop(&worker->deque);
+
+    if (NULL == task)
+    {
+        task = take_injected(worker->scheduler);
+    }
+    for(int round=0; NULL == task && round < SCHEDULER_SPIN_ROUNDS; round++)
+    {
+        task = steal(worker);
+    }
+    return task;
+}
+
+static void *worker_thread(void *arguments)
+{
+    scheduler_worker_t *worker = arguments;
+    scheduler_t *scheduler = worker->scheduler;
+    task_t *task = NULL;
+
+    current_worker = worker;
+    affinity_apply(worker->index);
+    while (true)
+    {
+        task = find_task(worker);
+        if (NULL != task)
+        {
+            worker->executed++;
+            task->run(task);
+            continue;
+        }
+
+        if (__atomic_load_n(&scheduler->stopping, __ATOMIC_ACQUIRE) && !has_work(scheduler))
+        {
+            break;
+        }
+        park(scheduler);
+    }
+    return NULL;
+}
+
+void scheduler_init(scheduler_t *scheduler, int worker_count)
+{
+    memset(scheduler, 0, sizeof(*scheduler));
+    pthread_mutex_init(&scheduler->injection_lock, NULL);
+    scheduler->worker_count = worker_count;
+
+    // The deques are cache line aligned
+    if (0 != posix_memalign((void **)&scheduler->workers, SCHEDULER_CACHE_LINE, worker_count * sizeof(scheduler_worker_t)))
+    {
+        perror("posix_memalign failed");
+        exit(-1);
+    }
+    memset(scheduler->workers, 0, worker_count * sizeof(scheduler_worker_t));
+
+    for(int i=0; i < worker_count; i++)
+    {
+        scheduler_worker_t *worker = &scheduler->workers[i];
+
+        worker->index = i;
+        worker->random = (uint32_t)time(NULL) ^ (i + 1) * 2654435761u;
+        worker->scheduler = scheduler;
+        if (0 == worker->random)
+        {
+            worker->random = 1;
+        }
+    }
+
+    // Started after every worker is set up, they steal from each other right away
+    for(int i=0; i < worker_count; i++)
+    {
+        errno = pthread_create(&scheduler->workers[i].tid, NULL, worker_thread, &scheduler->workers[i]);
+        if (0 != errno)
+        {
+            perror("Failed to create a scheduler worker");
+            exit(errno);
+        }
+    }
+}
+
+void scheduler_submit(scheduler_t *scheduler, task_t *task)
+{
+    scheduler_worker_t *worker = current_worker;
+
+    if (NULL == worker || worker->scheduler != scheduler || !deque_push(&worker->deque, task))
+    {
+        // From outside the workers, or a full deque
+        inject(scheduler, task);
+    }
+    notify(scheduler);
+}
+
+void scheduler_yield(scheduler_t *scheduler, task_t *task)
+{
+    inject(scheduler, task);
+    notify(scheduler);
+}
+
+void scheduler_stop(scheduler_t *scheduler)
+{
+    __atomic_store_n(&scheduler->stopping, true, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&scheduler->epoch, 1, __ATOMIC_SEQ_CST);
+    futex(&scheduler->epoch, FUTEX_WAKE_PRIVATE, INT_MAX);
+
+    for(int i=0; i < scheduler->worker_count; i++)
+    {
+        errno = pthread_join(scheduler->workers[i].tid, NULL);
+        if (0 != errno)
+        {
+            perror("Failed to join a scheduler worker");
+            exit(errno);
+        }
+    }
+
+    free(scheduler->workers);
+    scheduler->workers = NULL;
+    pthread_mutex_destroy(&scheduler->injection_lock);
+}
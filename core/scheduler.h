@@ -0,0 +1,70 @@
+/**
+ ** Written by Amit Sides
+ **/
+
+#ifndef CORE_SCHEDULER_H
+#define CORE_SCHEDULER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define SCHEDULER_DEQUE_SIZE    (4096)  // tasks per worker deque, a power of two
+#define SCHEDULER_SPIN_ROUNDS   (64)    // steal attempts over all the victims before parking
+#define SCHEDULER_CACHE_LINE    (64)
+
+// A unit of work. Embed it as the first member of the work's struct, run() gets it back.
+// A task is in at most one queue at a time, and may yield itself (scheduler_yield) to run again later.
+typedef struct task_s {
+    void (*run)(struct task_s *task);
+    struct task_s *next;                // the injection queue
+} task_t;
+
+// Chase-Lev work-stealing deque (Le et al., "Correct and Efficient Work-Stealing for Weak Memory Models").
+// The owner pushes and pops at the bottom without locking, thieves take from the top with a CAS.
+typedef struct deque_s {
+    int64_t top __attribute__((aligned(SCHEDULER_CACHE_LINE)));
+    int64_t bottom __attribute__((aligned(SCHEDULER_CACHE_LINE)));
+    task_t *tasks[SCHEDULER_DEQUE_SIZE] __attribute__((aligned(SCHEDULER_CACHE_LINE)));
+} deque_t;
+
+struct scheduler_s;
+
+typedef struct scheduler_worker_s {
+    deque_t deque;
+    pthread_t tid;
+    int index;
+    uint32_t random;                    // xorshift state, for picking victims
+    uint64_t executed;
+    uint64_t stolen;
+    struct scheduler_s *scheduler;
+} scheduler_worker_t;
+
+// Workers run the tasks of their own deque first (LIFO, cache-warm), then the tasks submitted from other
+// threads and the yielded ones (FIFO), then steal from random victims (FIFO, the oldest and usually biggest work). A worker that finds
+// nothing parks on a futex, and a submission wakes one only when some are parked.
+typedef struct scheduler_s {
+    scheduler_worker_t *workers;
+    int worker_count;
+    pthread_mutex_t injection_lock;     // tasks submitted from outside the workers
+    task_t *injection_head;
+    task_t *injection_tail;
+    uint32_t epoch __attribute__((aligned(SCHEDULER_CACHE_LINE))); // the futex, bumped on every submission
+    uint32_t sleepers;
+    bool stopping;
+} scheduler_t;
+
+// Starts the workers
+void scheduler_init(scheduler_t *scheduler, int worker_count);
+
+// Schedules a task. From a worker it goes to the worker's own deque, from any other thread to the injection queue.
+void scheduler_submit(scheduler_t *scheduler, task_t *task);
+
+// Schedules a task behind all the queued ones, for a task that used its budget and runs again.
+// It goes to the injection queue (FIFO): the worker's own deque is LIFO and would run it again first.
+void scheduler_yield(scheduler_t *scheduler, task_t *task);
+
+// Lets the workers finish the queued tasks and joins them
+void scheduler_stop(scheduler_t *scheduler);
+
+#endif //CORE_SCHEDULER_H
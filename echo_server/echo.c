@@ -10,26 +10,58 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <string.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include "metrics.h"
+#include "net.h"
+#include "handoff.h"
+#include "overload.h"
 
-#define SERVER_INTERFACE    ("0.0.0.0")
 #define SERVER_PORT         (12345)
+#define NO_SOCKET           (-1)
 
 #define MAX_MESSAGE_SIZE    (256)
 
-int setup_server();
+#define UDP_BATCH           (64)            // default datagrams per recvmmsg/sendmmsg
+#define MAX_UDP_BATCH       (1024)
+#define UDP_BUFFER_SIZE     (64 * 1024)     // the largest datagram, and the largest GRO'd one
+#define UDP_CONTROL_SIZE    (CMSG_SPACE(sizeof(int)))
+
+#define USAGE               ("Usage: %s [-a <admin port | unix:path>] [-u [-n <sockets>] [-b <batch>]] [-U <path>]\n" \
+                             "          [-L <SLO>] [-P <profile>] [-B <address>]\n" \
+                             "  -u  echo UDP datagrams instead of a TCP client\n" \
+                             "  -n  SO_REUSEPORT sockets, each served by its own thread\n" \
+                             "  -b  datagrams per recvmmsg/sendmmsg, 1 for a recvfrom/sendto per datagram\n" \
+                             "  -U  upgrade socket, take over the listeners of the TCP server running there and hand them\n" \
+                             "      over to the next one, after the client being served\n")
+
+// A UDP socket and the thread serving it
+typedef struct udp_socket_s {
+    pthread_t tid;
+    int fd;
+    int batch;
+    bool gro;                           // datagrams of a flow may arrive coalesced
+} udp_socket_t;
+
+overload_t overload;
 
-void handle_client(int client_fd, struct sockaddr_in client_address)
+void handle_client(int client_fd, struct sockaddr_storage *client_address)
 {
     int bytes_recv = 0;
     int bytes_sent = 0;
+    uint64_t start = 0;
     char message[MAX_MESSAGE_SIZE] = {0};
+    char client_name[NET_ADDRESS_SIZE] = {0};
 
     // Print client information
-    char *client_ip = inet_ntoa(client_address.sin_addr);
-    int client_port = ntohs(client_address.sin_port);
-    printf("A client connected from: %s:%d!\n", client_ip, client_port);
+    net_format_address(client_address, client_name, sizeof(client_name));
+    printf("A client connected from: %s!\n", client_name);
 
     while(true)
     {
@@ -44,13 +76,16 @@ void handle_client(int client_fd, struct sockaddr_in client_address)
         if (0 == bytes_recv)
         {
             // Connection probably closed...
-            printf("client %s:%d disconnected.\n", client_ip, client_port);
+            printf("client %s disconnected.\n", client_name);
             goto lbl_cleanup;
         }
 
         // A message was received, print it.
+        net_received(client_fd);
+        start = metrics_now_ns();
+        metrics_message_in(bytes_recv);
         message[bytes_recv-1] = '\0'; // replacing new-line with null-terminator
-        printf("Echoing '%s' to %s:%d...\n", message, client_ip, client_port);
+        printf("Echoing '%s' to %s...\n", message, client_name);
         message[bytes_recv-1] = '\n'; // replacing null-terminator with new-line
 
         // Echoing the message...
@@ -60,76 +95,332 @@ void handle_client(int client_fd, struct sockaddr_in client_address)
             perror("Failed to echo message");
             goto lbl_cleanup;
         }
+        metrics_message_out(bytes_sent);
+        metrics_handling_time(start);
+        overload_observe(&overload, metrics_now_ns() - start);
     }
 
 lbl_cleanup:
     close(client_fd);
+    metrics_disconnected();
 }
 
-int main()
+// The baseline: a system call per datagram in and one out
+void echo_datagrams(udp_socket_t *udp_socket)
 {
-    struct sockaddr_in client_address = {0};
-    int server_fd = 0, client_fd = 0;
-    int client_address_size = sizeof(client_address);
+    struct sockaddr_storage client_address = {0};
+    socklen_t client_address_size = 0;
+    char *datagram = malloc(UDP_BUFFER_SIZE);
+    ssize_t length = 0;
 
-    // Setup the server (socket, bind, listen)
-    server_fd = setup_server();
+    if (NULL == datagram)
+    {
+        perror("malloc failed");
+        exit(errno);
+    }
 
-    // Keep the server running to accept new clients
     while (true)
     {
-        // Accept a client
-        client_fd = accept4(server_fd, (struct sockaddr *)&client_address,
-                            &client_address_size, SOCK_CLOEXEC);
-        if (0 < client_fd)
+        client_address_size = sizeof(client_address);
+        length = recvfrom(udp_socket->fd, datagram, UDP_BUFFER_SIZE, 0,
+                          (struct sockaddr *)&client_address, &client_address_size);
+        if (-1 == length)
         {
-            handle_client(client_fd, client_address);
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            perror("recvfrom failed");
+            exit(errno);
         }
-    }
+        metrics_message_in(length);
 
-    close(server_fd);
-    return 0;
+        // A client that went away is its problem, the next datagram is someone else's
+        if (length == sendto(udp_socket->fd, datagram, length, 0, (struct sockaddr *)&client_address,
+                             client_address_size))
+        {
+            metrics_message_out(length);
+        }
+    }
 }
 
+// The segment size of a GRO'd datagram (several of a flow's datagrams back to back), 0 for a single one
+int gro_segment_size(struct msghdr *message)
+{
+    struct cmsghdr *header = NULL;
+    int segment_size = 0;
+
+    for (header = CMSG_FIRSTHDR(message); NULL != header; header = CMSG_NXTHDR(message, header))
+    {
+        if (SOL_UDP == header->cmsg_level && UDP_GRO == header->cmsg_type)
+        {
+            memcpy(&segment_size, CMSG_DATA(header), sizeof(segment_size));
+        }
+    }
+    return segment_size;
+}
 
-int setup_server()
+// A batch of datagrams in a single recvmmsg, echoed to their senders with a single sendmmsg.
+// A GRO'd datagram is echoed as is with UDP_SEGMENT (GSO): the kernel splits it into the original datagrams.
+void echo_datagram_batches(udp_socket_t *udp_socket)
 {
-    struct sockaddr_in server_address = {0};
-    int server_fd = 0;
+    struct mmsghdr *messages = calloc(udp_socket->batch, sizeof(*messages));
+    struct iovec *vectors = calloc(udp_socket->batch, sizeof(*vectors));
+    struct sockaddr_storage *addresses = calloc(udp_socket->batch, sizeof(*addresses));
+    char *controls = calloc(udp_socket->batch, UDP_CONTROL_SIZE);
+    char *buffers = malloc((size_t)udp_socket->batch * UDP_BUFFER_SIZE); // only the touched pages are resident
+    struct cmsghdr *header = NULL;
+    uint16_t segment_size = 0;
+    size_t datagrams = 0;
+    size_t bytes = 0;
+    int received = 0;
+    int sent = 0;
+    int result = 0;
 
-    // Creates the server socket
-    server_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
-    if (-1 == server_fd) {
-        perror("Failed to create server socket");
+    if (NULL == messages || NULL == vectors || NULL == addresses || NULL == controls || NULL == buffers)
+    {
+        perror("Failed to allocate the datagram batch");
         exit(errno);
     }
 
-    // Sets socket option SO_REUSEADDR, other processes will be able to listen on this port
-    // (enables quick restart of the server)
+    // Every message is set up for receiving, and the ones used for replies are set up again after sending
+    received = udp_socket->batch;
+    while (true)
+    {
+        for(int i=0; i < received; i++)
+        {
+            vectors[i].iov_base = buffers + (size_t)i * UDP_BUFFER_SIZE;
+            vectors[i].iov_len = UDP_BUFFER_SIZE;
+            messages[i].msg_hdr.msg_name = &addresses[i];
+            messages[i].msg_hdr.msg_namelen = sizeof(addresses[i]);
+            messages[i].msg_hdr.msg_iov = &vectors[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+            messages[i].msg_hdr.msg_control = controls + i * UDP_CONTROL_SIZE;
+            messages[i].msg_hdr.msg_controllen = UDP_CONTROL_SIZE;
+            messages[i].msg_hdr.msg_flags = 0;
+        }
+
+        // Blocks for the first datagram only, then takes whatever else is queued
+        received = recvmmsg(udp_socket->fd, messages, udp_socket->batch, MSG_WAITFORONE, NULL);
+        if (-1 == received)
+        {
+            if (EINTR == errno)
+            {
+                received = 0;
+                continue;
+            }
+            perror("recvmmsg failed");
+            exit(errno);
+        }
+
+        // The replies reuse the received messages: same buffer and address, only the length and control change
+        datagrams = 0;
+        bytes = 0;
+        for(int i=0; i < received; i++)
+        {
+            segment_size = udp_socket->gro ? gro_segment_size(&messages[i].msg_hdr) : 0;
+            vectors[i].iov_len = messages[i].msg_len;
+            messages[i].msg_hdr.msg_control = NULL;
+            messages[i].msg_hdr.msg_controllen = 0;
+            if (0 != segment_size && segment_size < messages[i].msg_len)
+            {
+                messages[i].msg_hdr.msg_control = controls + i * UDP_CONTROL_SIZE;
+                messages[i].msg_hdr.msg_controllen = CMSG_SPACE(sizeof(segment_size));
+                header = CMSG_FIRSTHDR(&messages[i].msg_hdr);
+                header->cmsg_level = SOL_UDP;
+                header->cmsg_type = UDP_SEGMENT;
+                header->cmsg_len = CMSG_LEN(sizeof(segment_size));
+                memcpy(CMSG_DATA(header), &segment_size, sizeof(segment_size));
+                datagrams += (messages[i].msg_len + segment_size - 1) / segment_size;
+            }
+            else
+            {
+                datagrams++;
+            }
+            bytes += messages[i].msg_len;
+        }
+        metrics_messages_in(datagrams, bytes);
+
+        // A reply that fails (its client went away) is skipped, the rest of the batch is still sent
+        sent = 0;
+        while (sent < received)
+        {
+            result = sendmmsg(udp_socket->fd, messages + sent, received - sent, 0);
+            if (0 < result)
+            {
+                sent += result;
+            }
+            else if (EINTR != errno)
+            {
+                sent++;
+            }
+        }
+        metrics_messages_out(datagrams, bytes);
+    }
+}
+
+void *serve_udp_socket(void *udp_socket_data)
+{
+    udp_socket_t *udp_socket = (udp_socket_t *)udp_socket_data;
+
+    if (1 == udp_socket->batch)
+    {
+        echo_datagrams(udp_socket);
+    }
+    else
+    {
+        echo_datagram_batches(udp_socket);
+    }
+    return NULL;
+}
+
+// UDP mode: every socket shares the port (SO_REUSEPORT) and has a thread of its own, the kernel spreads the
+// clients over them by their address
+void run_udp(int sockets, int batch)
+{
+    udp_socket_t *udp_sockets = calloc(sockets, sizeof(*udp_sockets));
     int enabled = 1;
-    if (0 != setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &enabled, sizeof(enabled)))
+
+    if (NULL == udp_sockets)
     {
-        perror("Failed to set SO_REUSEADDR");
+        perror("calloc failed");
         exit(errno);
     }
 
-    // Construct the server's data struct
-    server_address.sin_family = AF_INET;
-    server_address.sin_addr.s_addr = inet_addr(SERVER_INTERFACE);
-    server_address.sin_port = htons(SERVER_PORT);
+    for(int i=0; i < sockets; i++)
+    {
+        udp_sockets[i].fd = net_bind_udp(SERVER_PORT, 1 < sockets);
+        udp_sockets[i].batch = batch;
 
-    // Bind server socket to the network interface
-    if (0 != bind(server_fd, (struct sockaddr *)&server_address, sizeof(server_address))) {
-        perror("Failed to bind");
-        exit(errno);
+        // GRO only makes sense with the batches, older kernels don't have it
+        udp_sockets[i].gro = 1 < batch &&
+                             0 == setsockopt(udp_sockets[i].fd, SOL_UDP, UDP_GRO, &enabled, sizeof(enabled));
     }
+    printf("Echoing datagrams on port %d: %d socket(s), %d per batch, GRO %s\n", SERVER_PORT, sockets, batch,
+           udp_sockets[0].gro ? "on" : "off");
 
-    // Listen for incoming clients
-    if (0 != listen(server_fd, 0)) {
-        perror("Failed to listen");
-        exit(errno);
+    for(int i=0; i < sockets; i++)
+    {
+        errno = pthread_create(&udp_sockets[i].tid, NULL, serve_udp_socket, &udp_sockets[i]);
+        if (0 != errno)
+        {
+            perror("Failed to create a socket's thread");
+            exit(errno);
+        }
+    }
+    for(int i=0; i < sockets; i++)
+    {
+        pthread_join(udp_sockets[i].tid, NULL);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    struct sockaddr_storage client_address = {0};
+    int server_fd = NO_SOCKET, client_fd = 0;
+    int admin_fd = NO_SOCKET;
+    int client_address_size = sizeof(client_address);
+    int option = 0;
+    char *profile = NULL;
+    char *address = NULL;
+    bool udp = false;
+    int sockets = 1;
+    int batch = UDP_BATCH;
+    char *admin_address = NULL;
+    char *upgrade_path = NULL;
+
+    metrics_init("echo_server");
+
+    while (-1 != (option = getopt(argc, argv, "a:un:b:U:L:P:B:")))
+    {
+        switch (option)
+        {
+        case 'a':
+            // Optional admin listener. The server blocks on a single client, so it is served from a side thread
+            admin_address = optarg;
+            break;
+        case 'u':
+            udp = true;
+            break;
+        case 'n':
+            sockets = atoi(optarg);
+            break;
+        case 'b':
+            batch = atoi(optarg);
+            break;
+        case 'U':
+            upgrade_path = optarg;
+            break;
+        case 'L':
+            overload_configure(&overload, optarg);
+            break;
+        case 'P':
+            profile = optarg;
+            break;
+        case 'B':
+            address = optarg;
+            break;
+        default:
+            fprintf(stderr, USAGE, argv[0]);
+            fputs(OVERLOAD_USAGE, stderr);
+            fputs(NET_PROFILE_USAGE, stderr);
+            return -1;
+        }
+    }
+    if (0 >= sockets || 0 >= batch || MAX_UDP_BATCH < batch)
+    {
+        fprintf(stderr, USAGE, argv[0]);
+        return -1;
+    }
+
+    net_configure(profile, address);
+    if (NULL != upgrade_path && !udp)
+    {
+        handoff_take_listeners(upgrade_path, &server_fd, &admin_fd);
+    }
+    if (NO_SOCKET == admin_fd && NULL != admin_address)
+    {
+        admin_fd = metrics_setup_admin(admin_address);
+    }
+    if (NO_SOCKET != admin_fd)
+    {
+        metrics_start_admin_thread(admin_fd);
+    }
+    if (udp)
+    {
+        run_udp(sockets, batch);
+        return 0;
+    }
+
+    if (NO_SOCKET == server_fd)
+    {
+        // Setup the server (socket, bind, listen)
+        server_fd = net_listen(SERVER_PORT);
+    }
+    if (NULL != upgrade_path)
+    {
+        handoff_listeners_in_background(upgrade_path, server_fd, admin_fd);
     }
 
-    printf("Listening for incoming connections on %s:%d...\n", SERVER_INTERFACE, SERVER_PORT);
-    return server_fd;
+    // Keep the server running to accept new clients. After a hot upgrade the successor accepts, and this
+    // process exits once the client it serves left.
+    while (handoff_wait_accept(server_fd))
+    {
+        // Accept a client
+        client_fd = accept4(server_fd, (struct sockaddr *)&client_address,
+                            &client_address_size, SOCK_CLOEXEC);
+        if (0 < client_fd && !overload_admit(&overload))
+        {
+            overload_shed(&overload, client_fd);
+        }
+        else if (0 < client_fd)
+        {
+            metrics_accepted();
+            net_accepted(client_fd);
+            handle_client(client_fd, &client_address);
+        }
+    }
+
+    close(server_fd);
+    return 0;
 }
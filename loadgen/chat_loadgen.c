@@ -0,0 +1,664 @@
+/**
+ ** Written by Amit Sides
+ **/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define DEFAULT_IP              ("127.0.0.1")
+#define DEFAULT_PORT            (12345)
+#define DEFAULT_CLIENTS         (100)
+#define DEFAULT_RATE            (100)   // messages per second, over all clients
+#define DEFAULT_DURATION        (10)    // seconds of sending
+#define DEFAULT_DRAIN           (2)     // seconds to wait for late deliveries
+#define DEFAULT_SLOW_MS         (100)   // a delivery slower than this marks a slow receiver
+#define DEFAULT_INFLIGHT        (1)     // concurrent handshakes, the servers listen with a tiny backlog
+#define HANDSHAKE_TIMEOUT       (5)     // seconds without a client joining before giving up
+
+#define WELCOME_BANNER          ("Hello! Please enter your name: ")
+#define RESET                   ("\x1B[0m")
+#define MESSAGE_TAG             ("LG ")
+#define NAME_FORMAT             ("sim%d")
+#define RECV_BUFFER_SIZE        (64 * 1024)
+#define MAX_MESSAGE_SIZE        (256)   // the chat servers read a single message into this much
+#define MAX_EVENTS              (256)
+#define MAX_SERVERS             (16)    // -p takes a comma separated list, for federated servers
+
+#define USAGE ("Usage: %s [-h <ip>] [-p <port>[,<port>...]] [-c <clients>] [-r <msgs/sec>] [-d <seconds>]\n" \
+               "          [-s <message size>] [-l <slow ms>] [-i <inflight handshakes>] [-e] [-C]\n")
+
+// Log-linear histogram: 64 sub-buckets per power of two nanoseconds (~1.5% precision)
+#define SUB_BUCKET_BITS         (6)
+#define SUB_BUCKETS             (1 << SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS       (64 * SUB_BUCKETS)
+
+typedef enum client_state_e {
+    STATE_CONNECTING,
+    STATE_WAITING_BANNER,
+    STATE_WAITING_JOIN,
+    STATE_READY,
+    STATE_CLOSED,
+} client_state_t;
+
+typedef struct sim_client_s {
+    int fd;
+    int index;
+    client_state_t state;
+    char name[32];
+    char join_tag[40];          // "<name><RESET>", how the server prints our name
+    char *buffer;
+    size_t buffered;
+    uint64_t deliveries;
+    uint64_t slow_deliveries;
+} sim_client_t;
+
+typedef struct sent_message_s {
+    uint64_t send_ns;
+    int sender;
+    int expected;               // other ready clients when the message was sent
+    int received;
+} sent_message_t;
+
+typedef struct histogram_s {
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t max;
+} histogram_t;
+
+static histogram_t delivery_latency = {0};   // send -> each receiver
+static histogram_t fanout_latency = {0};     // send -> last receiver
+
+static sent_message_t *messages = NULL;
+static size_t messages_capacity = 0;
+static size_t messages_sent = 0;
+static uint64_t fanouts_completed = 0;
+static uint64_t total_deliveries = 0;
+static int ready_clients = 0;
+static int rejected_clients = 0;
+static int dropped_clients = 0;
+static int accepted_clients = 0;    // got the banner (or were rejected), no longer occupying the backlog
+static bool echo_mode = false;      // an echo server: no handshake, every message comes back to its sender
+
+static uint64_t now_ns()
+{
+    struct timespec now = {0};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static void histogram_record(histogram_t *histogram, uint64_t value)
+{
+    int index = value;
+
+    if (value >= SUB_BUCKETS)
+    {
+        int exponent = 63 - __builtin_clzll(value);
+        int shift = exponent - SUB_BUCKET_BITS;
+        index = ((shift + 1) << SUB_BUCKET_BITS) + ((value >> shift) & (SUB_BUCKETS - 1));
+    }
+    if (HISTOGRAM_BUCKETS <= index)
+    {
+        index = HISTOGRAM_BUCKETS - 1;
+    }
+
+    histogram->buckets[index]++;
+    histogram->count++;
+    if (histogram->max < value)
+    {
+        histogram->max = value;
+    }
+}
+
+static uint64_t histogram_value(int index)
+{
+    int shift = (index >> SUB_BUCKET_BITS) - 1;
+
+    if (0 > shift)
+    {
+        return index;
+    }
+    return ((uint64_t)(SUB_BUCKETS + (index & (SUB_BUCKETS - 1))) << shift);
+}
+
+static double histogram_percentile_ms(histogram_t *histogram, double fraction)
+{
+    uint64_t target = (uint64_t)((double)histogram->count * fraction);
+    uint64_t seen = 0;
+
+    if (0 == histogram->count)
+    {
+        return 0;
+    }
+    for(int i=0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += histogram->buckets[i];
+        if (seen > target)
+        {
+            return (double)histogram_value(i) / 1e6;
+        }
+    }
+    return (double)histogram->max / 1e6;
+}
+
+static void close_client(int epoll_fd, sim_client_t *client)
+{
+    if (STATE_CLOSED == client->state)
+    {
+        return;
+    }
+
+    if (STATE_READY == client->state)
+    {
+        ready_clients--;
+        dropped_clients++;
+    }
+    else
+    {
+        // The chat servers close connections they have no slot for
+        rejected_clients++;
+        if (STATE_WAITING_BANNER >= client->state)
+        {
+            accepted_clients++;
+        }
+    }
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    client->state = STATE_CLOSED;
+}
+
+static void start_connection(int epoll_fd, sim_client_t *client, struct sockaddr_in *server_address)
+{
+    struct epoll_event event = {0};
+    int enabled = 1;
+
+    client->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (-1 == client->fd)
+    {
+        perror("socket failed");
+        exit(errno);
+    }
+
+    // Latency is what we measure, don't let Nagle batch our small messages
+    setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &enabled, sizeof(enabled));
+
+    if (0 != connect(client->fd, (struct sockaddr *)server_address, sizeof(*server_address)) &&
+        EINPROGRESS != errno)
+    {
+        perror("connect failed");
+        exit(errno);
+    }
+
+    client->state = STATE_CONNECTING;
+    event.events = EPOLLIN | EPOLLOUT;
+    event.data.ptr = client;
+    if (0 != epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client->fd, &event))
+    {
+        perror("epoll_ctl failed");
+        exit(errno);
+    }
+}
+
+static void handle_delivery(sim_client_t *client, char *line, uint64_t now, uint64_t slow_ns)
+{
+    char *tag = strstr(line, MESSAGE_TAG);
+    unsigned long message_id = 0;
+    sent_message_t *message = NULL;
+    uint64_t latency = 0;
+
+    if (NULL == tag)
+    {
+        // Server notifications (joins, leaves)
+        return;
+    }
+
+    message_id = strtoul(tag + sizeof(MESSAGE_TAG) - 1, NULL, 10);
+    if (message_id >= messages_sent)
+    {
+        return;
+    }
+
+    message = &messages[message_id];
+    if (message->sender == client->index && !echo_mode)
+    {
+        // The servers echo our own message back to us, it is not a fan-out delivery
+        return;
+    }
+
+    latency = now - message->send_ns;
+    histogram_record(&delivery_latency, latency);
+    client->deliveries++;
+    total_deliveries++;
+    if (latency > slow_ns)
+    {
+        client->slow_deliveries++;
+    }
+
+    message->received++;
+    if (message->received == message->expected)
+    {
+        // Every other client got the message
+        histogram_record(&fanout_latency, latency);
+        fanouts_completed++;
+    }
+}
+
+static void handle_readable(int epoll_fd, sim_client_t *client, uint64_t slow_ns)
+{
+    ssize_t bytes_recv = 0;
+    uint64_t now = 0;
+    char *line = NULL;
+    char *end = NULL;
+
+    bytes_recv = recv(client->fd, client->buffer + client->buffered, RECV_BUFFER_SIZE - 1 - client->buffered, 0);
+    if (0 >= bytes_recv)
+    {
+        if (-1 == bytes_recv && (EAGAIN == errno || EWOULDBLOCK == errno))
+        {
+            return;
+        }
+        close_client(epoll_fd, client);
+        return;
+    }
+    now = now_ns();
+    client->buffered += bytes_recv;
+    client->buffer[client->buffered] = '\0';
+
+    if (STATE_WAITING_BANNER == client->state)
+    {
+        if (NULL == strstr(client->buffer, WELCOME_BANNER))
+        {
+            return;
+        }
+
+        // Completing the handshake by sending our name. Accepted already, so a failed send is only rejected.
+        accepted_clients++;
+        client->buffered = 0;
+        client->state = STATE_WAITING_JOIN;
+        char name_line[sizeof(client->name) + 1] = {0};
+        int length = snprintf(name_line, sizeof(name_line), "%s\n", client->name);
+        if (length != send(client->fd, name_line, length, MSG_NOSIGNAL))
+        {
+            close_client(epoll_fd, client);
+        }
+        return;
+    }
+
+    // Handling every complete line, keeping the partial tail for the next read
+    line = client->buffer;
+    while (NULL != (end = memchr(line, '\n', client->buffer + client->buffered - line)))
+    {
+        *end = '\0';
+        if (STATE_WAITING_JOIN == client->state)
+        {
+            if (NULL != strstr(line, client->join_tag))
+            {
+                // The server announced our join, we are part of the room now
+                client->state = STATE_READY;
+                ready_clients++;
+            }
+        }
+        else
+        {
+            handle_delivery(client, line, now, slow_ns);
+        }
+        line = end + 1;
+    }
+
+    client->buffered -= line - client->buffer;
+    memmove(client->buffer, line, client->buffered);
+    if (RECV_BUFFER_SIZE - 1 == client->buffered)
+    {
+        // A line longer than the buffer, can't be ours
+        client->buffered = 0;
+    }
+}
+
+static void handle_event(int epoll_fd, struct epoll_event *event, uint64_t slow_ns)
+{
+    sim_client_t *client = event->data.ptr;
+    struct epoll_event modified = {0};
+
+    if (STATE_CONNECTING == client->state && (event->events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+    {
+        int error = 0;
+        socklen_t error_size = sizeof(error);
+
+        getsockopt(client->fd, SOL_SOCKET, SO_ERROR, &error, &error_size);
+        if (0 != error)
+        {
+            close_client(epoll_fd, client);
+            return;
+        }
+
+        // Connected, only interested in reads from now on
+        client->state = STATE_WAITING_BANNER;
+        if (echo_mode)
+        {
+            // Echo servers have no banner, the client can send right away
+            client->state = STATE_READY;
+            ready_clients++;
+            accepted_clients++;
+        }
+        modified.events = EPOLLIN;
+        modified.data.ptr = client;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &modified);
+    }
+
+    if (event->events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+    {
+        handle_readable(epoll_fd, client, slow_ns);
+    }
+}
+
+static void send_message(int epoll_fd, sim_client_t *client, int message_size)
+{
+    char message[MAX_MESSAGE_SIZE] = {0};
+    sent_message_t *sent = NULL;
+    int length = 0;
+
+    if (messages_sent == messages_capacity)
+    {
+        messages_capacity = 0 == messages_capacity ? 1024 : messages_capacity * 2;
+        messages = realloc(messages, messages_capacity * sizeof(*messages));
+        if (NULL == messages)
+        {
+            perror("realloc failed");
+            exit(errno);
+        }
+    }
+
+    sent = &messages[messages_sent];
+    sent->sender = client->index;
+    sent->expected = echo_mode ? 1 : ready_clients - 1;
+    sent->received = 0;
+    sent->send_ns = now_ns();
+
+    // "LG <id>" padded up to the requested size
+    length = snprintf(message, sizeof(message), "%s%zu ", MESSAGE_TAG, messages_sent);
+    while (length < message_size - 1)
+    {
+        message[length++] = 'x';
+    }
+    message[length++] = '\n';
+
+    if (length != send(client->fd, message, length, MSG_NOSIGNAL))
+    {
+        close_client(epoll_fd, client);
+        return;
+    }
+    messages_sent++;
+}
+
+static void raise_fd_limit(int clients)
+{
+    struct rlimit limit = {0};
+
+    if (0 != getrlimit(RLIMIT_NOFILE, &limit))
+    {
+        return;
+    }
+    if (limit.rlim_cur < (rlim_t)clients + 16)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+static void print_report(sim_client_t *clients, int client_count, double elapsed, bool csv)
+{
+    int slow_receivers = 0;
+    uint64_t incomplete = 0;
+
+    for(int i=0; i < client_count; i++)
+    {
+        if (0 < clients[i].slow_deliveries)
+        {
+            slow_receivers++;
+        }
+    }
+    for(size_t i=0; i < messages_sent; i++)
+    {
+        if (0 < messages[i].expected && messages[i].received < messages[i].expected)
+        {
+            incomplete++;
+        }
+    }
+
+    if (csv)
+    {
+        printf("clients,ready,rejected,dropped,sent,delivered,delivered_per_sec,"
+               "fanout_p50_ms,fanout_p99_ms,fanout_max_ms,delivery_p50_ms,delivery_p99_ms,"
+               "incomplete,slow_receivers\n");
+        printf("%d,%d,%d,%d,%zu,%lu,%.1f,%.3f,%.3f,%.3f,%.3f,%.3f,%lu,%d\n",
+               client_count, ready_clients, rejected_clients, dropped_clients, messages_sent, total_deliveries,
+               (double)total_deliveries / elapsed,
+               histogram_percentile_ms(&fanout_latency, 0.5), histogram_percentile_ms(&fanout_latency, 0.99),
+               (double)fanout_latency.max / 1e6,
+               histogram_percentile_ms(&delivery_latency, 0.5), histogram_percentile_ms(&delivery_latency, 0.99),
+               incomplete, slow_receivers);
+        return;
+    }
+
+    printf("\nClients: %d joined, %d rejected, %d dropped\n", ready_clients, rejected_clients, dropped_clients);
+    printf("Messages: %zu sent, %lu fan-outs completed, %lu incomplete\n", messages_sent, fanouts_completed, incomplete);
+    printf("Deliveries: %lu (%.1f msgs/sec)\n", total_deliveries, (double)total_deliveries / elapsed);
+    printf("%s latency (ms):  p50 %.3f  p90 %.3f  p99 %.3f  p99.9 %.3f  max %.3f\n",
+           echo_mode ? "Round trip" : "Fan-out", histogram_percentile_ms(&fanout_latency, 0.5),
+           histogram_percentile_ms(&fanout_latency, 0.9),
+           histogram_percentile_ms(&fanout_latency, 0.99), histogram_percentile_ms(&fanout_latency, 0.999),
+           (double)fanout_latency.max / 1e6);
+    printf("Delivery latency (ms): p50 %.3f  p90 %.3f  p99 %.3f  p99.9 %.3f  max %.3f\n",
+           histogram_percentile_ms(&delivery_latency, 0.5), histogram_percentile_ms(&delivery_latency, 0.9),
+           histogram_percentile_ms(&delivery_latency, 0.99), histogram_percentile_ms(&delivery_latency, 0.999),
+           (double)delivery_latency.max / 1e6);
+    printf("Slow receivers: %d\n", slow_receivers);
+}
+
+int main(int argc, char *argv[])
+{
+    struct sockaddr_in server_addresses[MAX_SERVERS] = {0};
+    struct epoll_event events[MAX_EVENTS];
+    sim_client_t *clients = NULL;
+    char *ip = DEFAULT_IP;
+    char *ports = NULL;
+    int server_count = 0;
+    int client_count = DEFAULT_CLIENTS;
+    int rate = DEFAULT_RATE;
+    int duration = DEFAULT_DURATION;
+    int message_size = 32;
+    uint64_t slow_ns = DEFAULT_SLOW_MS * 1000000ull;
+    bool csv = false;
+    int option = 0;
+    int epoll_fd = 0;
+    int inflight = DEFAULT_INFLIGHT;
+    int next_connection = 0;
+    int progress = 0;
+    int next_sender = 0;
+    uint64_t start = 0;
+    uint64_t deadline = 0;
+    uint64_t send_start = 0;
+    uint64_t now = 0;
+
+    while (-1 != (option = getopt(argc, argv, "h:p:c:r:d:s:l:i:eC")))
+    {
+        switch (option)
+        {
+        case 'h': ip = optarg; break;
+        case 'p': ports = optarg; break;
+        case 'c': client_count = atoi(optarg); break;
+        case 'r': rate = atoi(optarg); break;
+        case 'd': duration = atoi(optarg); break;
+        case 's': message_size = atoi(optarg); break;
+        case 'l': slow_ns = strtoull(optarg, NULL, 10) * 1000000ull; break;
+        case 'i': inflight = atoi(optarg); break;
+        case 'e': echo_mode = true; break;
+        case 'C': csv = true; break;
+        default:
+            fprintf(stderr, USAGE, argv[0]);
+            return -1;
+        }
+    }
+    // Clients are spread round-robin over the servers
+    for (char *port = NULL == ports ? NULL : strtok(ports, ","); NULL != port && MAX_SERVERS > server_count;
+         port = strtok(NULL, ","))
+    {
+        server_addresses[server_count].sin_family = AF_INET;
+        server_addresses[server_count].sin_port = htons(atoi(port));
+        if (1 != inet_pton(AF_INET, ip, &server_addresses[server_count].sin_addr))
+        {
+            perror("inet_pton failed");
+            exit(errno);
+        }
+        if (0 >= atoi(port))
+        {
+            server_count = 0;
+            break;
+        }
+        server_count++;
+    }
+    if (NULL == ports)
+    {
+        server_addresses[0].sin_family = AF_INET;
+        server_addresses[0].sin_port = htons(DEFAULT_PORT);
+        inet_pton(AF_INET, ip, &server_addresses[0].sin_addr);
+        server_count = 1;
+    }
+
+    if (0 >= server_count || 0 >= client_count || 0 >= rate || 0 >= duration || 0 >= inflight)
+    {
+        fprintf(stderr, USAGE, argv[0]);
+        return -1;
+    }
+    if (MAX_MESSAGE_SIZE - 1 < message_size)
+    {
+        message_size = MAX_MESSAGE_SIZE - 1;
+    }
+
+    raise_fd_limit(client_count);
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (-1 == epoll_fd)
+    {
+        perror("epoll_create1 failed");
+        exit(errno);
+    }
+
+    clients = calloc(client_count, sizeof(*clients));
+    if (NULL == clients)
+    {
+        perror("calloc failed");
+        exit(errno);
+    }
+
+    for(int i=0; i < client_count; i++)
+    {
+        clients[i].index = i;
+        clients[i].state = STATE_CLOSED;
+        snprintf(clients[i].name, sizeof(clients[i].name), NAME_FORMAT, i);
+        snprintf(clients[i].join_tag, sizeof(clients[i].join_tag), "%s%s", clients[i].name, RESET);
+        clients[i].buffer = malloc(RECV_BUFFER_SIZE);
+        if (NULL == clients[i].buffer)
+        {
+            perror("malloc failed");
+            exit(errno);
+        }
+    }
+
+    // Opening the connections with a limited amount of handshakes in flight,
+    // so the listen backlog doesn't overflow (and the kernel doesn't back off for seconds)
+    fprintf(stderr, "Connecting %d clients to %d server(s) on %s...\n", client_count, server_count, ip);
+    start = now_ns();
+    deadline = start + HANDSHAKE_TIMEOUT * 1000000000ull;
+    while (ready_clients + rejected_clients < client_count && now_ns() < deadline)
+    {
+        while (next_connection < client_count && next_connection - accepted_clients < inflight)
+        {
+            start_connection(epoll_fd, &clients[next_connection], &server_addresses[next_connection % server_count]);
+            next_connection++;
+        }
+
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, 10);
+        for(int i=0; i < ready; i++)
+        {
+            handle_event(epoll_fd, &events[i], slow_ns);
+        }
+
+        if (progress != ready_clients + rejected_clients)
+        {
+            progress = ready_clients + rejected_clients;
+            deadline = now_ns() + HANDSHAKE_TIMEOUT * 1000000000ull;
+        }
+    }
+    fprintf(stderr, "%d clients joined in %.3f sec (%d rejected)\n",
+            ready_clients, (double)(now_ns() - start) / 1e9, rejected_clients);
+    if (echo_mode && 1 > ready_clients)
+    {
+        fprintf(stderr, "Error: no client connected\n");
+        return -2;
+    }
+    if (!echo_mode && 2 > ready_clients)
+    {
+        fprintf(stderr, "Error: a fan-out needs at least 2 clients in the room\n");
+        return -2;
+    }
+
+    // Sending at a fixed rate, round-robin over the joined clients
+    send_start = now_ns();
+    deadline = send_start + (uint64_t)duration * 1000000000ull;
+    now = send_start;
+    while (now < deadline + DEFAULT_DRAIN * 1000000000ull)
+    {
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, 1);
+        for(int i=0; i < ready; i++)
+        {
+            handle_event(epoll_fd, &events[i], slow_ns);
+        }
+
+        now = now_ns();
+        if (now < deadline)
+        {
+            size_t due = (size_t)((double)(now - send_start) * rate / 1e9);
+            for (int attempts = 0; messages_sent < due && attempts < client_count; attempts++)
+            {
+                sim_client_t *client = &clients[next_sender];
+                next_sender = (next_sender + 1) % client_count;
+                if (STATE_READY == client->state)
+                {
+                    send_message(epoll_fd, client, message_size);
+                    attempts = 0;
+                }
+            }
+        }
+    }
+
+    print_report(clients, client_count, (double)duration, csv);
+
+    for(int i=0; i < client_count; i++)
+    {
+        if (STATE_CLOSED != clients[i].state)
+        {
+            close(clients[i].fd);
+        }
+        free(clients[i].buffer);
+    }
+    free(clients);
+    free(messages);
+    close(epoll_fd);
+    return 0;
+}
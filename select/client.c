@@ -15,24 +15,22 @@
 #include <poll.h>
 
 #include "common.h"
+#include "renderer.h"
 
 #define SERVER_IP  ("127.0.0.1")
 
 #define USAGE       ("%s <name>\n")
 #define ERASE_LINE  ("\33[2K\r")
+#define PROMPT      ("Message: ")
+#define READ_SIZE   (1024) // pasted text is read at once
 
 char input_buffer[MAX_MESSAGE_SIZE + 1] = {0};
 int input_index = 0;
+renderer_t renderer;
 
 void print_buffer()
 {
-    int i=0;
-    printf("Message: ");
-
-    for (; i < input_index; i++)
-    {
-        printf("%c", input_buffer[i]);
-    }
+    renderer_line(&renderer, PROMPT, input_buffer, input_index);
 }
 
 void reset_terminal()
@@ -110,11 +108,8 @@ int setup_connection()
     return socket_fd;
 }
 
-void handle_character_input(int socket_fd)
+void handle_character(int socket_fd, char character)
 {
-    unsigned character = 0;
-
-    character = getchar();
     switch(character)
     {
     case 127: // backspace
@@ -136,6 +131,7 @@ void handle_character_input(int socket_fd)
         input_buffer[input_index++] = character;
         if (-1 == send(socket_fd, input_buffer, input_index, 0))
         {
+            renderer_flush(&renderer, true);
             printf(ERASE_LINE);
             perror("send failed");
             exit(errno);
@@ -150,8 +146,26 @@ void handle_character_input(int socket_fd)
         }
         input_buffer[input_index++] = character;
     }
+}
+
+void handle_character_input(int socket_fd)
+{
+    char characters[READ_SIZE] = {0};
+    ssize_t bytes_read = 0;
 
-    printf(ERASE_LINE);
+    bytes_read = read(STDIN_FILENO, characters, sizeof(characters));
+    if (0 >= bytes_read)
+    {
+        renderer_flush(&renderer, true);
+        printf(ERASE_LINE);
+        perror("read failed");
+        exit(errno);
+    }
+
+    for(ssize_t i=0; i < bytes_read; i++)
+    {
+        handle_character(socket_fd, characters[i]);
+    }
     print_buffer();
 }
 
@@ -164,10 +178,12 @@ void handle_message(int socket_fd)
     switch(bytes_recv)
     {
         case -1:
+            renderer_flush(&renderer, true);
             printf(ERASE_LINE);
             perror("recv failed");
             exit(errno);
         case 0:
+            renderer_flush(&renderer, true);
             printf(ERASE_LINE);
             fprintf(stderr, "Connection closed :(\n");
             exit(errno);
@@ -175,8 +191,7 @@ void handle_message(int socket_fd)
             break;
     }
 
-    printf(ERASE_LINE);
-    printf("%s", buffer);
+    renderer_print(&renderer, buffer, bytes_recv);
     print_buffer();
 }
 
@@ -191,7 +206,8 @@ void handle_client_connection(int socket_fd)
     pollfds[1].fd = socket_fd;
     pollfds[1].events = POLLIN;
 
-    poll_result = poll(pollfds, sizeof(pollfds) / sizeof(*pollfds), 0);
+    // Waiting for input, or for the next frame
+    poll_result = poll(pollfds, sizeof(pollfds) / sizeof(*pollfds), renderer_timeout(&renderer));
     switch(poll_result)
     {
         case -1:
@@ -200,7 +216,8 @@ void handle_client_connection(int socket_fd)
             perror("poll failed");
             exit(errno);
         case 0:
-            // timeout occurred, just exit
+            // timeout occurred, time for a frame
+            renderer_flush(&renderer, false);
             return;
         default:
             break;
@@ -227,6 +244,8 @@ void handle_client_connection(int socket_fd)
         // message from socket
         handle_message(socket_fd);
     }
+
+    renderer_flush(&renderer, false);
 }
 
 int main(int argc, char *argv[])
@@ -247,11 +266,13 @@ int main(int argc, char *argv[])
     }
 
     configure_terminal();
+    renderer_init(&renderer);
 
     socket_fd = setup_connection();
 
     // Sends the server the name
     printf("%s", argv[1]);
+    renderer_invalidate(&renderer);
     if (-1 == send(socket_fd, argv[1], strlen(argv[1])+1, 0))
     {
         perror("Failed to send name");
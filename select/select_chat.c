@@ -9,33 +9,83 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
+#include <getopt.h>
 
 #include "common.h"
 #include "colors.h"
+#include "metrics.h"
+#include "profiler.h"
+#include "framing.h"
+#include "name_index.h"
+#include "net.h"
+#include "handoff.h"
+#include "overload.h"
 
 #define NO_SOCKET           (-1)
-#define SERVER_INTERFACE    ("0.0.0.0")
 #define MAXIMUM_CLIENTS     (sizeof(colors) / sizeof(*colors)) // = 6
 
 #define WELCOME_BANNER      ("Hello! Please enter your name: ")
-
-int setup_server();
+#define NAME_TAKEN_BANNER   ("is taken, please enter another name: ")
+#define PRIVATE_COMMAND     ("/msg ")
+#define USAGE               ("Usage: %s [-a <admin port | unix:path>] [-p] [-t <trace.json>] [-P <profile>] [-B <address>]\n" \
+                             "          [-u <upgrade socket>] [-L <SLO>]\n")
 
 typedef struct client_s {
     int client_fd;
     char name[MAX_NAME_SIZE + 1];
+    frame_buffer_t input;
 } client_t;
 
-void send_to_all_clients(client_t *clients, char *message, size_t length)
+// What a client's connection carries over to the next server process. The layout word comes first, so a
+// server built with another client_state_t drops the clients instead of misreading them. Bump it on changes.
+#define CLIENT_STATE_LAYOUT (0x43530001)
+
+typedef struct client_state_s {
+    uint32_t layout;                    // CLIENT_STATE_LAYOUT
+    uint32_t slot;                      // keeps the client's color
+    char name[MAX_NAME_SIZE + 1];       // empty while the client is still picking one
+    char input[FRAME_BUFFER_SIZE];      // the unhandled part of its input, only the used bytes are sent
+} client_state_t;
+
+// Name -> client slot, for uniqueness and direct messages
+name_index_t client_names = {0};
+
+// The loop's latency SLO, new clients are shed while it's breached
+overload_t overload = {0};
+
+void disconnect_client(client_t *clients, int client_index);
+
+bool send_to_client(client_t *clients, int client_index, char *message, size_t length)
 {
     int bytes_sent = 0;
-    int bytes_to_send = 0;
-    char send_message[MAX_NAME_SIZE + MAX_MESSAGE_SIZE + 10] = {0}; // +10 for metadata
+
+    errno = 0;
+    bytes_sent = send(clients[client_index].client_fd, message, length, MSG_NOSIGNAL);
+    if (ECONNRESET == errno || ETIMEDOUT == errno || EPIPE == errno)
+    {
+        // Client closed the connection
+        disconnect_client(clients, client_index);
+        return false;
+    }
+    else if (bytes_sent != length)
+    {
+        perror("Failed to send message");
+        exit(bytes_sent);
+    }
+
+    metrics_message_out(bytes_sent);
+    return true;
+}
+
+void send_to_all_clients(client_t *clients, char *message, size_t length)
+{
+    size_t recipients = 0;
 
     printf("%s", message);
     for(int i=0; i < MAXIMUM_CLIENTS; i++)
@@ -45,77 +95,128 @@ void send_to_all_clients(client_t *clients, char *message, size_t length)
             continue;
         }
 
-        errno = 0;
-        bytes_sent = send(clients[i].client_fd, message, length, 0);
-        if (ECONNRESET == errno || ETIMEDOUT == errno)
+        if (send_to_client(clients, i, message, length))
         {
-            // Client closed the connection
-
-            // Constructing a message to notify clients a client has disconnected.
-            bytes_to_send = snprintf(send_message, sizeof(send_message), "%sServer:\tClient %s%s%s%s %swas disconnected.%s\n",
-                                     BOLD_WHITE, RESET, colors[i], clients[i].name, RESET, BOLD_WHITE, RESET);
-
-            close(clients[i].client_fd);
-            clients[i].client_fd = NO_SOCKET;
-            memset(clients[i].name, 0, sizeof(clients[i].name));
-            send_to_all_clients(clients, send_message, bytes_to_send);
-        }
-        else if (bytes_sent != length)
-        {
-            perror("Failed to send message");
-            exit(bytes_sent);
+            recipients++;
         }
     }
+
+    metrics_fanout(recipients);
 }
 
-void get_client_name(client_t *clients, int client_index)
+void get_client_name(client_t *clients, int client_index, char *name)
 {
-    int bytes_recv = 0;
+    int bytes_to_send = 0;
     char send_message[MAX_NAME_SIZE + MAX_MESSAGE_SIZE + 10] = {0}; // +10 for metadata
 
-    // Receive client name
-    bytes_recv = recv(clients[client_index].client_fd, clients[client_index].name, MAX_NAME_SIZE, 0);
-    if (-1 == bytes_recv && ECONNRESET != errno && ETIMEDOUT != errno)
+    // Names are unique (direct messages are routed by them), spaces would break /msg
+    name[strcspn(name, " ")] = '\0';
+    if (MAX_NAME_SIZE < strlen(name))
     {
-        perror("recv failed");
-        exit(-1);
+        name[MAX_NAME_SIZE] = '\0';
     }
-
-    if (0 == bytes_recv || (-1 == bytes_recv && (ECONNRESET == errno || ETIMEDOUT == errno)))
+    if ('\0' == name[0] || !name_index_insert(&client_names, name, client_index))
     {
-        // Client disconnected
-        close(clients[client_index].client_fd);
-        clients[client_index].client_fd = NO_SOCKET;
-        memset(clients[client_index].name, 0, sizeof(clients[client_index].name));
+        // Asking for another name, the client stays nameless until then
+        bytes_to_send = snprintf(send_message, sizeof(send_message), "%sServer:\tName '%s' %s%s",
+                                 BOLD_WHITE, name, NAME_TAKEN_BANNER, RESET);
+        send_to_client(clients, client_index, send_message, bytes_to_send);
         return;
     }
 
-    // null-terminating the name
-    clients[client_index].name[bytes_recv-1] = '\0';
+    // Copying the name, it is already null-terminated and truncated to MAX_NAME_SIZE
+    strncpy(clients[client_index].name, name, MAX_NAME_SIZE);
 
     // Notifying the chat room a new client has connected
-    bytes_recv = snprintf(send_message, sizeof(send_message), "%sServer:\tClient %s%s%s%s %shas connected.%s\n",
-                          BOLD_WHITE, RESET, colors[client_index], clients[client_index].name, RESET, BOLD_WHITE, RESET);
-    send_to_all_clients(clients, send_message, bytes_recv);
+    bytes_to_send = snprintf(send_message, sizeof(send_message), "%sServer:\tClient %s%s%s%s %shas connected.%s\n",
+                             BOLD_WHITE, RESET, colors[client_index], clients[client_index].name, RESET, BOLD_WHITE, RESET);
+    send_to_all_clients(clients, send_message, bytes_to_send);
 }
 
-void handle_client(client_t *clients, int client_index)
+void disconnect_client(client_t *clients, int client_index)
 {
-    int bytes_recv = 0;
     int bytes_to_send = 0;
-    char recv_message[MAX_MESSAGE_SIZE] = {0};
+    bool named = '\0' != clients[client_index].name[0];
     char send_message[MAX_NAME_SIZE + MAX_MESSAGE_SIZE + 10] = {0}; // +10 for metadata
 
-    // Checks if the client has entered a name already
-    if ('\0' == clients[client_index].name[0])
+    // Constructing a message to notify clients a client has disconnected.
+    bytes_to_send = snprintf(send_message, sizeof(send_message), "%sServer:\tClient %s%s%s%s %swas disconnected.%s\n",
+                             BOLD_WHITE, RESET, colors[client_index], clients[client_index].name, RESET, BOLD_WHITE, RESET);
+
+    // Resetting client struct
+    if (named)
+    {
+        name_index_remove(&client_names, clients[client_index].name);
+    }
+    close(clients[client_index].client_fd);
+    clients[client_index].client_fd = NO_SOCKET;
+    memset(clients[client_index].name, 0, sizeof(clients[client_index].name));
+    metrics_disconnected();
+
+    // A client that didn't enter a name never joined the chat room
+    if (named)
+    {
+        send_to_all_clients(clients, send_message, bytes_to_send);
+    }
+}
+
+void send_private_message(client_t *clients, int client_index, char *command)
+{
+    int bytes_to_send = 0;
+    int recipient = 0;
+    char *text = command + strcspn(command, " ");
+    char send_message[MAX_NAME_SIZE * 2 + MAX_MESSAGE_SIZE + 20] = {0}; // +20 for metadata
+
+    // "/msg <name> <text>", splitting the name from the text
+    if ('\0' != *text)
+    {
+        *text++ = '\0';
+    }
+
+    recipient = name_index_find(&client_names, command);
+    if (NAME_INDEX_NOT_FOUND == recipient || '\0' == *text)
     {
-        // A client has no name
-        get_client_name(clients, client_index);
+        bytes_to_send = snprintf(send_message, sizeof(send_message), "%sServer:\tNo client named '%s'%s\n",
+                                 BOLD_WHITE, command, RESET);
+        if ('\0' == *text)
+        {
+            bytes_to_send = snprintf(send_message, sizeof(send_message), "%sServer:\tUsage: %s<name> <text>%s\n",
+                                     BOLD_WHITE, PRIVATE_COMMAND, RESET);
+        }
+        send_to_client(clients, client_index, send_message, bytes_to_send);
         return;
     }
 
-    // Receive client message
-    bytes_recv = recv(clients[client_index].client_fd, recv_message, sizeof(recv_message), 0);
+    bytes_to_send = snprintf(send_message, sizeof(send_message), "%s%s -> %s:\t%.*s%s\n",
+                             colors[client_index], clients[client_index].name, clients[recipient].name,
+                             MAX_MESSAGE_SIZE, text, RESET);
+    if (sizeof(send_message) <= bytes_to_send)
+    {
+        bytes_to_send = sizeof(send_message) - 1;
+    }
+
+    metrics_fanout(1);
+    if (send_to_client(clients, recipient, send_message, bytes_to_send) && recipient != client_index)
+    {
+        // The sender sees its own direct message too
+        send_to_client(clients, client_index, send_message, bytes_to_send);
+    }
+}
+
+void handle_client(client_t *clients, int client_index)
+{
+    int bytes_recv = 0;
+    int bytes_to_send = 0;
+    size_t offset = 0;
+    char *message = NULL;
+    frame_buffer_t *input = &clients[client_index].input;
+    uint64_t profile_start = 0;
+    char send_message[MAX_NAME_SIZE + MAX_MESSAGE_SIZE + 10] = {0}; // +10 for metadata
+
+    // Receive whatever the client sent, it may hold several messages or only a part of one
+    profile_start = profiler_begin();
+    bytes_recv = frame_recv(clients[client_index].client_fd, input);
+    profiler_end(PROFILE_RECV, profile_start);
     if (-1 == bytes_recv && ECONNRESET != errno && ETIMEDOUT != errno)
     {
         perror("recv failed");
@@ -126,36 +227,79 @@ void handle_client(client_t *clients, int client_index)
     if (0 == bytes_recv || (-1 == bytes_recv && (ECONNRESET == errno || ETIMEDOUT == errno)))
     {
         // Connection probably closed...
-        // Constructing a message to notify clients a client has disconnected.
-        bytes_to_send = snprintf(send_message, sizeof(send_message), "%sServer:\tClient %s%s%s%s %swas disconnected.%s\n",
-                              BOLD_WHITE, RESET, colors[client_index], clients[client_index].name, RESET, BOLD_WHITE, RESET);
-        // Resetting client struct
-        close(clients[client_index].client_fd);
-        clients[client_index].client_fd = NO_SOCKET;
-        memset(clients[client_index].name, 0, sizeof(clients[client_index].name));
+        disconnect_client(clients, client_index);
+        return;
     }
-    else
+    input->length += bytes_recv;
+    net_received(clients[client_index].client_fd);
+
+    // Handling every complete message, the partial tail stays in the buffer for the next read
+    while (NULL != (message = frame_next(input, &offset)))
     {
+        if ('\0' == message[0])
+        {
+            // Empty line
+            continue;
+        }
+        metrics_message_in(strlen(message));
+
+        // Checks if the client has entered a name already
+        if ('\0' == clients[client_index].name[0])
+        {
+            // The first message of a client is its name
+            get_client_name(clients, client_index, message);
+            if (NO_SOCKET == clients[client_index].client_fd)
+            {
+                return;
+            }
+            continue;
+        }
+
+        if (0 == strncmp(message, PRIVATE_COMMAND, sizeof(PRIVATE_COMMAND) - 1))
+        {
+            // A direct message, only the recipient (and the sender) get it
+            send_private_message(clients, client_index, message + sizeof(PRIVATE_COMMAND) - 1);
+            if (NO_SOCKET == clients[client_index].client_fd)
+            {
+                return;
+            }
+            continue;
+        }
+
         // A message was received. Construct a message to deliver to the other clients.
-        recv_message[bytes_recv-1] = '\0'; // replacing new-line with null-terminator
-        // Constructing the message to send to the users
-        bytes_to_send = snprintf(send_message, sizeof(send_message), "%s%s:\t%s%s\n",
-                              colors[client_index], clients[client_index].name, recv_message, RESET);
+        profile_start = profiler_begin();
+        bytes_to_send = snprintf(send_message, sizeof(send_message), "%s%s:\t%.*s%s\n",
+                                 colors[client_index], clients[client_index].name, MAX_MESSAGE_SIZE, message, RESET);
+        profiler_end(PROFILE_FORMAT, profile_start);
 
-    }
+        // Checks the call to snprintf was successful
+        if (0 > bytes_to_send)
+        {
+            perror("snprintf failed");
+            exit(-1);
+        }
+        if (sizeof(send_message) <= bytes_to_send)
+        {
+            // Truncated, sending what fits
+            bytes_to_send = sizeof(send_message) - 1;
+        }
 
-    // Checks the call to snprintf was successful
-    if (0 > bytes_to_send)
-    {
-        perror("snprintf failed");
-        exit(-1);
+        // Sending the message to all clients...
+        profile_start = profiler_begin();
+        send_to_all_clients(clients, send_message, bytes_to_send);
+        profiler_end(PROFILE_FANOUT, profile_start);
+
+        if (NO_SOCKET == clients[client_index].client_fd)
+        {
+            // The client was disconnected while sending to it
+            return;
+        }
     }
 
-    // Sending the message to all clients...
-    send_to_all_clients(clients, send_message, bytes_to_send);
+    frame_compact(input, offset);
 }
 
-int handle_select(int server_fd, client_t *clients, fd_set *read_fds)
+int handle_select(int server_fd, int upgrade_fd, client_t *clients, fd_set *read_fds)
 {
     int maximum_fd = server_fd;
 
@@ -164,6 +308,14 @@ int handle_select(int server_fd, client_t *clients, fd_set *read_fds)
 
     // Setting the bits of the relevant fds
     FD_SET(server_fd, read_fds);
+    if (NO_SOCKET != upgrade_fd)
+    {
+        FD_SET(upgrade_fd, read_fds);
+        if (maximum_fd < upgrade_fd)
+        {
+            maximum_fd = upgrade_fd;
+        }
+    }
     for(int i=0; i < MAXIMUM_CLIENTS; i++)
     {
         if (NO_SOCKET != clients[i].client_fd)
@@ -196,6 +348,14 @@ void handle_new_client(int server_fd, client_t *clients) {
         perror("accept failed");
         return;
     }
+    if (!overload_admit(&overload))
+    {
+        overload_shed(&overload, client_fd);
+        return;
+    }
+    metrics_accepted();
+    net_accepted(client_fd);
+
     for (int i = 0; i < MAXIMUM_CLIENTS && !connected; i++) {
         if (NO_SOCKET != clients[i].client_fd) {
             continue;
@@ -203,11 +363,13 @@ void handle_new_client(int server_fd, client_t *clients) {
 
         // Found an empty client slot
         clients[i].client_fd = client_fd;
+        frame_reset(&clients[i].input);
         connected = true;
     }
 
     if (!connected) {
         close(client_fd);
+        metrics_disconnected();
     }
     else
     {
@@ -223,97 +385,260 @@ void handle_new_client(int server_fd, client_t *clients) {
 
 void handle_messages(client_t *clients, fd_set *read_fds)
 {
+    // Every ready client waited since select returned, the ones handled later queued behind the others
+    uint64_t ready = metrics_now_ns();
+
     for(int i=0; i < MAXIMUM_CLIENTS; i++)
     {
         if (NO_SOCKET != clients[i].client_fd && FD_ISSET(clients[i].client_fd, read_fds))
         {
+            uint64_t start = metrics_now_ns();
             handle_client(clients, i);
+            metrics_handling_time(start);
+            overload_observe(&overload, metrics_now_ns() - ready);
         }
     }
 }
 
-int main()
+// Hot upgrade: the new server process connected to the upgrade socket. It gets the listener, the admin
+// listener and every client with its name and unhandled input, and this process exits once it took them.
+// Connections keep queueing in the listener's backlog meanwhile.
+void hand_off(int upgrade_fd, int server_fd, int admin_fd, client_t *clients)
 {
-    int server_fd = 0;
+    static handoff_t handoff;
+    client_state_t state = {0};
+
+    handoff_accept(&handoff, upgrade_fd);
+    handoff_put(&handoff, HANDOFF_LISTENER, server_fd, NULL, 0);
+    if (NO_SOCKET != admin_fd)
+    {
+        handoff_put(&handoff, HANDOFF_ADMIN, admin_fd, NULL, 0);
+    }
+    for(int i=0; i < MAXIMUM_CLIENTS; i++)
+    {
+        if (NO_SOCKET == clients[i].client_fd)
+        {
+            continue;
+        }
+        state.layout = CLIENT_STATE_LAYOUT;
+        state.slot = i;
+        memcpy(state.name, clients[i].name, sizeof(state.name));
+        memcpy(state.input, clients[i].input.data, clients[i].input.length);
+        handoff_put(&handoff, HANDOFF_CLIENT, clients[i].client_fd, &state,
+                    offsetof(client_state_t, input) + clients[i].input.length);
+    }
+
+    if (!handoff_finish(&handoff))
+    {
+        printf("Upgrade failed, still serving\n");
+        return;
+    }
+    printf("Handed off %zu fds in %.3f ms, exiting\n", handoff.total, handoff_elapsed_ms(&handoff));
+    exit(0);
+}
+
+void restore_client(client_t *clients, int client_fd, client_state_t *state, size_t size)
+{
+    uint32_t slot = state->slot;
+
+    // The state comes from another process, it may be of another build: the layout, the size and the slot
+    // are checked before anything is copied
+    if (offsetof(client_state_t, input) > size ||
+        offsetof(client_state_t, input) + sizeof(state->input) < size ||
+        CLIENT_STATE_LAYOUT != state->layout)
+    {
+        fprintf(stderr, "Dropping a handed off client with an incompatible state\n");
+        close(client_fd);
+        return;
+    }
+    if (MAXIMUM_CLIENTS <= slot || NO_SOCKET != clients[slot].client_fd)
+    {
+        fprintf(stderr, "Dropping a handed off client with an invalid slot\n");
+        close(client_fd);
+        return;
+    }
+
+    clients[slot].client_fd = client_fd;
+    memcpy(clients[slot].name, state->name, sizeof(clients[slot].name));
+    clients[slot].name[MAX_NAME_SIZE] = '\0';
+    if ('\0' != clients[slot].name[0])
+    {
+        name_index_insert(&client_names, clients[slot].name, slot);
+    }
+    frame_reset(&clients[slot].input);
+    clients[slot].input.length = size - offsetof(client_state_t, input);
+    memcpy(clients[slot].input.data, state->input, clients[slot].input.length);
+    metrics_taken_over();
+}
+
+// Takes over the sockets and clients of the server running on the upgrade socket, if there is one
+void take_over(const char *upgrade_path, client_t *clients, int *server_fd, int *admin_fd)
+{
+    static handoff_t handoff;
+    union {
+        client_state_t client;
+        char bytes[HANDOFF_STATE_SIZE];
+    } state;
+    uint32_t kind = 0;
+    int fd = 0;
+    size_t size = 0;
+
+    if (!handoff_connect(&handoff, upgrade_path))
+    {
+        return;
+    }
+
+    while (handoff_get(&handoff, &kind, &fd, &state, &size))
+    {
+        switch (kind)
+        {
+        case HANDOFF_LISTENER:
+            *server_fd = fd;
+            break;
+        case HANDOFF_ADMIN:
+            *admin_fd = fd;
+            break;
+        case HANDOFF_CLIENT:
+            restore_client(clients, fd, &state.client, size);
+            break;
+        default:
+            close(fd);
+        }
+    }
+    handoff_done(&handoff);
+    printf("Took over %zu fds from the previous server in %.3f ms\n", handoff.total, handoff_elapsed_ms(&handoff));
+}
+
+int main(int argc, char *argv[])
+{
+    int server_fd = NO_SOCKET;
+    int admin_fd = NO_SOCKET;
+    int upgrade_fd = NO_SOCKET;
     int select_result = 0;
+    int option = 0;
+    bool profile = false;
+    char *trace_path = NULL;
+    char *socket_profile = NULL;
+    char *address = NULL;
+    char *admin_address = NULL;
+    char *upgrade_path = NULL;
+    uint64_t profile_start = 0;
     client_t clients[MAXIMUM_CLIENTS];
     fd_set read_fds;
 
+    metrics_init("select_chat");
+
+    while (-1 != (option = getopt(argc, argv, "a:pt:P:B:u:L:")))
+    {
+        switch (option)
+        {
+        case 'a':
+            // Optional admin listener, serving Prometheus metrics
+            admin_address = optarg;
+            break;
+        case 'p':
+            // Profile from startup (otherwise toggled with SIGUSR1)
+            profile = true;
+            break;
+        case 't':
+            trace_path = optarg;
+            break;
+        case 'P':
+            socket_profile = optarg;
+            break;
+        case 'B':
+            address = optarg;
+            break;
+        case 'u':
+            // Hot upgrades: take over from the server on this socket, and hand off to the next one
+            upgrade_path = optarg;
+            break;
+        case 'L':
+            overload_configure(&overload, optarg);
+            break;
+        default:
+            fprintf(stderr, USAGE, argv[0]);
+            fputs(NET_PROFILE_USAGE, stderr);
+            fputs(OVERLOAD_USAGE, stderr);
+            return -1;
+        }
+    }
+
     // Initializes clients
+    name_index_init(&client_names, MAXIMUM_CLIENTS);
     for(int i=0; i < MAXIMUM_CLIENTS; i++)
     {
         clients[i].client_fd = NO_SOCKET;
         memset(clients[i].name, 0, sizeof(clients[i].name));
     }
 
-    // Setup the server (socket, bind, listen)
-    server_fd = setup_server();
+    profiler_init(trace_path, profile);
+
+    net_configure(socket_profile, address);
+    if (NULL != upgrade_path)
+    {
+        take_over(upgrade_path, clients, &server_fd, &admin_fd);
+    }
+    if (NO_SOCKET == server_fd)
+    {
+        // Setup the server (socket, bind, listen)
+        server_fd = net_listen(SERVER_PORT);
+    }
+    if (NO_SOCKET == admin_fd && NULL != admin_address)
+    {
+        admin_fd = metrics_setup_admin(admin_address);
+    }
+    if (NO_SOCKET != admin_fd)
+    {
+        // Served off the chat loop, a slow scraper doesn't hold the clients
+        metrics_start_admin_thread(admin_fd);
+    }
+    if (NULL != upgrade_path)
+    {
+        upgrade_fd = handoff_listen(upgrade_path);
+    }
 
     while(true)
     {
-        select_result = handle_select(server_fd, clients, &read_fds);
+        profile_start = profiler_begin();
+        select_result = handle_select(server_fd, upgrade_fd, clients, &read_fds);
+        profiler_end_wait(profile_start, select_result);
         switch (select_result)
         {
         case -1:
+            if (EINTR == errno)
+            {
+                // Interrupted by a profiler signal
+                break;
+            }
             perror("select failed");
             exit(-1);
         case 0:
             // Timeout has occurred
             break;
         default:
+            metrics_queue_depth(select_result);
+            if (NO_SOCKET != upgrade_fd && FD_ISSET(upgrade_fd, &read_fds))
+            {
+                // A new server process is taking over, it doesn't return unless the upgrade failed
+                hand_off(upgrade_fd, server_fd, admin_fd, clients);
+                break;
+            }
+
             if (FD_ISSET(server_fd, &read_fds))
             {
                 // A new client is connecting
+                profile_start = profiler_begin();
                 handle_new_client(server_fd, clients);
+                profiler_end(PROFILE_NEW_CLIENT, profile_start);
             }
             else
             {
                 // One client or more sent a message
+                profile_start = profiler_begin();
                 handle_messages(clients, &read_fds);
+                profiler_end(PROFILE_MESSAGES, profile_start);
             }
         }
     }
 }
-
-
-int setup_server()
-{
-    struct sockaddr_in server_address = {0};
-    int server_fd = 0;
-
-    // Creates the server socket
-    server_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
-    if (-1 == server_fd) {
-        perror("Failed to create server socket");
-        exit(errno);
-    }
-
-    // Sets socket option SO_REUSEADDR, other processes will be able to listen on this port
-    // (enables quick restart of the server)
-    int enabled = 1;
-    if (0 != setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &enabled, sizeof(enabled)))
-    {
-        perror("Failed to set SO_REUSEADDR");
-        exit(errno);
-    }
-
-    // Construct the server's data struct
-    server_address.sin_family = AF_INET;
-    server_address.sin_addr.s_addr = inet_addr(SERVER_INTERFACE);
-    server_address.sin_port = htons(SERVER_PORT);
-
-    // Bind server socket to the network interface
-    if (0 != bind(server_fd, (struct sockaddr *)&server_address, sizeof(server_address))) {
-        perror("Failed to bind");
-        exit(errno);
-    }
-
-    // Listen for incoming clients
-    if (0 != listen(server_fd, 0)) {
-        perror("Failed to listen");
-        exit(errno);
-    }
-
-    printf("Listening for incoming connections...\n");
-    return server_fd;
-}
@@ -12,91 +12,593 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/epoll.h>
 #include <arpa/inet.h>
+#include <getopt.h>
 #include <pthread.h>
 
-#define SERVER_INTERFACE    ("0.0.0.0")
+#include "metrics.h"
+#include "scheduler.h"
+#include "net.h"
+#include "fiber.h"
+#include "affinity.h"
+#include "overload.h"
+#include "handoff.h"
+
 #define SERVER_PORT         (12345)
+#define NO_SOCKET           (-1)
 
 #define MAX_MESSAGE_SIZE    (256)
 
-int setup_server();
+#define MAX_EVENTS          (256)
+#define CONNECTION_BUDGET   (16)    // messages a connection echoes before yielding to the others
+#define DRAIN_INTERVAL      (100)   // ms between checking whether the clients left, after a hot upgrade
+
+#define USAGE               ("Usage: %s [-a <admin port | unix:path>] [-w <workers> | -g <carriers>] [-s <stack KB>]\n" \
+                             "          [-m <budget MB>] [-A <placement>] [-L <SLO>] [-u <path>] [-P <profile>] [-B <address>]\n" \
+                             "  -w  schedule the connections on a work-stealing pool (0 for a worker per CPU)\n" \
+                             "      instead of a thread per client\n" \
+                             "  -g  run every client on a green thread, over a few OS threads (0 for one per CPU)\n" \
+                             "  -s  stack size of a client's thread or green thread\n" \
+                             "  -m  memory of all the connections, new connections are closed beyond it\n" \
+                             "  -u  upgrade socket, take over the listeners of the server running there and hand them\n" \
+                             "      over to the next one, serving the clients until they leave\n")
 
 typedef struct client_s {
     int client_fd;
-    struct sockaddr_in client_address;
+    struct sockaddr_storage client_address;
 } client_t;
 
-void *handle_client(void *client_data)
+// A connection of the work-stealing mode. Its task reads and echoes when the socket is readable.
+typedef struct connection_s {
+    task_t task;                        // first, the task is the connection
+    client_t client;
+    int epoll_fd;
+    uint64_t ready_ns;                  // when the socket became readable, the queueing starts
+} connection_t;
+
+// Admission control: every connection reserves its memory (its stack and its structures) up front,
+// a connection that doesn't fit in the budget is closed right after accept.
+typedef struct memory_budget_s {
+    size_t limit;                       // bytes, 0 for no limit
+    size_t per_connection;              // bytes a connection reserves
+    size_t reserved;
+} memory_budget_t;
+
+scheduler_t scheduler;
+fiber_runtime_t runtime;
+memory_budget_t budget;
+overload_t overload;
+
+void setup_budget(size_t per_connection)
+{
+    budget.per_connection = per_connection;
+    if (0 == budget.limit)
+    {
+        printf("%.1fKB per connection\n", (double)per_connection / 1024);
+        return;
+    }
+    printf("%.1fKB per connection, a %zuMB budget admits %zu connections\n",
+           (double)per_connection / 1024, budget.limit / (1024 * 1024), budget.limit / per_connection);
+}
+
+// Reserves the connection's memory, false when the budget is spent (the caller closes it)
+bool admit_connection()
+{
+    if (0 == budget.limit)
+    {
+        return true;
+    }
+    if (__atomic_add_fetch(&budget.reserved, budget.per_connection, __ATOMIC_RELAXED) <= budget.limit)
+    {
+        return true;
+    }
+    __atomic_sub_fetch(&budget.reserved, budget.per_connection, __ATOMIC_RELAXED);
+    metrics_rejected();
+    return false;
+}
+
+void release_connection()
+{
+    if (0 != budget.limit)
+    {
+        __atomic_sub_fetch(&budget.reserved, budget.per_connection, __ATOMIC_RELAXED);
+    }
+}
+
+// Echoes a single message, returns false if the client can't be written to.
+// ready_ns is when the message was ready to be handled, its latency is checked against the SLO.
+bool echo_message(int client_fd, char *message, int bytes_recv, const char *client_name, uint64_t ready_ns)
 {
-    int bytes_recv = 0;
     int bytes_sent = 0;
-    char message[MAX_MESSAGE_SIZE] = {0};
-    char *client_ip = NULL;
-    int client_port = 0;
-    client_t *client = (client_t *)client_data;
+    int sent = 0;
+    uint64_t start = metrics_now_ns();
 
-    // First, register a cleanup function to release the client's allocated data.
-    // Eliminating the risk of a memory leak
-    pthread_cleanup_push(free, client);                           // will be called last
-    pthread_cleanup_push(close, (void *)client->client_fd); // will be called first
+    // A message was received, print it (without the new-line). A read may end in the middle of a message,
+    // so the message isn't modified.
+    metrics_message_in(bytes_recv);
+    net_received(client_fd);
+    printf("Echoing '%.*s' to %s...\n", '\n' == message[bytes_recv-1] ? bytes_recv - 1 : bytes_recv, message,
+           client_name);
 
-    // Print client information
-    client_ip = inet_ntoa(client->client_address.sin_addr);
-    client_port = ntohs(client->client_address.sin_port);
-    printf("A client connected from: %s:%d! handling thread: 0x%lx\n", client_ip, client_port, pthread_self());
+    // Echoing the message... A scheduled connection's socket is non-blocking, so a full send buffer waits here
+    // (a green thread waits on its carrier's reactor, a worker in poll)
+    while (sent < bytes_recv)
+    {
+        bytes_sent = fiber_send(client_fd, message + sent, bytes_recv - sent, MSG_NOSIGNAL);
+        if (0 >= bytes_sent)
+        {
+            perror("Failed to echo message");
+            return false;
+        }
+        sent += bytes_sent;
+    }
+    metrics_message_out(sent);
+    metrics_handling_time(start);
+    overload_observe(&overload, metrics_now_ns() - ready_ns);
+    return true;
+}
+
+// The client's blocking loop, the same for a thread per client and for a green thread per client
+void serve_client(client_t *client, const char *client_name)
+{
+    int bytes_recv = 0;
+    char message[MAX_MESSAGE_SIZE] = {0};
 
     while(true)
     {
-        // Receive client message
-        bytes_recv = recv(client->client_fd, message, sizeof(message), 0);
+        // Receive client message, blocking only the green thread when running on one
+        bytes_recv = fiber_recv(client->client_fd, message, sizeof(message), 0);
         if (-1 == bytes_recv)
         {
             perror("recv failed");
-            pthread_exit(NULL);
+            return;
         }
 
         if (0 == bytes_recv)
         {
             // Connection probably closed...
-            printf("client %s:%d disconnected.\n", client_ip, client_port);
-            break;
+            printf("client %s disconnected.\n", client_name);
+            return;
         }
 
-        // A message was received, print it.
-        message[bytes_recv-1] = '\0'; // replacing new-line with null-terminator
-        printf("Echoing '%s' to %s:%d...\n", message, client_ip, client_port);
-        message[bytes_recv-1] = '\n'; // replacing null-terminator with new-line
-
-        // Echoing the message...
-        bytes_sent = send(client->client_fd, message, bytes_recv, 0);
-        if (bytes_sent != bytes_recv)
+        // A thread (or green thread) of its own, only the handling is measured
+        if (!echo_message(client->client_fd, message, bytes_recv, client_name, metrics_now_ns()))
         {
-            perror("Failed to echo message");
-            pthread_exit(NULL);
+            return;
         }
     }
+}
+
+void *handle_client(void *client_data)
+{
+    char client_name[NET_ADDRESS_SIZE] = {0};
+    client_t *client = (client_t *)client_data;
+
+    // First, register a cleanup function to release the client's allocated data.
+    // Eliminating the risk of a memory leak
+    pthread_cleanup_push((void (*)(void *))release_connection, NULL); // will be called last
+    pthread_cleanup_push((void (*)(void *))metrics_disconnected, NULL);
+    pthread_cleanup_push(free, client);
+    pthread_cleanup_push(close, (void *)client->client_fd); // will be called first
+
+    // Pinned when placing the threads, the clients take the CPUs round-robin
+    affinity_apply(AFFINITY_NEXT);
+
+    // Print client information
+    net_format_address(&client->client_address, client_name, sizeof(client_name));
+    printf("A client connected from: %s! handling thread: 0x%lx\n", client_name, pthread_self());
+
+    serve_client(client, client_name);
 
     // Cleanup
     pthread_cleanup_pop(true);
     pthread_cleanup_pop(true);
+    pthread_cleanup_pop(true);
+    pthread_cleanup_pop(true);
     // Exiting the thread
     printf("Exiting thread: 0x%lx\n", pthread_self());
     pthread_exit(NULL);
 }
 
-int main()
+void close_connection(connection_t *connection, const char *client_name)
+{
+    printf("client %s disconnected.\n", client_name);
+    close(connection->client.client_fd);
+    free(connection);
+    metrics_disconnected();
+    release_connection();
+}
+
+// Waits for the next message, the connection is scheduled again when the socket is readable
+void rearm_connection(connection_t *connection)
+{
+    struct epoll_event event = {0};
+
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.ptr = connection;
+    if (0 != epoll_ctl(connection->epoll_fd, EPOLL_CTL_MOD, connection->client.client_fd, &event))
+    {
+        perror("Failed to rearm the connection");
+        exit(errno);
+    }
+}
+
+// A connection's work item: echoes what it has read, up to CONNECTION_BUDGET messages.
+// EPOLLONESHOT makes sure a connection runs on a single worker at a time.
+void run_connection(task_t *task)
+{
+    connection_t *connection = (connection_t *)task;
+    char message[MAX_MESSAGE_SIZE] = {0};
+    char client_name[NET_ADDRESS_SIZE] = {0};
+    int bytes_recv = 0;
+
+    net_format_address(&connection->client.client_address, client_name, sizeof(client_name));
+    for(int i=0; i < CONNECTION_BUDGET; i++)
+    {
+        bytes_recv = recv(connection->client.client_fd, message, sizeof(message), MSG_DONTWAIT);
+        if (-1 == bytes_recv && (EAGAIN == errno || EWOULDBLOCK == errno))
+        {
+            rearm_connection(connection);
+            return;
+        }
+        if (-1 == bytes_recv)
+        {
+            perror("recv failed");
+            close_connection(connection, client_name);
+            return;
+        }
+        if (0 == bytes_recv)
+        {
+            // Connection probably closed...
+            close_connection(connection, client_name);
+            return;
+        }
+
+        // Measured since the socket became readable, the time queued for a worker included
+        if (!echo_message(connection->client.client_fd, message, bytes_recv, client_name, connection->ready_ns))
+        {
+            close_connection(connection, client_name);
+            return;
+        }
+    }
+
+    // A busy client yields behind the queued connections, the ones on this worker's deque and the injected ones
+    scheduler_yield(&scheduler, task);
+}
+
+void accept_connection(int server_fd, int epoll_fd)
+{
+    struct epoll_event event = {0};
+    socklen_t client_address_size = sizeof(struct sockaddr_storage);
+    char client_name[NET_ADDRESS_SIZE] = {0};
+    connection_t *connection = calloc(1, sizeof(*connection));
+
+    if (NULL == connection)
+    {
+        perror("calloc failed");
+        exit(errno);
+    }
+
+    connection->client.client_fd = accept4(server_fd, (struct sockaddr *)&connection->client.client_address,
+                                           &client_address_size, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (0 >= connection->client.client_fd)
+    {
+        free(connection);
+        return;
+    }
+    if (!overload_admit(&overload))
+    {
+        overload_shed(&overload, connection->client.client_fd);
+        free(connection);
+        return;
+    }
+    if (!admit_connection())
+    {
+        close(connection->client.client_fd);
+        free(connection);
+        return;
+    }
+    metrics_accepted();
+    net_accepted(connection->client.client_fd);
+    printf("A client connected from: %s! scheduled on %d workers\n",
+           net_format_address(&connection->client.client_address, client_name, sizeof(client_name)), scheduler.worker_count);
+
+    connection->task.run = run_connection;
+    connection->epoll_fd = epoll_fd;
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.ptr = connection;
+    if (0 != epoll_ctl(epoll_fd, EPOLL_CTL_ADD, connection->client.client_fd, &event))
+    {
+        perror("Failed to watch the connection");
+        exit(errno);
+    }
+}
+
+// Hot upgrade: the successor took the listeners and accepts from now on. The clients have no state a
+// successor could take (it's on their threads' stacks), so they're served here until they leave.
+void drain()
+{
+    printf("Serving %ld clients until they leave\n", __atomic_load_n(&metrics.connections, __ATOMIC_RELAXED));
+    while (0 < __atomic_load_n(&metrics.connections, __ATOMIC_RELAXED))
+    {
+        usleep(DRAIN_INTERVAL * 1000);
+    }
+    printf("Drained, exiting\n");
+    exit(0);
+}
+
+// Work-stealing mode: this thread only accepts and waits for readable sockets, the workers read and echo.
+// Bursts on many connections spread over the workers without a thread per client.
+void run_scheduled(int server_fd, int workers)
+{
+    struct epoll_event events[MAX_EVENTS];
+    struct epoll_event event = {0};
+    static char drain_event;            // its address tells the upgrade apart from the listener and connections
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    int events_count = 0;
+    bool draining = false;
+
+    if (-1 == epoll_fd)
+    {
+        perror("epoll_create1 failed");
+        exit(errno);
+    }
+
+    // The listener's data is NULL, the connections' data is their connection_t
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (0 != epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &event))
+    {
+        perror("Failed to watch the server socket");
+        exit(errno);
+    }
+    event.data.ptr = &drain_event;
+    if (-1 != handoff_drain_fd() && 0 != epoll_ctl(epoll_fd, EPOLL_CTL_ADD, handoff_drain_fd(), &event))
+    {
+        perror("Failed to watch the upgrade");
+        exit(errno);
+    }
+
+    scheduler_init(&scheduler, 0 < workers ? workers : affinity_cpu_count());
+    printf("Scheduling connections on %d workers\n", scheduler.worker_count);
+    setup_budget(sizeof(connection_t));
+
+    while (true)
+    {
+        // After a hot upgrade only the clients are served, until they leave
+        if (draining && 0 >= __atomic_load_n(&metrics.connections, __ATOMIC_RELAXED))
+        {
+            printf("Drained, exiting\n");
+            exit(0);
+        }
+
+        events_count = epoll_wait(epoll_fd, events, MAX_EVENTS, draining ? DRAIN_INTERVAL : -1);
+        if (-1 == events_count)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            perror("epoll_wait failed");
+            exit(errno);
+        }
+
+        for(int i=0; i < events_count; i++)
+        {
+            if (NULL == events[i].data.ptr)
+            {
+                accept_connection(server_fd, epoll_fd);
+                continue;
+            }
+            if (&drain_event == events[i].data.ptr)
+            {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, server_fd, NULL);
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, handoff_drain_fd(), NULL);
+                draining = true;
+                printf("Serving %ld clients until they leave\n",
+                       __atomic_load_n(&metrics.connections, __ATOMIC_RELAXED));
+                continue;
+            }
+            ((connection_t *)events[i].data.ptr)->ready_ns = metrics_now_ns();
+            scheduler_submit(&scheduler, (task_t *)events[i].data.ptr);
+        }
+    }
+}
+
+// A green thread's entry, the same handler as a thread per client
+void handle_green_client(void *client_data)
+{
+    char client_name[NET_ADDRESS_SIZE] = {0};
+    client_t *client = (client_t *)client_data;
+
+    net_format_address(&client->client_address, client_name, sizeof(client_name));
+    printf("A client connected from: %s! handling carrier: %d\n", client_name, fiber_current()->carrier->index);
+
+    serve_client(client, client_name);
+
+    close(client->client_fd);
+    free(client);
+    metrics_disconnected();
+    release_connection();
+}
+
+// Green thread mode: this thread only accepts, every client gets a fiber with a small stack on one of the
+// carriers. A fiber blocked on its socket parks on the carrier's epoll, so a few OS threads serve every client.
+void run_green(int server_fd, int carriers, size_t stack_size)
 {
-    int server_fd = 0;
     client_t *client = NULL;
     socklen_t client_address_size = sizeof(client->client_address);
+
+    fiber_runtime_init(&runtime, 0 < carriers ? carriers : affinity_cpu_count(), stack_size);
+    printf("Running clients on green threads over %d carriers (%zuKB stacks)\n",
+           runtime.carrier_count, runtime.stack_size / 1024);
+    setup_budget(runtime.stack_size + sysconf(_SC_PAGESIZE) + sizeof(fiber_t) + sizeof(client_t));
+
+    while (handoff_wait_accept(server_fd))
+    {
+        client = malloc(sizeof(*client));
+        if (NULL == client)
+        {
+            perror("malloc failed");
+            exit(errno);
+        }
+
+        // Non-blocking, the green threads wait on their carrier's reactor instead
+        client->client_fd = accept4(server_fd, (struct sockaddr *)&client->client_address,
+                                    &client_address_size, SOCK_CLOEXEC | SOCK_NONBLOCK);
+        if (0 >= client->client_fd)
+        {
+            free(client);
+            continue;
+        }
+        if (!overload_admit(&overload))
+        {
+            overload_shed(&overload, client->client_fd);
+            free(client);
+            continue;
+        }
+        if (!admit_connection())
+        {
+            close(client->client_fd);
+            free(client);
+            continue;
+        }
+        metrics_accepted();
+        net_accepted(client->client_fd);
+        fiber_spawn(&runtime, handle_green_client, client);
+    }
+    drain();
+}
+
+int main(int argc, char *argv[])
+{
+    int server_fd = NO_SOCKET;
+    int admin_fd = NO_SOCKET;
+    int option = 0;
+    int workers = -1;
+    int carriers = -1;
+    size_t stack_size = 0;
+    char *profile = NULL;
+    char *placement = NULL;
+    char *slo = NULL;
+    char *address = NULL;
+    char *admin_address = NULL;
+    char *upgrade_path = NULL;
+    client_t *client = NULL;
+    socklen_t client_address_size = sizeof(client->client_address);
+    pthread_attr_t attributes;
+    size_t guard_size = sysconf(_SC_PAGESIZE);
     pthread_t tid;
 
-    // Setup the server (socket, bind, listen)
-    server_fd = setup_server();
+    metrics_init("threaded_echo");
 
-    // Keep the server running to accept new clients
-    while (true)
+    while (-1 != (option = getopt(argc, argv, "a:w:g:s:m:A:L:u:P:B:")))
+    {
+        switch (option)
+        {
+        case 'a':
+            // Optional admin listener, served by its own thread like every client
+            admin_address = optarg;
+            break;
+        case 'w':
+            workers = atoi(optarg);
+            break;
+        case 'g':
+            carriers = atoi(optarg);
+            break;
+        case 's':
+            stack_size = strtoul(optarg, NULL, 10) * 1024;
+            break;
+        case 'm':
+            budget.limit = strtoul(optarg, NULL, 10) * 1024 * 1024;
+            break;
+        case 'A':
+            placement = optarg;
+            break;
+        case 'L':
+            slo = optarg;
+            break;
+        case 'u':
+            upgrade_path = optarg;
+            break;
+        case 'P':
+            profile = optarg;
+            break;
+        case 'B':
+            address = optarg;
+            break;
+        default:
+            fprintf(stderr, USAGE, argv[0]);
+            fputs(AFFINITY_USAGE, stderr);
+            fputs(OVERLOAD_USAGE, stderr);
+            fputs(NET_PROFILE_USAGE, stderr);
+            return -1;
+        }
+    }
+
+    // Before any worker, carrier or client thread starts, they inherit the allowed CPUs
+    affinity_configure(placement);
+    overload_configure(&overload, slo);
+
+    net_configure(profile, address);
+    if (NULL != upgrade_path)
+    {
+        handoff_take_listeners(upgrade_path, &server_fd, &admin_fd);
+    }
+    if (NO_SOCKET == server_fd)
+    {
+        // Setup the server (socket, bind, listen)
+        server_fd = net_listen(SERVER_PORT);
+    }
+    if (NO_SOCKET == admin_fd && NULL != admin_address)
+    {
+        admin_fd = metrics_setup_admin(admin_address);
+    }
+    if (NO_SOCKET != admin_fd)
+    {
+        metrics_start_admin_thread(admin_fd);
+    }
+    if (NULL != upgrade_path)
+    {
+        handoff_listeners_in_background(upgrade_path, server_fd, admin_fd);
+    }
+
+    if (0 <= workers)
+    {
+        run_scheduled(server_fd, workers);
+    }
+    if (0 <= carriers)
+    {
+        run_green(server_fd, carriers, stack_size);
+    }
+
+    // A thread per client: its stack is reserved virtual memory (8MB by default, the stack ulimit), only the
+    // touched pages are resident. A smaller stack lets many more threads fit, the guard page below it faults
+    // on an overflow instead of corrupting the neighbouring stack.
+    errno = pthread_attr_init(&attributes);
+    if (0 == errno && 0 != stack_size)
+    {
+        errno = pthread_attr_setstacksize(&attributes, stack_size);
+    }
+    if (0 == errno)
+    {
+        errno = pthread_attr_setguardsize(&attributes, guard_size);
+    }
+    if (0 == errno)
+    {
+        errno = pthread_attr_getstacksize(&attributes, &stack_size);
+    }
+    if (0 != errno)
+    {
+        perror("Invalid thread stack size");
+        exit(errno);
+    }
+    printf("Running a thread per client (%zuKB stacks, %zuKB guard)\n", stack_size / 1024, guard_size / 1024);
+    setup_budget(stack_size + guard_size + sizeof(client_t));
+
+    // Keep the server running to accept new clients, until a hot upgrade
+    while (handoff_wait_accept(server_fd))
     {
         // Allocate memory for client data
         client = malloc(sizeof(*client));
@@ -109,10 +611,33 @@ int main()
         // Accept a client
         client->client_fd = accept4(server_fd, (struct sockaddr *)&client->client_address,
                                     &client_address_size, SOCK_CLOEXEC);
-        if (0 < client->client_fd)
+        if (0 < client->client_fd && !overload_admit(&overload))
+        {
+            overload_shed(&overload, client->client_fd);
+            free(client);
+        }
+        else if (0 < client->client_fd && !admit_connection())
+        {
+            close(client->client_fd);
+            free(client);
+        }
+        else if (0 < client->client_fd)
         {
+            metrics_accepted();
+            net_accepted(client->client_fd);
+
             // Creates a new thread to handle the client
-            errno = pthread_create(&tid, NULL, handle_client, (void *)client);
+            errno = pthread_create(&tid, &attributes, handle_client, (void *)client);
+            if (EAGAIN == errno)
+            {
+                // Out of memory for another stack (or of threads), the server keeps serving the others
+                perror("Failed to create a client's thread");
+                close(client->client_fd);
+                free(client);
+                metrics_disconnected();
+                release_connection();
+                continue;
+            }
             if (0 != errno)
             {
                 perror("Error while creating thread 1");
@@ -136,50 +661,7 @@ int main()
         }
     }
 
-    free(client);
-    close(server_fd);
+    pthread_attr_destroy(&attributes);
+    drain();
     return 0;
 }
-
-
-int setup_server()
-{
-    struct sockaddr_in server_address = {0};
-    int server_fd = 0;
-
-    // Creates the server socket
-    server_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
-    if (-1 == server_fd) {
-        perror("Failed to create server socket");
-        exit(errno);
-    }
-
-    // Sets socket option SO_REUSEADDR, other processes will be able to listen on this port
-    // (enables quick restart of the server)
-    int enabled = 1;
-    if (0 != setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &enabled, sizeof(enabled)))
-    {
-        perror("Failed to set SO_REUSEADDR");
-        exit(errno);
-    }
-
-    // Construct the server's data struct
-    server_address.sin_family = AF_INET;
-    server_address.sin_addr.s_addr = inet_addr(SERVER_INTERFACE);
-    server_address.sin_port = htons(SERVER_PORT);
-
-    // Bind server socket to the network interface
-    if (0 != bind(server_fd, (struct sockaddr *)&server_address, sizeof(server_address))) {
-        perror("Failed to bind");
-        exit(errno);
-    }
-
-    // Listen for incoming clients
-    if (0 != listen(server_fd, 0)) {
-        perror("Failed to listen");
-        exit(errno);
-    }
-
-    printf("Listening for incoming connections on %s:%d...\n", SERVER_INTERFACE, SERVER_PORT);
-    return server_fd;
-}
@@ -0,0 +1,680 @@
+/**
+ ** Written by Amit Sides
+ **/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+
+#include "scheduler.h"
+
+#define DEFAULT_ITERATIONS      (100000)    // per thread, the create/join benchmark does a tenth of that
+#define MAX_THREADS             (256)
+#define CACHE_LINE_SIZE         (64)
+#define BURST_MAX               (64)        // work items of a simulated connection's burst
+#define WORK_ITEM_NS            (1000)      // the cost of a work item (reading and echoing a message)
+
+#define USAGE ("Usage: %s [-b <benchmark>] [-t <threads>] [-i <iterations>] [-p] [-C]\n" \
+               "  -b  only run one of: create, switch, condvar, lock, sharing, scheduler\n" \
+               "  -t  threads of the contention and scheduler benchmarks (default: the online CPUs, at least 2)\n" \
+               "  -p  pin the ping-pong threads to a single CPU, so every handoff is a context switch\n" \
+               "  -C  print CSV rows, to compare kernels and hosts\n")
+
+typedef struct options_s {
+    const char *only;
+    int threads;
+    long iterations;
+    bool pin;
+    bool csv;
+} options_t;
+
+typedef struct lock_ops_s {
+    const char *name;
+    void (*init)();
+    void (*lock)();
+    void (*unlock)();
+} lock_ops_t;
+
+typedef struct padded_counter_s {
+    volatile uint64_t value;
+} __attribute__((aligned(CACHE_LINE_SIZE))) padded_counter_t;
+
+// A worker of the contention and sharing benchmarks
+typedef struct worker_s {
+    pthread_t tid;
+    int index;
+    long iterations;
+    void *context;
+    uint64_t start_ns;
+    uint64_t end_ns;
+} worker_t;
+
+// Ping-pong between two threads
+typedef struct ping_pong_s {
+    int pipes[2][2];                    // [0] main -> partner, [1] partner -> main
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int turn;                           // 0 while main runs, 1 while the partner runs
+    long iterations;
+    bool pin;
+} ping_pong_t;
+
+// A connection of the scheduler benchmark, a burst of work items that yields after every item
+typedef struct burst_s {
+    task_t task;
+    int remaining;
+} burst_t;
+
+options_t options = {NULL, 0, DEFAULT_ITERATIONS, false, false};
+struct utsname host = {0};
+pthread_barrier_t start_barrier;
+
+// The locks compete over this counter
+pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_spinlock_t spinlock;
+uint32_t futex_word = 0;                // 0 unlocked, 1 locked, 2 locked with waiters
+uint32_t ttas_word = 0;
+volatile uint64_t shared_counter = 0;
+uint64_t atomic_counter = 0;
+
+uint64_t packed_counters[MAX_THREADS] = {0};
+padded_counter_t padded_counters[MAX_THREADS];
+
+uint64_t now_ns()
+{
+    struct timespec now = {0};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+void report(const char *benchmark, const char *variant, int threads, long operations, uint64_t elapsed_ns)
+{
+    double ns_per_op = (double)elapsed_ns / operations;
+
+    if (options.csv)
+    {
+        printf("%s,%s,%ld,%s,%s,%d,%ld,%.1f,%.0f\n", host.nodename, host.release, sysconf(_SC_NPROCESSORS_ONLN),
+               benchmark, variant, threads, operations, ns_per_op, 1e9 / ns_per_op);
+        return;
+    }
+    printf("%-10s %-22s %4d threads %12.1f ns/op %14.0f ops/sec\n", benchmark, variant, threads, ns_per_op, 1e9 / ns_per_op);
+}
+
+bool should_run(const char *benchmark)
+{
+    return NULL == options.only || 0 == strcmp(options.only, benchmark);
+}
+
+void create_thread(pthread_t *tid, void *(*routine)(void *), void *argument)
+{
+    errno = pthread_create(tid, NULL, routine, argument);
+    if (0 != errno)
+    {
+        perror("Error while creating a thread");
+        exit(errno);
+    }
+}
+
+void join_thread(pthread_t tid)
+{
+    errno = pthread_join(tid, NULL);
+    if (0 != errno)
+    {
+        perror("Error while waiting a thread");
+        exit(errno);
+    }
+}
+
+void pin_to_cpu(int cpu)
+{
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    errno = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (0 != errno)
+    {
+        perror("Failed to pin the thread");
+        exit(errno);
+    }
+}
+
+// Workers wait for each other before starting the clock, thread creation isn't measured
+void worker_begin(worker_t *worker)
+{
+    pthread_barrier_wait(&start_barrier);
+    worker->start_ns = now_ns();
+}
+
+void worker_end(worker_t *worker)
+{
+    worker->end_ns = now_ns();
+}
+
+// Runs routine on the workers started together, returns the time from the first start to the last end.
+// The workers keep their own time: with fewer CPUs than threads, they may finish before main runs again.
+uint64_t run_workers(int threads, void *(*routine)(void *), void *context)
+{
+    worker_t workers[MAX_THREADS];
+    uint64_t start = UINT64_MAX;
+    uint64_t end = 0;
+
+    pthread_barrier_init(&start_barrier, NULL, threads + 1);
+    for(int i=0; i < threads; i++)
+    {
+        workers[i].index = i;
+        workers[i].iterations = options.iterations;
+        workers[i].context = context;
+        create_thread(&workers[i].tid, routine, &workers[i]);
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    for(int i=0; i < threads; i++)
+    {
+        join_thread(workers[i].tid);
+        start = workers[i].start_ns < start ? workers[i].start_ns : start;
+        end = workers[i].end_ns > end ? workers[i].end_ns : end;
+    }
+    pthread_barrier_destroy(&start_barrier);
+    return end - start;
+}
+
+void *empty_thread(void *argument)
+{
+    return NULL;
+}
+
+// The cost of a thread per connection, paid on every accept
+void bench_create_join()
+{
+    long iterations = options.iterations / 10;
+    uint64_t start = now_ns();
+    pthread_t tid;
+
+    for(long i=0; i < iterations; i++)
+    {
+        create_thread(&tid, empty_thread, NULL);
+        join_thread(tid);
+    }
+    report("create", "pthread_create+join", 1, iterations, now_ns() - start);
+}
+
+void *pipe_partner(void *argument)
+{
+    ping_pong_t *ping_pong = argument;
+    char token = 0;
+
+    if (ping_pong->pin)
+    {
+        pin_to_cpu(0);
+    }
+    for(long i=0; i < ping_pong->iterations; i++)
+    {
+        if (1 != read(ping_pong->pipes[0][0], &token, 1) || 1 != write(ping_pong->pipes[1][1], &token, 1))
+        {
+            perror("Partner ping-pong failed");
+            exit(errno);
+        }
+    }
+    return NULL;
+}
+
+// A byte bounces between two threads over pipes, every round trip blocks and wakes each side once
+void bench_context_switch()
+{
+    ping_pong_t ping_pong = {0};
+    pthread_t partner;
+    uint64_t start = 0;
+    char token = 'x';
+
+    ping_pong.iterations = options.iterations;
+    ping_pong.pin = options.pin;
+    if (0 != pipe(ping_pong.pipes[0]) || 0 != pipe(ping_pong.pipes[1]))
+    {
+        perror("pipe failed");
+        exit(errno);
+    }
+    if (options.pin)
+    {
+        pin_to_cpu(0);
+    }
+
+    create_thread(&partner, pipe_partner, &ping_pong);
+    start = now_ns();
+    for(long i=0; i < ping_pong.iterations; i++)
+    {
+        if (1 != write(ping_pong.pipes[0][1], &token, 1) || 1 != read(ping_pong.pipes[1][0], &token, 1))
+        {
+            perror("Ping-pong failed");
+            exit(errno);
+        }
+    }
+    // Two switches per round trip
+    report("switch", options.pin ? "pipe ping-pong pinned" : "pipe ping-pong", 2, ping_pong.iterations * 2, now_ns() - start);
+    join_thread(partner);
+
+    for(int i=0; i < 2; i++)
+    {
+        close(ping_pong.pipes[i][0]);
+        close(ping_pong.pipes[i][1]);
+    }
+}
+
+void wait_turn(ping_pong_t *ping_pong, int turn)
+{
+    pthread_mutex_lock(&ping_pong->mutex);
+    while (ping_pong->turn != turn)
+    {
+        pthread_cond_wait(&ping_pong->cond, &ping_pong->mutex);
+    }
+    pthread_mutex_unlock(&ping_pong->mutex);
+}
+
+void pass_turn(ping_pong_t *ping_pong, int turn)
+{
+    pthread_mutex_lock(&ping_pong->mutex);
+    ping_pong->turn = turn;
+    pthread_cond_signal(&ping_pong->cond);
+    pthread_mutex_unlock(&ping_pong->mutex);
+}
+
+void *cond_partner(void *argument)
+{
+    ping_pong_t *ping_pong = argument;
+
+    if (ping_pong->pin)
+    {
+        pin_to_cpu(0);
+    }
+    for(long i=0; i < ping_pong->iterations; i++)
+    {
+        wait_turn(ping_pong, 1);
+        pass_turn(ping_pong, 0);
+    }
+    return NULL;
+}
+
+// Handing work to a sleeping thread, like a producer waking a worker pool
+void bench_condvar()
+{
+    ping_pong_t ping_pong = {0};
+    pthread_t partner;
+    uint64_t start = 0;
+
+    ping_pong.iterations = options.iterations;
+    ping_pong.pin = options.pin;
+    pthread_mutex_init(&ping_pong.mutex, NULL);
+    pthread_cond_init(&ping_pong.cond, NULL);
+    if (options.pin)
+    {
+        pin_to_cpu(0);
+    }
+
+    create_thread(&partner, cond_partner, &ping_pong);
+    start = now_ns();
+    for(long i=0; i < ping_pong.iterations; i++)
+    {
+        pass_turn(&ping_pong, 1);
+        wait_turn(&ping_pong, 0);
+    }
+    report("condvar", options.pin ? "handoff pinned" : "handoff", 2, ping_pong.iterations * 2, now_ns() - start);
+    join_thread(partner);
+
+    pthread_cond_destroy(&ping_pong.cond);
+    pthread_mutex_destroy(&ping_pong.mutex);
+}
+
+void mutex_init() {}
+void mutex_lock() { pthread_mutex_lock(&mutex); }
+void mutex_unlock() { pthread_mutex_unlock(&mutex); }
+
+void spin_init() { pthread_spin_init(&spinlock, PTHREAD_PROCESS_PRIVATE); }
+void spin_lock() { pthread_spin_lock(&spinlock); }
+void spin_unlock() { pthread_spin_unlock(&spinlock); }
+
+void ttas_init() { ttas_word = 0; }
+
+// Test and test-and-set: spins on a read, so waiters don't bounce the cache line while the lock is held
+void ttas_lock()
+{
+    while (0 != __atomic_exchange_n(&ttas_word, 1, __ATOMIC_ACQUIRE))
+    {
+        while (0 != __atomic_load_n(&ttas_word, __ATOMIC_RELAXED))
+        {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#endif
+        }
+    }
+}
+
+void ttas_unlock() { __atomic_store_n(&ttas_word, 0, __ATOMIC_RELEASE); }
+
+long futex(uint32_t *word, int operation, uint32_t value)
+{
+    return syscall(SYS_futex, word, operation, value, NULL, NULL, 0);
+}
+
+void futex_init() { futex_word = 0; }
+
+// Drepper's "Futexes Are Tricky" mutex: the uncontended paths never enter the kernel
+void futex_lock()
+{
+    uint32_t state = 0;
+
+    if (__atomic_compare_exchange_n(&futex_word, &state, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+    if (2 != state)
+    {
+        state = __atomic_exchange_n(&futex_word, 2, __ATOMIC_ACQUIRE);
+    }
+    while (0 != state)
+    {
+        futex(&futex_word, FUTEX_WAIT_PRIVATE, 2);
+        state = __atomic_exchange_n(&futex_word, 2, __ATOMIC_ACQUIRE);
+    }
+}
+
+void futex_unlock()
+{
+    if (1 != __atomic_fetch_sub(&futex_word, 1, __ATOMIC_RELEASE))
+    {
+        // There are waiters
+        __atomic_store_n(&futex_word, 0, __ATOMIC_RELEASE);
+        futex(&futex_word, FUTEX_WAKE_PRIVATE, 1);
+    }
+}
+
+lock_ops_t locks[] = {
+    {"pthread_mutex", mutex_init, mutex_lock, mutex_unlock},
+    {"pthread_spin", spin_init, spin_lock, spin_unlock},
+    {"ttas spinlock", ttas_init, ttas_lock, ttas_unlock},
+    {"futex mutex", futex_init, futex_lock, futex_unlock},
+};
+
+void *lock_worker(void *argument)
+{
+    worker_t *worker = argument;
+    lock_ops_t *lock = worker->context;
+
+    worker_begin(worker);
+    for(long i=0; i < worker->iterations; i++)
+    {
+        lock->lock();
+        shared_counter++;
+        lock->unlock();
+    }
+    worker_end(worker);
+    return NULL;
+}
+
+void *atomic_worker(void *argument)
+{
+    worker_t *worker = argument;
+
+    worker_begin(worker);
+    for(long i=0; i < worker->iterations; i++)
+    {
+        __atomic_fetch_add(&atomic_counter, 1, __ATOMIC_RELAXED);
+    }
+    worker_end(worker);
+    return NULL;
+}
+
+void check_counter(const char *variant, uint64_t counter, int threads)
+{
+    if (counter != (uint64_t)threads * options.iterations)
+    {
+        fprintf(stderr, "Error: %s lost updates (%lu of %lu)\n", variant, counter, (uint64_t)threads * options.iterations);
+        exit(-1);
+    }
+}
+
+// 1, 2, 4... and finally all the threads
+int next_thread_count(int threads)
+{
+    if (threads == options.threads)
+    {
+        return threads + 1;
+    }
+    return threads * 2 < options.threads ? threads * 2 : options.threads;
+}
+
+// Every thread increments the same counter, like the servers' shared state under a lock
+void bench_locks()
+{
+    for(int threads=1; threads <= options.threads; threads = next_thread_count(threads))
+    {
+        for(int i=0; i < sizeof(locks) / sizeof(*locks); i++)
+        {
+            uint64_t elapsed = 0;
+
+            locks[i].init();
+            shared_counter = 0;
+            elapsed = run_workers(threads, lock_worker, &locks[i]);
+            check_counter(locks[i].name, shared_counter, threads);
+            report("lock", locks[i].name, threads, threads * options.iterations, elapsed);
+        }
+
+        atomic_counter = 0;
+        report("lock", "atomic fetch_add", threads, threads * options.iterations,
+               run_workers(threads, atomic_worker, NULL));
+        check_counter("atomic fetch_add", atomic_counter, threads);
+    }
+}
+
+void *packed_worker(void *argument)
+{
+    worker_t *worker = argument;
+    volatile uint64_t *counter = &packed_counters[worker->index];
+
+    worker_begin(worker);
+    for(long i=0; i < worker->iterations; i++)
+    {
+        (*counter)++;
+    }
+    worker_end(worker);
+    return NULL;
+}
+
+void *padded_worker(void *argument)
+{
+    worker_t *worker = argument;
+    padded_counter_t *counter = &padded_counters[worker->index];
+
+    worker_begin(worker);
+    for(long i=0; i < worker->iterations; i++)
+    {
+        counter->value++;
+    }
+    worker_end(worker);
+    return NULL;
+}
+
+// Every thread increments its own counter. Packed counters share cache lines, so the cores keep
+// stealing the line from each other although no data is shared (like per-thread metrics in an array).
+void bench_false_sharing()
+{
+    long operations = (long)options.threads * options.iterations;
+
+    memset(packed_counters, 0, sizeof(packed_counters));
+    report("sharing", "packed counters", options.threads, operations,
+           run_workers(options.threads, packed_worker, NULL));
+
+    memset(padded_counters, 0, sizeof(padded_counters));
+    report("sharing", "padded counters", options.threads, operations,
+           run_workers(options.threads, padded_worker, NULL));
+}
+
+scheduler_t scheduler;
+int bursts_remaining = 0;
+pthread_mutex_t bursts_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t bursts_done = PTHREAD_COND_INITIALIZER;
+
+void run_burst(task_t *task)
+{
+    burst_t *burst = (burst_t *)task;
+    uint64_t start = now_ns();
+
+    while (now_ns() - start < WORK_ITEM_NS);
+
+    if (0 < --burst->remaining)
+    {
+        // Yields, like a connection that used its budget
+        scheduler_yield(&scheduler, task);
+        return;
+    }
+
+    if (1 == __atomic_fetch_sub(&bursts_remaining, 1, __ATOMIC_ACQ_REL))
+    {
+        pthread_mutex_lock(&bursts_lock);
+        pthread_cond_signal(&bursts_done);
+        pthread_mutex_unlock(&bursts_lock);
+    }
+}
+
+// Connections with random bursts of work are submitted from a single thread, like the echo server's
+// epoll thread, and the workers balance them by stealing. Scales from 1 worker to all the threads.
+void bench_scheduler()
+{
+    // At least one connection, every connection has at least one item
+    int connections = 100 <= options.iterations ? options.iterations / 100 : 1;
+    burst_t *bursts = calloc(connections, sizeof(*bursts));
+    long items = 0;
+    double single_worker_ns = 0;
+
+    if (NULL == bursts)
+    {
+        perror("calloc failed");
+        exit(errno);
+    }
+
+    for(int workers=1; workers <= options.threads; workers = next_thread_count(workers))
+    {
+        uint64_t start = 0;
+        uint64_t elapsed = 0;
+        uint64_t stolen = 0;
+        char variant[64] = {0};
+
+        srand(1);
+        items = 0;
+        scheduler_init(&scheduler, workers);
+        bursts_remaining = connections;
+
+        start = now_ns();
+        for(int i=0; i < connections; i++)
+        {
+            bursts[i].task.run = run_burst;
+            bursts[i].remaining = 1 + rand() % BURST_MAX;
+            items += bursts[i].remaining;
+            scheduler_submit(&scheduler, &bursts[i].task);
+        }
+        pthread_mutex_lock(&bursts_lock);
+        while (0 != __atomic_load_n(&bursts_remaining, __ATOMIC_ACQUIRE))
+        {
+            pthread_cond_wait(&bursts_done, &bursts_lock);
+        }
+        pthread_mutex_unlock(&bursts_lock);
+        elapsed = now_ns() - start;
+
+        for(int i=0; i < workers; i++)
+        {
+            stolen += scheduler.workers[i].stolen;
+        }
+        scheduler_stop(&scheduler);
+
+        if (1 == workers)
+        {
+            single_worker_ns = elapsed;
+        }
+        snprintf(variant, sizeof(variant), "work-stealing x%.2f %lu%% stolen", single_worker_ns / elapsed, stolen * 100 / items);
+        report("scheduler", variant, workers, items, elapsed);
+    }
+    free(bursts);
+}
+
+int main(int argc, char *argv[])
+{
+    int option = 0;
+
+    while (-1 != (option = getopt(argc, argv, "b:t:i:pC")))
+    {
+        switch (option)
+        {
+        case 'b': options.only = optarg; break;
+        case 't': options.threads = atoi(optarg); break;
+        case 'i': options.iterations = atol(optarg); break;
+        case 'p': options.pin = true; break;
+        case 'C': options.csv = true; break;
+        default:
+            fprintf(stderr, USAGE, argv[0]);
+            return -1;
+        }
+    }
+
+    if (0 == options.threads)
+    {
+        options.threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (2 > options.threads)
+        {
+            options.threads = 2;
+        }
+    }
+    if (0 >= options.threads || MAX_THREADS < options.threads || 10 > options.iterations)
+    {
+        fprintf(stderr, USAGE, argv[0]);
+        return -1;
+    }
+
+    uname(&host);
+    if (options.csv)
+    {
+        printf("host,kernel,cpus,benchmark,variant,threads,operations,ns_per_op,ops_per_sec\n");
+    }
+    else
+    {
+        printf("%s, Linux %s, %ld CPUs\n", host.nodename, host.release, sysconf(_SC_NPROCESSORS_ONLN));
+    }
+
+    if (should_run("create"))
+    {
+        bench_create_join();
+    }
+    if (should_run("lock"))
+    {
+        bench_locks();
+    }
+    if (should_run("sharing"))
+    {
+        bench_false_sharing();
+    }
+    if (should_run("scheduler"))
+    {
+        bench_scheduler();
+    }
+    // Last, pinning moves the main thread to CPU 0
+    if (should_run("switch"))
+    {
+        bench_context_switch();
+    }
+    if (should_run("condvar"))
+    {
+        bench_condvar();
+    }
+    return 0;
+}